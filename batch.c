@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "batch.h"
+
+/* The conversion keeps its state in globals so the workers are processes
+ * rather than threads.  Everything is loaded before they are forked so
+ * they share the materials and printers.  Each worker takes the next job
+ * nobody has started, so a slow job doesn't hold up the ones after it,
+ * and a worker that dies is replaced while there are jobs left.
+ */
+
+typedef enum { NOT_STARTED = 0, RUNNING, SUCCEEDED, FAILED } job_status_t;
+
+typedef struct {
+    int next;
+    job_status_t status[];
+} pool_t;
+
+static char *
+log_fname(convert_t *c)
+{
+    const char *msf = convert_msf_fname(c);
+    char *fname = malloc(strlen(msf) + 10);
+
+    sprintf(fname, "%s.log", msf);
+    return fname;
+}
+
+static int
+redirect_output(const char *fname)
+{
+    int fd;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(fname);
+	return 0;
+    }
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    return 1;
+}
+
+static void
+worker(pool_t *pool, convert_t **jobs, int n_jobs)
+{
+    int i;
+
+    while ((i = __sync_fetch_and_add(&pool->next, 1)) < n_jobs) {
+	char *fname = log_fname(jobs[i]);
+
+	pool->status[i] = RUNNING;
+	if (redirect_output(fname) && convert_run(jobs[i]) > 0) pool->status[i] = SUCCEEDED;
+	else pool->status[i] = FAILED;
+	fflush(stdout);
+	fflush(stderr);
+	free(fname);
+    }
+    exit(0);
+}
+
+static int
+start_worker(pool_t *pool, convert_t **jobs, int n_jobs)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	return 0;
+    }
+    if (pid == 0) worker(pool, jobs, n_jobs);
+    return 1;
+}
+
+int
+batch_run(convert_t **jobs, int n_jobs, int n_workers)
+{
+    pool_t *pool;
+    size_t size = sizeof(*pool) + sizeof(pool->status[0]) * n_jobs;
+    int running = 0, failed = 0;
+    int i;
+
+    if (n_workers <= 0) n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers > n_jobs) n_workers = n_jobs;
+
+    if ((pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	perror("mmap");
+	return n_jobs;
+    }
+
+    printf("Converting %d jobs on %d workers\n", n_jobs, n_workers);
+    for (i = 0; i < n_workers; i++) running += start_worker(pool, jobs, n_jobs);
+
+    while (running > 0 && wait(NULL) > 0) {
+	running--;
+	if (pool->next < n_jobs) running += start_worker(pool, jobs, n_jobs);
+    }
+
+    for (i = 0; i < n_jobs; i++) {
+	char *fname = log_fname(jobs[i]);
+
+	if (pool->status[i] != SUCCEEDED) failed++;
+	printf("%-10s %s (%s)\n", pool->status[i] == SUCCEEDED ? "ok" : pool->status[i] == NOT_STARTED ? "not run" : "FAILED", convert_msf_fname(jobs[i]), fname);
+	free(fname);
+    }
+    printf("%d of %d jobs converted\n", n_jobs - failed, n_jobs);
+
+    munmap(pool, size);
+    return failed;
+}
@@ -0,0 +1,12 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "convert.h"
+
+/* Run the conversions on n_workers workers (0 for one per core).  The
+ * output of each job goes to its own log next to its msf.  Returns the
+ * number of jobs that failed.
+ */
+int batch_run(convert_t **jobs, int n_jobs, int n_workers);
+
+#endif
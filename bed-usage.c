@@ -27,6 +27,7 @@
 
 typedef struct {
     double	z;
+    int		object;
     int		n_used;
     unsigned char *used;
 } layer_t;
@@ -62,9 +63,12 @@ bed_usage_t *bed_usage_new(void)
 
 }
 
-void bed_usage_new_layer(bed_usage_t *b, double z)
+void bed_usage_new_layer(bed_usage_t *b, double z, int object)
 {
-    if (b->n_layers && b->cur->n_used == 0) return;
+    if (b->n_layers && b->cur->n_used == 0) {
+	b->cur->object = object;
+	return;
+    }
 
     if (b->n_layers >= b->a_layers) {
 	b->a_layers *= 2;
@@ -73,6 +77,7 @@ void bed_usage_new_layer(bed_usage_t *b, double z)
 
     b->cur = &b->l[b->n_layers++];
     b->cur->z = z;
+    b->cur->object = object;
     b->cur->n_used = 0;
     b->cur->used = calloc(sizeof(*b->cur->used), b->w * b->h);
 }
@@ -184,32 +189,81 @@ print_bed(bed_usage_t *b, unsigned char *used, FILE *f)
     }
 }
 
+static void
+expand(bed_usage_t *b, unsigned char *used, unsigned char *expanded, int r)
+{
+    int i, j, x, y;
+
+    for (i = 0; i < b->w; i++) {
+	for (j = 0; j < b->h; j++) {
+	    if (! CELL(b, used, i, j)) continue;
+	    for (x = i - r; x <= i + r; x++) {
+		for (y = j - r; y <= j + r; y++) {
+		    if (x >= 0 && y >= 0 && x < b->w && y < b->h) CELL(b, expanded, x, y) |= CELL(b, used, i, j);
+		}
+	    }
+	}
+    }
+}
+
 static unsigned char *
 get_usage_to_z(bed_usage_t *b, double z)
 {
     unsigned char *used, *expanded;
-    int i, j, k;
+    int i, j;
 
     used = calloc(sizeof(*used), b->w * b->h);
     expanded = calloc(sizeof(*expanded), b->w * b->h);
 
     for (i = 0; i < b->n_layers; i++) {
-	if (i == 0 || b->l[i].z <= z) {
+	if (i == 0 || b->l[i].z <= z || b->l[i].object != b->l[i-1].object) {
 	    for (j = 0; j < b->w * b->h; j++) used[j] |= b->l[i].used[j];
 	}
     }
 
-    for (i = 0; i < b->w; i++) {
-	for (j = 0; j < b->h; j++) {
-	    for (k = 0; k < 9; k++) {
-		int x = i + k % 3 - 1;
-		int y = j + k / 3 - 1;
-		if (x >= 0 && y >= 0 && x < b->w && y < b->h) CELL(b, expanded, i, j) |= CELL(b, used, x, y);
-	    }
+    expand(b, used, expanded, 1);
+
+    free(used);
+    return expanded;
+}
+
+/* For a sequential print: the object's own layers up to z only need the
+ * usual empty cell around them, everything else on the bed (the other
+ * objects at their full height and anything placed except the prime
+ * line) has to stay clear of the extruder by the clearance radius.
+ */
+
+static unsigned char *
+get_usage_in_sequence(bed_usage_t *b, double z, int object, double clearance)
+{
+    unsigned char *own, *others, *expanded;
+    int i, j;
+    int seen_own = 0;
+
+    own = calloc(sizeof(*own), b->w * b->h);
+    others = calloc(sizeof(*others), b->w * b->h);
+    expanded = calloc(sizeof(*expanded), b->w * b->h);
+
+    for (i = 0; i < b->n_layers; i++) {
+	int is_own = b->l[i].object == object;
+
+	for (j = 0; j < b->w * b->h; j++) {
+	    unsigned char c = b->l[i].used[j];
+
+	    if (! c) continue;
+	    if (c == USED && is_own && (b->l[i].z <= z || ! seen_own)) own[j] = c;
+	    else if (c == USED && ! is_own) others[j] = c;
+	    else if (c == 'P') own[j] = c;
+	    else if (c != USED) others[j] = c;
 	}
+	seen_own |= is_own;
     }
 
-    free(used);
+    expand(b, own, expanded, 1);
+    expand(b, others, expanded, fmax(ceil(clearance / CELL_SIZE), 1));
+
+    free(own);
+    free(others);
     return expanded;
 }
 
@@ -222,9 +276,9 @@ is_valid(int x, int y)
     return printer_is_valid(fixed_x, fixed_y);
 }
 
-int bed_usage_place_object(bed_usage_t *b, double w0, double h0, double to_z, double *x_res, double *y_res)
+static int
+place_object(bed_usage_t *b, unsigned char *l, double w0, double h0, int near_x, int near_y, double *x_res, double *y_res)
 {
-    unsigned char *l = get_usage_to_z(b, to_z);
     int w, h;
     int x, y, dx, dy;
     double best_d = NAN;
@@ -241,7 +295,7 @@ int bed_usage_place_object(bed_usage_t *b, double w0, double h0, double to_z, do
 		    if (! is_valid(x + dx, y+ dy) || CELL(b, l, x + dx, y + dy)) goto next_location;
 		}
 	    }
-	    this_d = sqrt((x + w/2 - b->w/2)*(x + w/2 - b->w/2) + (y + h/2 - b->h/2)*(y + h/2 - b->h/2));
+	    this_d = sqrt((x + w/2 - near_x)*(x + w/2 - near_x) + (y + h/2 - near_y)*(y + h/2 - near_y));
 	    if (! isfinite(best_d) || this_d < best_d) {
 		best_d = this_d;
 		*x_res = bed_xy_to_xy(x) + (w*CELL_SIZE - w0) / 2;
@@ -257,6 +311,21 @@ next_location:
     return isfinite(best_d);
 }
 
+int bed_usage_place_object(bed_usage_t *b, double w0, double h0, double to_z, double *x_res, double *y_res)
+{
+    return place_object(b, get_usage_to_z(b, to_z), w0, h0, b->w/2, b->h/2, x_res, y_res);
+}
+
+int bed_usage_place_object_near(bed_usage_t *b, double w0, double h0, double to_z, double x, double y, double *x_res, double *y_res)
+{
+    return place_object(b, get_usage_to_z(b, to_z), w0, h0, xy_to_bed_xy(x), xy_to_bed_xy(y), x_res, y_res);
+}
+
+int bed_usage_place_object_in_sequence(bed_usage_t *b, double w0, double h0, double to_z, int object, double clearance, double x, double y, double *x_res, double *y_res)
+{
+    return place_object(b, get_usage_in_sequence(b, to_z, object, clearance), w0, h0, xy_to_bed_xy(x), xy_to_bed_xy(y), x_res, y_res);
+}
+
 void bed_usage_add_object(bed_usage_t *b, double x0, double y0, double w0, double h0, char usage)
 {
     int x = xy_to_bed_xy(x0);
@@ -285,6 +354,57 @@ void bed_usage_print(bed_usage_t *b, FILE *f)
     print_bed(b, b->l[0].used, f);
 }
 
+/* The layers are written as they are, for the same printer to read back */
+
+int bed_usage_save(bed_usage_t *b, FILE *f)
+{
+    int i, ok;
+
+    ok = fwrite(&b->n_layers, sizeof(b->n_layers), 1, f) == 1 &&
+	 fwrite(&b->w, sizeof(b->w), 1, f) == 1 &&
+	 fwrite(&b->h, sizeof(b->h), 1, f) == 1;
+    for (i = 0; ok && i < b->n_layers; i++) {
+	layer_t *l = &b->l[i];
+
+	ok = fwrite(&l->z, sizeof(l->z), 1, f) == 1 &&
+	     fwrite(&l->object, sizeof(l->object), 1, f) == 1 &&
+	     fwrite(&l->n_used, sizeof(l->n_used), 1, f) == 1 &&
+	     fwrite(l->used, sizeof(*l->used), b->w * b->h, f) == b->w * b->h;
+    }
+
+    return ok;
+}
+
+bed_usage_t *bed_usage_load(FILE *f)
+{
+    bed_usage_t *b;
+    int n_layers, w, h;
+
+    if (fread(&n_layers, sizeof(n_layers), 1, f) != 1 || fread(&w, sizeof(w), 1, f) != 1 || fread(&h, sizeof(h), 1, f) != 1) return NULL;
+
+    b = bed_usage_new();
+    if (w != b->w || h != b->h) {
+	bed_usage_destroy(b);
+	return NULL;
+    }
+
+    while (b->n_layers < n_layers) {
+	layer_t l;
+
+	if (fread(&l.z, sizeof(l.z), 1, f) != 1 || fread(&l.object, sizeof(l.object), 1, f) != 1) break;
+	bed_usage_new_layer(b, l.z, l.object);
+	if (fread(&b->cur->n_used, sizeof(b->cur->n_used), 1, f) != 1) break;
+	if (fread(b->cur->used, sizeof(*b->cur->used), b->w * b->h, f) != b->w * b->h) break;
+    }
+
+    if (b->n_layers < n_layers) {
+	bed_usage_destroy(b);
+	return NULL;
+    }
+
+    return b;
+}
+
 void bed_usage_destroy(bed_usage_t *b)
 {
     free(b->l);
@@ -5,18 +5,29 @@ typedef struct bed_usageS bed_usage_t;
 
 bed_usage_t *bed_usage_new(void);
 
-void bed_usage_new_layer(bed_usage_t *, double z);
+void bed_usage_new_layer(bed_usage_t *, double z, int object);
 
 void bed_usage_extrude(bed_usage_t *, double x0, double y0, double x1, double y1);
 
 int bed_usage_place_object(bed_usage_t *b, double w, double h, double to_z, double *x_res, double *y_res);
 
+int bed_usage_place_object_near(bed_usage_t *b, double w, double h, double to_z, double x, double y, double *x_res, double *y_res);
+
+/* Keeps clear of the other objects of a sequential print by the extruder clearance */
+int bed_usage_place_object_in_sequence(bed_usage_t *b, double w, double h, double to_z, int object, double clearance, double x, double y, double *x_res, double *y_res);
+
 void bed_usage_add_object(bed_usage_t *b, double x, double y, double w, double h, char usage);
 
 int bed_usage_place_and_add_object(bed_usage_t *b, double w, double h, double to_z, char usage, double *x_res, double *y_res);
 
 void bed_usage_print(bed_usage_t *, FILE *);
 
+/* Returns 0 if it can't be written */
+int bed_usage_save(bed_usage_t *, FILE *);
+
+/* Returns NULL if f doesn't hold the usage of a bed of the current printer */
+bed_usage_t *bed_usage_load(FILE *);
+
 void bed_usage_destroy(bed_usage_t *);
 
 #endif
@@ -0,0 +1,945 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "convert.h"
+#include "gcode.h"
+#include "materials.h"
+#include "plate.h"
+#include "printer.h"
+#include "splice-sim.h"
+#include "transition-block.h"
+#include "util.h"
+
+typedef struct {
+    int drive;
+    char *name, *colour;
+    colour_strength_t strength;
+} drive_setting_t;
+
+struct convertS {
+    convert_options_t options;
+    printer_t *printer;
+    char *printer_fname;
+    char *purge_lengths_fname;
+    drive_setting_t *drives;
+    int n_drives, a_drives;
+    int aliases[N_DRIVES * N_DRIVES][2];
+    int n_aliases;
+    plate_job_t plate_jobs[MAX_PLATE_JOBS];
+    int n_plate_jobs;
+    char *input_fname;
+    const char *input_buf;
+    size_t input_len;
+    char *msf_fname, *gcode_fname;
+    char *cache_dir;
+    FILE *report;
+    char *input_copy;
+    size_t input_copy_len;
+    char *merged, *msf, *gcode;
+    size_t merged_len, msf_len, gcode_len;
+};
+
+static void
+output_summary(FILE *o)
+{
+    int i, j, k;
+    int layer = 1;
+    double last_layer_z = 0;
+    double total[N_DRIVES] = { 0, };
+    char buf[500];
+
+    fprintf(o, "Layer by layer extrusions\n");
+    fprintf(o, "-------------------------\n");
+    for (i = 0; i < n_runs; i = j) {
+	double layer_total = 0;
+	int gap = N_DRIVES * 26 + 5;
+
+	fprintf(o, "%5d %6.02f %6.02f", layer++, runs[i].z - last_layer_z, runs[i].z);
+	last_layer_z = runs[i].z;
+	for (j = i; j < n_runs && runs[i].z == runs[j].z; j++) {
+	    total[runs[j].t] += runs[j].e;
+	    buf[0] = '\0';
+	    if (runs[j].leading_support_mm > 0) sprintf(&buf[strlen(buf)], "%.2f|", runs[j].leading_support_mm);
+	    sprintf(&buf[strlen(buf)], "%.2f", runs[j].e);
+	    if (runs[j].trailing_infill_mm > 0) sprintf(&buf[strlen(buf)], "=%.2f", runs[j].trailing_infill_mm);
+	    fprintf(o, " %20s [%d]%c%c", buf, runs[j].t, runs[j].next_move_no_extrusion ? '!' : ' ', runs[j].ends_with_retraction ? 'R' : ' ');
+	    layer_total += runs[j].e;
+	    gap -= 26;
+	}
+	fprintf(o, "%*c %10.2f totals:", gap, ' ', layer_total);
+	for (k = 0; k < N_DRIVES; k++) {
+	    fprintf(o, " %12.2f", total[k]);
+	}
+	fprintf(o, "\n");
+    }
+    for (i = 0; i < N_DRIVES; i++) {
+	if (total[i]) fprintf(o, "T%d: %.2f mm\n", i, total[i]);
+    }
+    fprintf(o, "\n");
+    transition_block_dump_transitions(o);
+}
+
+static char *
+float_to_hex(double f, char *buf)
+{
+    unsigned v;
+    if (f == 0) strcpy(buf, "0");
+    else {
+	int shift = 0;
+
+	if (f < 0) v = 1 << 31;
+	else v = 0;
+	f = fabs(f);
+
+	while (f >= 2) {
+	   f /= 2;
+	   shift++;
+	}
+	while (f < 1) {
+	   f *= 2;
+	   shift--;
+	}
+	f = f - 1;
+	v |= (unsigned) (f * (0x800000 + 0.5));
+	v |= (shift + 0x7f) << 23;
+
+	sprintf(buf, "%x", v);
+    }
+
+    return buf;
+}
+
+/* The MSF numbers the materials of the print from 1, in the order of the
+ * drives that use them, whatever their order in materials.yml.
+ */
+
+static int
+get_used_materials(material_t **materials)
+{
+    int i, j;
+    int n_materials = 0;
+
+    for (i = 0; i < N_DRIVES; i++) {
+	active_material_t *m = get_active_material(i);
+	if (! used_tool[i]) continue;
+	for (j = 0; j < n_materials; j++) {
+	    if (materials[j] == m->m) break;
+	}
+	if (j >= n_materials) materials[n_materials++] = m->m;
+    }
+
+    return n_materials;
+}
+
+static void
+produce_msf_colours(FILE *o)
+{
+    material_t *materials[N_DRIVES];
+    int n_materials = get_used_materials(materials);
+    int i, j;
+    int first = 1;
+
+    fprintf(o, "cu:");
+    for (i = 0; i < N_DRIVES; i++) {
+	if (! first) fprintf(o, ";");
+	first = 0;
+	if (used_tool[i]) {
+	    active_material_t *m = get_active_material(i);
+	    const char *c = m->colour;
+
+	    for (j = 0; j < n_materials && materials[j] != m->m; j++) {}
+	    fprintf(o, "%d %s%s%s", j+1, c ? c : "", c ? " " : "", m->m->type);
+	} else {
+	    fprintf(o, "0");
+	}
+    }
+    fprintf(o, ";\r\n");
+}
+
+static void
+produce_msf_splices(FILE *o)
+{
+    int i;
+    char buf[20];
+
+    for (i = 0; i < n_splices; i++) {
+	 fprintf(o, "(%02x,%s)\r\n", splices[i].drive, float_to_hex(splices[i].mm, buf));
+    }
+}
+
+static void
+produce_msf_pings(FILE *o)
+{
+    int i;
+    char buf[20];
+
+    for (i = 0; i < n_pings; i++) {
+	fprintf(o, "(64,%s)\r\n", float_to_hex(pings[i].mm, buf));
+    }
+}
+
+/* A combination missing from materials.yml is spliced with everything 0 */
+
+static void
+produce_msf_splice_configuration(FILE *o, material_t **materials, int i1, int i2)
+{
+    material_t *m1 = materials[i1], *m2 = materials[i2];
+    static const material_splice_t undefined = { 0, };
+    char buf1[20], buf2[20];
+    const material_splice_t *splice;
+
+    if (! o) return;
+    if ((splice = materials_find_splice(m1->id, m2->id)) == NULL) {
+	fprintf(stderr, "No splice settings for %s to %s in materials.yml, using 0 for all of them\n", m1->name, m2->name);
+	splice = &undefined;
+    }
+    fprintf(o, "(%d%d,%s,%s,%d)\r\n", i1+1, i2+1, float_to_hex(splice->heat, buf1), float_to_hex(splice->compression, buf2), splice->reverse);
+}
+
+static void
+count_or_produce_splice_configurations(FILE *o, int *n_out)
+{
+    int i, j;
+    material_t *materials[N_DRIVES];
+    int n_materials = get_used_materials(materials);
+    int n = 0;
+
+    for (i = 0; i < n_materials; i++) {
+	produce_msf_splice_configuration(o, materials, i, i);
+	n++;
+	for (j = i+1; j < n_materials; j++) {
+	    produce_msf_splice_configuration(o, materials, i, j);
+	    produce_msf_splice_configuration(o, materials, j, i);
+	    n += 2;
+	}
+    }
+
+    if (n_out) *n_out = n;
+}
+
+static void
+produce_msf_splice_configurations(FILE *o)
+{
+    count_or_produce_splice_configurations(o, NULL);
+}
+
+static int
+msf_splice_configurations_n()
+{
+    int n;
+
+    count_or_produce_splice_configurations(NULL, &n);
+    return n;
+}
+
+static void
+produce_msf(FILE *o)
+{
+    char buf[20];
+
+    fprintf(o, "MSF1.4\r\n");
+    produce_msf_colours(o);
+    fprintf(o, "ppm:%s\r\n", float_to_hex(printer->pv / printer->calibration_len, buf));
+    fprintf(o, "lo:%04x\r\n", printer->loading_offset);
+    fprintf(o, "ns:%04x\r\n", n_splices);
+    fprintf(o, "np:%04x\r\n", n_pings);
+    fprintf(o, "nh:0000\r\n");
+    fprintf(o, "na:%04x\r\n", msf_splice_configurations_n());
+    // TODO na:
+    produce_msf_splices(o);
+    produce_msf_pings(o);
+    produce_msf_splice_configurations(o);
+}
+
+static void
+output_material_usage_and_transition_block(FILE *o)
+{
+    double used[N_DRIVES] = {0, };
+    double waste[N_DRIVES] = { 0, };
+    double transition_mm[N_DRIVES] = { 0, };
+    double total_used;
+    double total_waste = 0;
+    double total_transition_mm = 0;
+    double last = 0;
+    int i;
+
+    if (printer->side_transitions) {
+	fprintf(o, "side transitions:  %s\n", printer->purge_in_place ? "in place" : printer->purge_edge ? printer->purge_edge : "west");
+    } else {
+	for (i = 0; i < n_towers; i++) {
+	    transition_block_t *b = &transition_blocks[i];
+	    if (b->top_z < 0) continue;
+	    fprintf(o, "transition block:  (%.2f, %.2f) x (%.2f, %.2f)", b->x, b->y, b->w, b->h);
+	    if (n_towers > 1) fprintf(o, " up to z=%.2f", b->top_z);
+	    fprintf(o, "\n");
+	}
+    }
+    if (n_objects > 1) fprintf(o, "sequential objects: %d\n", n_objects);
+    fprintf(o, "transition layers: %d\n", n_transitions);
+    fprintf(o, "number of splices: %d\n", n_splices);
+    fprintf(o, "number of pings:   %d (%.0f seconds of pauses, %.2f mm extra purge)\n", n_pings, n_pings * printer->ping_seconds, ping_extra_purge_mm);
+
+    for (i = 0; i < n_splices; i++) {
+	int d = splices[i].drive;
+
+	used[d] += splices[i].mm - last;
+	waste[d] += splices[i].waste;
+	transition_mm[d] += splices[i].transition_mm;
+	total_waste += splices[i].waste;
+	total_transition_mm += splices[i].transition_mm;
+	last = splices[i].mm;
+    }
+
+    total_used = splices[n_splices-1].mm;
+
+    fprintf(o, "\nFilament usage:\n");
+    if (total_waste < total_transition_mm) {
+	fprintf(o, "Saved %.2f%% filament using infill & support\n", (total_transition_mm - total_waste) / total_transition_mm*100);
+    }
+
+    for (i = 0; i < N_DRIVES; i++) {
+	if (used[i]) {
+	    fprintf(o, "T%d: %9.2f mm + %9.2f mm waste => %9.2f mm (%.2f m)", i, used[i]-waste[i], waste[i], used[i], used[i]/1000);
+	    if (waste[i] < transition_mm[i]) fprintf(o, " saved %.2f mm", transition_mm[i] - waste[i]);
+	    fprintf(o, "\n");
+	}
+    }
+    fprintf(o, "-------------------------------------------------------------------\n");
+    fprintf(o, "    %9.2f mm + %9.2f mm waste => %9.2f mm (%.2f m)", total_used - total_waste, total_waste, total_used, total_used / 1000);
+    if (total_waste < total_transition_mm) fprintf(o, " saved %.2f mm", total_transition_mm - total_waste);
+    fprintf(o, "\n");
+
+    fprintf(o, "\nPrint time:\n");
+    print_time_report(print_time, o);
+}
+
+static char *
+get_msf_fname(const char *base)
+{
+    char *fname;
+
+    fname = malloc(strlen(base) + 20);
+    strcpy(fname, base);
+    if (ends_with(fname, ".gcode")) fname[strlen(fname)-6] = '\0';
+    if (! ends_with(fname, ".msf")) strcat(fname, ".msf");
+    return fname;
+}
+
+#define MAX_FIX_ITERATIONS	5
+
+/* Everything that was set for the conversion is applied to the other
+ * modules, which still hold what the previous conversion set.
+ */
+
+static int
+apply_settings(convert_t *c)
+{
+    convert_options_t *o = &c->options;
+    int i;
+
+    printer = c->printer;
+    validate_only = o->validate_only;
+    extrusions = o->extrusions;
+    gcode_trace = o->gcode_trace;
+    debug_tool_changes = o->debug_tool_changes;
+    stop_at_ping = o->stop_at_ping;
+    reduce_pings = o->reduce_pings;
+    sparse_tower = o->sparse_tower;
+    ping_in_object = o->ping_in_object;
+    reorder_tools = o->reorder_tools;
+    global_purge = o->global_purge;
+    purge_any_infill = o->purge_any_infill;
+    n_towers = o->n_towers;
+    auto_alias_drives = o->alias_drives;
+    runs_cache_dir = c->cache_dir;
+    report_out = c->report ? c->report : stdout;
+
+    reset_active_materials();
+    if (! init_active_materials()) return 0;
+    for (i = 0; i < c->n_drives; i++) {
+	drive_setting_t *d = &c->drives[i];
+	if (! set_active_material(d->drive, d->name, d->colour, d->strength)) return 0;
+    }
+    for (i = 0; i < c->n_aliases; i++) set_drive_alias(c->aliases[i][0], c->aliases[i][1]);
+    if (! purge_lengths_load(c->purge_lengths_fname)) {
+	fprintf(stderr, "%s: can't load the purge lengths\n", c->purge_lengths_fname);
+	return 0;
+    }
+    init_purge_lengths();
+    return 1;
+}
+
+/* The jobs are merged in memory and the input is read back from there */
+
+static FILE *
+open_merged_input(convert_t *c)
+{
+    FILE *o;
+    int ok;
+
+    if (! c->input_fname) {
+	fprintf(stderr, "Only gcode files can be merged onto a plate\n");
+	return NULL;
+    }
+
+    c->plate_jobs[0].fname = c->input_fname;
+    free(c->merged);
+    c->merged = NULL;
+    if ((o = open_memstream(&c->merged, &c->merged_len)) == NULL) return NULL;
+    ok = plate_merge(c->plate_jobs, c->n_plate_jobs, o, report_out);
+    fclose(o);
+
+    return ok ? fmemopen(c->merged, c->merged_len, "r") : NULL;
+}
+
+static FILE *
+open_input(convert_t *c)
+{
+    FILE *in;
+
+    if (c->n_plate_jobs > 1) return open_merged_input(c);
+    if (c->input_buf) return fmemopen((void *) c->input_buf, c->input_len, "r");
+    if (! c->input_fname) return NULL;
+    if ((in = fopen(c->input_fname, "r")) == NULL) perror(c->input_fname);
+    return in;
+}
+
+static FILE *
+open_output(const char *fname, char **buf, size_t *len)
+{
+    FILE *o;
+
+    if (! fname) {
+	free(*buf);
+	*buf = NULL;
+	return open_memstream(buf, len);
+    }
+    if ((o = fopen(fname, "w")) == NULL) perror(fname);
+    return o;
+}
+
+/* Returns -1 if the gcode stopped at --stop-at-ping */
+
+static int
+produce_gcode_output(convert_t *c)
+{
+    FILE *o;
+
+    if ((o = open_output(c->gcode_fname, &c->gcode, &c->gcode_len)) == NULL) return 0;
+    return gcode_to_msf_gcode(o) ? 1 : -1;
+}
+
+static int
+run_splice_sim(convert_t *c)
+{
+    FILE *f;
+
+    if (c->gcode_fname) f = fopen(c->gcode_fname, "r");
+    else f = fmemopen(c->gcode, c->gcode_len, "r");
+
+    if (f == NULL) {
+	perror(c->gcode_fname ? c->gcode_fname : "gcode");
+	return 0;
+    }
+    splice_sim_run(f);
+    fclose(f);
+    return 1;
+}
+
+/* The gcode doesn't depend on the colours and materials themselves, only on
+ * the strength of each colour, the purge lengths and which drives are
+ * aliased.  Each conversion to a file keeps its splices and pings in the
+ * cache dir under a hash of everything else the gcode depends on, with the
+ * size and mtime of the gcode it wrote.  With --msf-only the .msf is then
+ * written again from them when nothing the gcode depends on has changed,
+ * without going over the gcode at all.  Bump MSF_CACHE_VERSION whenever
+ * the gcode produced changes.
+ */
+
+#define MSF_CACHE_VERSION	1
+#define MSF_CACHE_MAGIC		"g2m-msf "
+
+typedef struct {
+    char magic[8];
+    int version;
+    unsigned long long key;
+    int sizes[2];
+    long long gcode_size, gcode_mtime;
+    int n_splices, n_pings;
+    int used_tool[N_DRIVES];
+} msf_cache_header_t;
+
+static unsigned long long
+hash_string(unsigned long long h, const char *s)
+{
+    return s ? hash_bytes(h, s, strlen(s) + 1) : h;
+}
+
+/* Files are taken to be unchanged while they have the same size and mtime */
+
+static unsigned long long
+hash_file(unsigned long long h, const char *fname)
+{
+    struct stat st;
+
+    h = hash_string(h, fname);
+    if (fname && stat(fname, &st) == 0) {
+	long long mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	h = HASH(h, st.st_size);
+	h = HASH(h, mtime);
+    }
+    return h;
+}
+
+static unsigned long long
+msf_cache_key(convert_t *c)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int version = MSF_CACHE_VERSION;
+    convert_options_t o = c->options;
+    int i, j;
+
+    o.summary = o.bed_usage = o.splice_sim = o.validate_only = o.msf_only = 0;
+
+    h = HASH(h, version);
+    h = HASH(h, o);
+    h = HASH(h, squash_interface);
+    h = hash_file(h, c->printer_fname);
+    if (c->input_buf) h = hash_bytes(h, c->input_buf, c->input_len);
+    else h = hash_file(h, c->input_fname);
+    for (i = 1; i < c->n_plate_jobs; i++) {
+	h = hash_file(h, c->plate_jobs[i].fname);
+	h = HASH(h, c->plate_jobs[i].dx);
+	h = HASH(h, c->plate_jobs[i].dy);
+    }
+    h = hash_string(h, c->gcode_fname);
+
+    for (i = 0; i < N_DRIVES; i++) {
+	h = HASH(h, get_active_material(i)->strength);
+	for (j = 0; j < N_DRIVES; j++) {
+	    double mm = get_purge_length(i, j);
+	    int aliased = drives_are_aliased(i, j);
+
+	    h = HASH(h, mm);
+	    h = HASH(h, aliased);
+	}
+    }
+
+    return h;
+}
+
+static char *
+msf_cache_fname(convert_t *c, unsigned long long key, const char *suffix)
+{
+    char *fname = malloc(strlen(c->cache_dir) + strlen(suffix) + 30);
+
+    sprintf(fname, "%s/%016llx.msf%s", c->cache_dir, key, suffix);
+    return fname;
+}
+
+static void
+msf_cache_header(msf_cache_header_t *hdr, unsigned long long key, struct stat *st)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, MSF_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = MSF_CACHE_VERSION;
+    hdr->key = key;
+    hdr->sizes[0] = sizeof(splice_t);
+    hdr->sizes[1] = sizeof(ping_t);
+    hdr->gcode_size = st->st_size;
+    hdr->gcode_mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static void
+save_msf_cache(convert_t *c)
+{
+    unsigned long long key = msf_cache_key(c);
+    char *fname = msf_cache_fname(c, key, "");
+    char *tmp = msf_cache_fname(c, key, ".tmp");
+    msf_cache_header_t hdr;
+    struct stat st;
+    FILE *f;
+    int ok = 0;
+
+    if (stat(c->gcode_fname, &st) == 0 && (f = fopen(tmp, "w")) != NULL) {
+	msf_cache_header(&hdr, key, &st);
+	hdr.n_splices = n_splices;
+	hdr.n_pings = n_pings;
+	memcpy(hdr.used_tool, used_tool, sizeof(hdr.used_tool));
+	ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+	     fwrite(splices, sizeof(*splices), n_splices, f) == n_splices &&
+	     fwrite(pings, sizeof(*pings), n_pings, f) == n_pings;
+	if (fclose(f) != 0) ok = 0;
+	if (ok) ok = rename(tmp, fname) == 0;
+    }
+    if (! ok) {
+	perror(fname);
+	unlink(tmp);
+    }
+    free(fname);
+    free(tmp);
+}
+
+/* Returns 0 if the gcode has to be produced again, -1 if the .msf can't
+ * be written.
+ */
+
+static int
+rewrite_msf(convert_t *c)
+{
+    unsigned long long key;
+    msf_cache_header_t hdr, want;
+    struct stat st;
+    char *fname;
+    FILE *f = NULL, *o;
+    int ok;
+
+    if (! c->cache_dir || ! c->gcode_fname) {
+	fprintf(stderr, "--msf-only needs --cache and an output file, converting everything\n");
+	return 0;
+    }
+
+    key = msf_cache_key(c);
+    fname = msf_cache_fname(c, key, "");
+    ok = stat(c->gcode_fname, &st) == 0 && (f = fopen(fname, "r")) != NULL;
+    if (ok) {
+	msf_cache_header(&want, key, &st);
+	ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && memcmp(&hdr, &want, (char *) &want.n_splices - (char *) &want) == 0 &&
+	     hdr.n_splices >= 0 && hdr.n_splices <= MAX_RUNS && hdr.n_pings >= 0 && hdr.n_pings <= MAX_RUNS &&
+	     fread(splices, sizeof(*splices), hdr.n_splices, f) == hdr.n_splices &&
+	     fread(pings, sizeof(*pings), hdr.n_pings, f) == hdr.n_pings;
+	fclose(f);
+    }
+    free(fname);
+
+    if (! ok) {
+	fprintf(report_out, "%s isn't the gcode of these settings, converting everything\n", c->gcode_fname);
+	return 0;
+    }
+
+    n_splices = hdr.n_splices;
+    n_pings = hdr.n_pings;
+    memcpy(used_tool, hdr.used_tool, sizeof(used_tool));
+
+    fprintf(report_out, "Outputting to %s, %s is unchanged\n", c->msf_fname, c->gcode_fname);
+    if ((o = open_output(c->msf_fname, &c->msf, &c->msf_len)) == NULL) return -1;
+    produce_msf(o);
+    fclose(o);
+
+    fprintf(report_out, "number of splices: %d\n", n_splices);
+    fprintf(report_out, "number of pings:   %d\n", n_pings);
+
+    return 1;
+}
+
+static int
+convert(convert_t *c)
+{
+    FILE *in, *o;
+    int i, ok;
+
+    if (c->options.msf_only && ! c->options.validate_only && (ok = rewrite_msf(c)) != 0) return ok > 0;
+
+    if ((in = open_input(c)) == NULL) return 0;
+    if (! gcode_to_runs(in)) return 0;
+    if (! transition_block_create_from_runs()) return c->options.validate_only ? -1 : 0;
+    if (c->options.validate_only) {
+	if (c->options.summary) output_summary(report_out);
+	if (c->options.bed_usage) bed_usage_print(bed_usage, report_out);
+	return transition_block_validate(report_out) ? 1 : -1;
+    }
+    if (c->msf_fname) fprintf(report_out, "Outputting to %s\n", c->msf_fname);
+
+    /* Stopping at a ping leaves only the gcode up to it */
+    if ((ok = produce_gcode_output(c)) <= 0) return ok < 0;
+    if (c->options.splice_sim || c->options.fix_starvation) {
+	if (! run_splice_sim(c)) return 0;
+	for (i = 0; c->options.fix_starvation && n_stalls > 0 && i < MAX_FIX_ITERATIONS && splice_sim_fix(); i++) {
+	    if (produce_gcode_output(c) <= 0 || ! run_splice_sim(c)) return 0;
+	}
+    }
+
+    if ((o = open_output(c->msf_fname, &c->msf, &c->msf_len)) == NULL) return 0;
+    produce_msf(o);
+    fclose(o);
+
+    if (c->cache_dir && c->gcode_fname) save_msf_cache(c);
+
+    if (c->options.summary) output_summary(report_out);
+    if (c->options.bed_usage) bed_usage_print(bed_usage, report_out);
+    if (c->options.splice_sim || c->options.fix_starvation) splice_sim_report(report_out);
+    output_material_usage_and_transition_block(report_out);
+
+    return 1;
+}
+
+/* The materials are loaded again when the file changes or another file
+ * is given.
+ */
+
+convert_t *
+convert_new(const char *materials_fname)
+{
+    static char *loaded_fname;
+    static time_t loaded_mtime;
+    struct stat st;
+    convert_t *c;
+
+    if (stat(materials_fname, &st) < 0) return NULL;
+    if (! loaded_fname || strcmp(loaded_fname, materials_fname) != 0 || st.st_mtime != loaded_mtime) {
+	free(loaded_fname);
+	loaded_fname = NULL;
+	if (! materials_load(materials_fname)) return NULL;
+	loaded_fname = strdup(materials_fname);
+	loaded_mtime = st.st_mtime;
+    }
+
+    c = calloc(sizeof(*c), 1);
+    c->options.stop_at_ping = -1;
+    c->options.n_towers = 1;
+    c->n_plate_jobs = 1;
+
+    return c;
+}
+
+convert_options_t *
+convert_options(convert_t *c)
+{
+    return &c->options;
+}
+
+/* A printer is only loaded once however many conversions use it, unless
+ * the file has changed since.  Contexts keep the printer they were given.
+ */
+
+#define MAX_PRINTERS	100
+
+static struct {
+    char *fname;
+    time_t mtime;
+    printer_t *printer;
+} printers[MAX_PRINTERS];
+static int n_printers;
+
+int
+convert_set_printer(convert_t *c, const char *fname)
+{
+    struct stat st;
+    int i;
+
+    if (stat(fname, &st) < 0) return 0;
+    free(c->printer_fname);
+    c->printer_fname = strdup(fname);
+
+    for (i = 0; i < n_printers; i++) {
+	if (strcmp(printers[i].fname, fname) == 0 && printers[i].mtime == st.st_mtime) {
+	    c->printer = printers[i].printer;
+	    return 1;
+	}
+    }
+
+    if (! printer_load(fname)) return 0;
+    c->printer = printer;
+
+    for (i = 0; i < n_printers && strcmp(printers[i].fname, fname) != 0; i++) {}
+    if (i < MAX_PRINTERS) {
+	if (i == n_printers) printers[n_printers++].fname = strdup(fname);
+	printers[i].mtime = st.st_mtime;
+	printers[i].printer = printer;
+    }
+    return 1;
+}
+
+/* Loaded again by each conversion, so only this context uses them */
+
+int
+convert_set_purge_lengths(convert_t *c, const char *fname)
+{
+    free(c->purge_lengths_fname);
+    c->purge_lengths_fname = strdup(fname);
+    return purge_lengths_load(fname);
+}
+
+void
+convert_set_material(convert_t *c, int drive, const char *name, const char *colour, colour_strength_t strength)
+{
+    drive_setting_t *d;
+
+    if (c->n_drives >= c->a_drives) {
+	c->a_drives = c->a_drives ? c->a_drives * 2 : 16;
+	c->drives = realloc(c->drives, sizeof(*c->drives) * c->a_drives);
+    }
+    d = &c->drives[c->n_drives++];
+    d->drive = drive;
+    d->name = name ? strdup(name) : NULL;
+    d->colour = colour ? strdup(colour) : NULL;
+    d->strength = strength;
+}
+
+void
+convert_set_alias(convert_t *c, int drive, int same_as)
+{
+    if (c->n_aliases >= N_DRIVES * N_DRIVES) return;
+    c->aliases[c->n_aliases][0] = drive;
+    c->aliases[c->n_aliases][1] = same_as;
+    c->n_aliases++;
+}
+
+int
+convert_add_plate_job(convert_t *c, const char *fname, double dx, double dy)
+{
+    if (c->n_plate_jobs >= MAX_PLATE_JOBS) return 0;
+    c->plate_jobs[c->n_plate_jobs].fname = strdup(fname);
+    c->plate_jobs[c->n_plate_jobs].dx = dx;
+    c->plate_jobs[c->n_plate_jobs].dy = dy;
+    c->n_plate_jobs++;
+    return 1;
+}
+
+void
+convert_set_input_file(convert_t *c, const char *fname)
+{
+    free(c->input_fname);
+    c->input_fname = strdup(fname);
+    c->input_buf = NULL;
+}
+
+void
+convert_set_input_buffer(convert_t *c, const char *buf, size_t len)
+{
+    free(c->input_fname);
+    c->input_fname = NULL;
+    c->input_buf = buf;
+    c->input_len = len;
+}
+
+void
+convert_set_output_file(convert_t *c, const char *fname)
+{
+    free(c->msf_fname);
+    free(c->gcode_fname);
+    c->msf_fname = get_msf_fname(fname);
+    c->gcode_fname = malloc(strlen(c->msf_fname) + 20);
+    sprintf(c->gcode_fname, "%s.gcode", c->msf_fname);
+}
+
+void
+convert_set_cache_dir(convert_t *c, const char *dir)
+{
+    free(c->cache_dir);
+    free(c->input_copy);
+    c->cache_dir = dir ? strdup(dir) : NULL;
+}
+
+void
+convert_set_report(convert_t *c, FILE *report)
+{
+    c->report = report;
+}
+
+int
+convert_run(convert_t *c)
+{
+    int ok;
+
+    if (! c->printer) {
+	fprintf(stderr, "No printer to convert for\n");
+	return 0;
+    }
+
+    if (! apply_settings(c)) return 0;
+    fprintf(stderr, "Using printer: %s\n", printer->name);
+    ok = convert(c);
+    gcode_close_input();
+
+    return ok;
+}
+
+int
+convert_first_pass(convert_t *c)
+{
+    FILE *in, *copy;
+    char buf[64*1024];
+    size_t len;
+
+    if (! c->printer) {
+	fprintf(stderr, "No printer to convert for\n");
+	return 0;
+    }
+
+    if (! apply_settings(c)) return 0;
+    fprintf(stderr, "Using printer: %s\n", printer->name);
+
+    if ((in = open_input(c)) == NULL) return 0;
+    free(c->input_copy);
+    c->input_copy = NULL;
+    if ((copy = open_memstream(&c->input_copy, &c->input_copy_len)) == NULL) {
+	fclose(in);
+	return 0;
+    }
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, len, copy);
+    fclose(in);
+    fclose(copy);
+
+    if ((in = fmemopen(c->input_copy, c->input_copy_len, "r")) == NULL) {
+	perror("gcode");
+	return 0;
+    }
+    return gcode_to_runs(in);
+}
+
+const char *
+convert_msf_fname(convert_t *c)
+{
+    return c->msf_fname;
+}
+
+const char *
+convert_gcode_fname(convert_t *c)
+{
+    return c->gcode_fname;
+}
+
+const char *
+convert_msf(convert_t *c, size_t *len)
+{
+    *len = c->msf_len;
+    return c->msf;
+}
+
+const char *
+convert_gcode(convert_t *c, size_t *len)
+{
+    *len = c->gcode_len;
+    return c->gcode;
+}
+
+void
+convert_destroy(convert_t *c)
+{
+    int i;
+
+    for (i = 0; i < c->n_drives; i++) {
+	free(c->drives[i].name);
+	free(c->drives[i].colour);
+    }
+    for (i = 1; i < c->n_plate_jobs; i++) free((char *) c->plate_jobs[i].fname);
+    free(c->drives);
+    free(c->printer_fname);
+    free(c->purge_lengths_fname);
+    free(c->input_fname);
+    free(c->msf_fname);
+    free(c->gcode_fname);
+    free(c->cache_dir);
+    free(c->merged);
+    free(c->msf);
+    free(c->gcode);
+    free(c);
+}
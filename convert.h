@@ -0,0 +1,98 @@
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stdio.h>
+#include "materials.h"
+
+/* A conversion: the printer, what is loaded in each drive, the options and
+ * where the gcode comes from and the results go.
+ *
+ * The conversion works on the state of the other modules so only one can
+ * run at a time, but a context can be run any number of times and any
+ * number of contexts can be used one after the other.  The materials
+ * (and calibrated purge lengths) are shared by all of them and are loaded
+ * again by convert_new() when the materials file changes.
+ */
+
+typedef struct convertS convert_t;
+
+typedef struct {
+    int summary;
+    int bed_usage;
+    int splice_sim;
+    int fix_starvation;
+    int validate_only;
+    int extrusions;
+    int gcode_trace;
+    int debug_tool_changes;
+    int stop_at_ping;
+    int reduce_pings;
+    int sparse_tower;
+    int ping_in_object;
+    int reorder_tools;
+    int global_purge;
+    int purge_any_infill;
+    int n_towers;
+    int alias_drives;
+    int msf_only;
+} convert_options_t;
+
+/* Returns NULL if the materials (materials.yml) can't be loaded */
+convert_t *convert_new(const char *materials_fname);
+
+convert_options_t *convert_options(convert_t *);
+
+int convert_set_printer(convert_t *, const char *fname);
+
+/* Where the run reports what it did (the summary, the filament usage and
+ * the print time), stdout if NULL.  Errors and warnings go to stderr.
+ */
+void convert_set_report(convert_t *, FILE *report);
+
+int convert_set_purge_lengths(convert_t *, const char *fname);
+
+/* Like set_active_material(), applied in order at the start of each run */
+void convert_set_material(convert_t *, int drive, const char *name, const char *colour, colour_strength_t strength);
+
+void convert_set_alias(convert_t *, int drive, int same_as);
+
+/* Returns 0 if there are already MAX_PLATE_JOBS jobs */
+int convert_add_plate_job(convert_t *, const char *fname, double dx, double dy);
+
+void convert_set_input_file(convert_t *, const char *fname);
+
+/* The buffer has to stay valid until the run is over */
+void convert_set_input_buffer(convert_t *, const char *buf, size_t len);
+
+/* Write fname.msf and fname.msf.gcode, otherwise both are kept in memory */
+void convert_set_output_file(convert_t *, const char *fname);
+
+/* Keep the result of the first pass over the input in dir, to be reused
+ * by the runs of any context with the same input, NULL not to
+ */
+void convert_set_cache_dir(convert_t *, const char *dir);
+
+/* NULL if the results are kept in memory */
+const char *convert_msf_fname(convert_t *);
+
+const char *convert_gcode_fname(convert_t *);
+
+/* Returns 0 if the input or output can't be opened.  With validate_only
+ * nothing is written and it returns -1 if the print can't be made.
+ */
+int convert_run(convert_t *);
+
+/* Apply the settings and make only the first pass over the input, which
+ * is copied into memory so that the processes forked afterwards can each
+ * carry on with their own copy of it (see sweep.c).
+ */
+int convert_first_pass(convert_t *);
+
+/* The results of the last run kept in memory, valid until the next run */
+const char *convert_msf(convert_t *, size_t *len);
+
+const char *convert_gcode(convert_t *, size_t *len);
+
+void convert_destroy(convert_t *);
+
+#endif
@@ -5,10 +5,13 @@
 #include <math.h>
 #include <float.h>
 #include <assert.h>
+#include <unistd.h>
 #include "bed-usage.h"
 #include "gcode.h"
 #include "printer.h"
+#include "print-time.h"
 #include "transition-block.h"
+#include "util.h"
 
 #define EPSILON 0.0000001
 
@@ -61,20 +64,28 @@ int gcode_trace = 0;
 int validate_only = 0;
 int debug_tool_changes = 0;
 int stop_at_ping = -1;
+FILE *report_out;
 int squash_interface = 0;
+int reorder_tools = 0;
+int purge_any_infill = 0;
+const char *runs_cache_dir = NULL;
+print_time_t *print_time;
 
-static double last_x = 0, last_y = 0, last_z = 0, last_e = 0, last_f = 0;
+static double last_x = 0, last_y = 0, last_z = 0, last_e = 0, last_f = 0, high_e = 0;
 static double start_e = 0, cur_max_e = 0, abs_start_e = 0, abs_max_e = 0, start_z = NAN;
 static int e_is_absolute = 1;
 static int in_slic3r_crap = 0;
 static path_t start_path = NORMAL, cur_path = NORMAL;
+static int start_object = 0, cur_object = 0;
 static double last_fan = 0;
 static int tool = 0;
+static int next_alias_splice;
 static int seen_tool = 0;
 static int n_used_tools = 0;
 
 run_t runs[MAX_RUNS];
 int n_runs = 0;
+int n_objects = 1;
 int used_tool[N_DRIVES] = { 0, };
 double tool_mm[N_DRIVES] = { 0, };
 bed_usage_t *bed_usage;
@@ -137,22 +148,6 @@ struct {
 
 #define STRNCMP(a, b) strncmp(a, b, strlen(b))
 
-static int
-find_arg(const char *buf, char arg, double *val)
-{
-    size_t i;
-
-    for (i = 0; buf[i]; i++) {
-	if (buf[i] == ' ' && buf[i+1] == arg) {
-	     if (sscanf(&buf[i+2], "%lf", val) > 0) {
-		return 1;
-	     }
-	     return 0;
-	}
-    }
-    return 0;
-}
-
 static int
 has_arg(const char *buf, char arg)
 {
@@ -217,13 +212,53 @@ check_for_simplify3d_path_types()
     else cur_path = NORMAL;
 }
 
+/* The state of the printer at a run boundary so that the input can be
+ * resumed there when the runs are emitted in a different order.
+ */
+
+typedef struct {
+    double x, y, z, e, f, fan;
+    double retracted;
+    path_t path;
+    int e_is_absolute;
+    int tool;
+    int in_slic3r_crap;
+} gcode_state_t;
+
+typedef struct {
+    long offset;
+    gcode_state_t state;
+} boundary_t;
+
+static boundary_t *boundaries;
+static int n_boundaries, a_boundaries;
+
+/* The order in which the input is emitted: a list of byte ranges of the
+ * input, pos being where the range starts in the reordered input.
+ * Empty unless the runs have been reordered.
+ */
+
+typedef struct {
+    long start, end;
+    long pos;
+    gcode_state_t state;
+} segment_t;
+
+static segment_t *segments;
+static int n_segments, cur_segment;
+static long segment_delta;
+
 static long next_pos = 0;
 
+static void jump_to_segment(int i);
+
 static void
 rewind_input()
 {
     rewind(f);
     next_pos = 0;
+    cur_segment = 0;
+    segment_delta = 0;
     has_started = 0;
     e_is_absolute = 1;
     in_slic3r_crap = 0;
@@ -243,10 +278,12 @@ get_next_token_wrapped()
 {
     token_t t;
 
-    while (fgets(buf, sizeof(buf), f) != NULL) {
+    while (1) {
+	if (cur_segment+1 < n_segments && ftell(f) >= segments[cur_segment].end) jump_to_segment(cur_segment+1);
+	if (fgets(buf, sizeof(buf), f) == NULL) break;
 	t.t = OTHER;
 	t.pos = next_pos;
-	next_pos = ftell(f);
+	next_pos = ftell(f) + segment_delta;
 	if (in_slic3r_crap && (
 	    STRNCMP(buf, "G1 E-15.0000") == 0 ||
 	    STRNCMP(buf, "G1 E10.5000 F5400") == 0 ||
@@ -332,7 +369,7 @@ get_next_token_wrapped()
 	if (buf[0] == 'T' && isdigit(buf[1])) {
 	    if (slicer == SLIC3R && ! has_started) {
 		next_pos = t.pos;
-		fseek(f, next_pos, SEEK_SET);
+		fseek(f, next_pos - segment_delta, SEEK_SET);
 		t.t = START;
 		has_started = 1;
 		return t;
@@ -359,6 +396,7 @@ static void
 update_last_state(token_t *t)
 {
     last_f = t->x.move.f;
+    if (t->x.move.e > high_e) high_e = t->x.move.e;
     last_e = t->x.move.e;
     last_x = t->x.move.x;
     last_y = t->x.move.y;
@@ -370,21 +408,61 @@ get_next_token()
 {
     token_t t = get_next_token_wrapped();
     if (gcode_trace) {
-	printf("%8ld ", t.pos);
+	fprintf(report_out, "%8ld ", t.pos);
 	switch (t.t) {
-	case MOVE: printf("MOVE (%f,%f,%f) e=%f path=%s%s\n", t.x.move.x, t.x.move.y, t.x.move.z, t.x.move.e, path_names[cur_path], t.x.move.changes_position ? " changes-pos" : ""); break;
-	case SET_E: printf("SET_E %f\n", t.x.e); break;
-	case START: printf("START\n"); break;
-	case TOOL: printf("TOOL %d\n", t.x.tool); break;
-	case FAN: printf("FAN %f\n", t.x.fan); break;
-	case OTHER: printf("%s", buf); break;
-	case KISS_EXT: printf("KISS_EXT %d\n", t.x.tool); break;
-	default: printf("*** UNKNOWN TOKEN ****\n");
+	case MOVE: fprintf(report_out, "MOVE (%f,%f,%f) e=%f path=%s%s\n", t.x.move.x, t.x.move.y, t.x.move.z, t.x.move.e, path_names[cur_path], t.x.move.changes_position ? " changes-pos" : ""); break;
+	case SET_E: fprintf(report_out, "SET_E %f\n", t.x.e); break;
+	case START: fprintf(report_out, "START\n"); break;
+	case TOOL: fprintf(report_out, "TOOL %d\n", t.x.tool); break;
+	case FAN: fprintf(report_out, "FAN %f\n", t.x.fan); break;
+	case OTHER: fprintf(report_out, "%s", buf); break;
+	case KISS_EXT: fprintf(report_out, "KISS_EXT %d\n", t.x.tool); break;
+	default: fprintf(report_out, "*** UNKNOWN TOKEN ****\n");
         }
     }
     return t;
 }
 
+static void
+record_boundary(long offset)
+{
+    boundary_t *b;
+
+    if (n_boundaries >= a_boundaries) {
+	a_boundaries = a_boundaries ? a_boundaries * 2 : 1024;
+	boundaries = realloc(boundaries, sizeof(*boundaries) * a_boundaries);
+    }
+
+    b = &boundaries[n_boundaries++];
+    b->offset = offset;
+    b->state.x = last_x;
+    b->state.y = last_y;
+    b->state.z = last_z;
+    b->state.e = last_e;
+    b->state.f = last_f;
+    b->state.fan = last_fan;
+    b->state.retracted = high_e - last_e;
+    b->state.path = cur_path;
+    b->state.e_is_absolute = e_is_absolute;
+    b->state.tool = tool;
+    b->state.in_slic3r_crap = in_slic3r_crap;
+}
+
+static gcode_state_t *
+find_boundary(long offset)
+{
+    int lo = 0, hi = n_boundaries-1;
+
+    while (lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+	if (boundaries[mid].offset <= offset) lo = mid;
+	else hi = mid-1;
+    }
+
+    assert(n_boundaries > 0 && boundaries[lo].offset == offset);
+    return &boundaries[lo].state;
+}
+
 static void
 add_run(long offset)
 {
@@ -420,15 +498,23 @@ add_run(long offset)
 
     if (n_runs > 0 && runs[n_runs-1].t == tool && runs[n_runs-1].z == start_z && runs[n_runs-1].path == path) {
 	runs[n_runs-1].e += delta_e;
+	runs[n_runs-1].offset = offset;
+	runs[n_runs-1].x = last_x;
+	runs[n_runs-1].y = last_y;
+	record_boundary(offset);
     } else {
 	runs[n_runs].z = start_z;
 	runs[n_runs].e = delta_e;
 	runs[n_runs].t = tool;
 	runs[n_runs].path = path == UNKNOWN_PATH ? NORMAL : path;
 	runs[n_runs].offset = offset;
+	runs[n_runs].x = last_x;
+	runs[n_runs].y = last_y;
+	runs[n_runs].object = start_object;
 	runs[n_runs].next_move_no_extrusion = 0;
 	if (n_runs == 0) runs[0].e += printer->prime_mm - retract_mm;
 	n_runs++;
+	record_boundary(offset);
     }
 
     runs[n_runs-1].ends_with_retraction = ends_with_retraction;
@@ -439,7 +525,7 @@ add_run(long offset)
 static int
 compatible_runs(run_t *r1, run_t *r2)
 {
-    return r1->z >= r2->z && r1->t == r2->t;
+    return r1->z >= r2->z && r1->t == r2->t && r1->object == r2->object;
 }
 
 static void
@@ -471,6 +557,8 @@ merge_consecutive_runs()
 	}
 
 	runs[i].offset = runs[next_run-1].offset;
+	runs[i].x = runs[next_run-1].x;
+	runs[i].y = runs[next_run-1].y;
     }
 
     n_runs = i;
@@ -483,6 +571,8 @@ static void merge_run(run_t *pre, run_t *next)
     else pre->trailing_infill_mm = next->trailing_infill_mm;
     pre->e += next->e;
     pre->offset = next->offset;
+    pre->x = next->x;
+    pre->y = next->y;
     pre->ends_with_retraction = next->ends_with_retraction;
 }
 
@@ -494,11 +584,12 @@ merge_negative_height_runs()
     int n_merged = 0;
 
     for (i = 0, next_run = 0; next_run < n_runs; i++) {
-	double last_z = i > 0 ? runs[i-1].z : 0;
+	double last_z = i > 0 && runs[i-1].object == runs[next_run].object ? runs[i-1].z : 0;
 
 	runs[i] = runs[next_run++];
 	while (next_run < n_runs &&
 		runs[i].t == runs[next_run].t &&
+		runs[i].object == runs[next_run].object &&
 		runs[i].z < last_z &&
 		runs[next_run].z - last_z < printer->max_layer_height)
 	{
@@ -512,14 +603,14 @@ merge_negative_height_runs()
     if (n_merged > 0) fprintf(stderr, "Warning: %d runs were merged due to negative layer heights\n", n_merged);
 }
     
-static void
+static int
 merge_compatible_runs()
 {
     int i;
     int next_run;
 
     for (i = 0, next_run = 0; next_run < n_runs; i++) {
-	double last_z = i > 0 ? runs[i-1].z : 0;
+	double last_z = i > 0 && runs[i-1].object == runs[next_run].object ? runs[i-1].z : 0;
 
 	runs[i] = runs[next_run++];
 	while (next_run < n_runs &&
@@ -527,6 +618,7 @@ merge_compatible_runs()
 	    last_z < runs[i].z &&
 	    runs[i].z < runs[next_run].z &&
 	    runs[i].t == runs[next_run].t &&
+	    runs[i].object == runs[next_run].object &&
 	    runs[next_run].z - last_z < printer->max_layer_height)
 	{
 	    merge_run(&runs[i], &runs[next_run]);
@@ -535,22 +627,239 @@ merge_compatible_runs()
 
 	if (runs[i].z < last_z) {
 	    fprintf(stderr, "Cannot complete gcode processing.\nExtrusion at height %f occurs before extrusion at height %f\n", last_z, runs[i].z);
-	    exit(1);
+	    return 0;
 	}
     }
 
     n_runs = i;
+    return 1;
+}
+
+/* Emit the runs in a different order.  Each run's byte range is looked up
+ * through the current order, so reorderings can be stacked, and the
+ * printer state for a jump is always the state recorded at the run
+ * boundary where that range starts in the input.
+ */
+
+static void
+add_segment(long start, long end)
+{
+    long pos = n_segments ? segments[n_segments-1].pos + (segments[n_segments-1].end - segments[n_segments-1].start) : 0;
+
+    if (n_segments && segments[n_segments-1].end == start) {
+	segments[n_segments-1].end = end;
+	return;
+    }
+
+    segments[n_segments].start = start;
+    segments[n_segments].end = end;
+    segments[n_segments].pos = pos;
+    if (start > 0) segments[n_segments].state = *find_boundary(start);
+    n_segments++;
+}
+
+static void
+add_reordered_range(segment_t *old, int n_old, long start, long end)
+{
+    int lo = 0, hi = n_old-1;
+
+    if (n_old == 0) {
+	add_segment(start, end);
+	return;
+    }
+
+    while (lo < hi) {
+	int mid = (lo + hi + 1) / 2;
+	if (old[mid].pos <= start) lo = mid;
+	else hi = mid-1;
+    }
+
+    for (; start < end; lo++) {
+	long seg_end = old[lo].pos + (old[lo].end - old[lo].start);
+	long piece_end = end < seg_end ? end : seg_end;
+
+	add_segment(old[lo].start + (start - old[lo].pos), old[lo].start + (piece_end - old[lo].pos));
+	start = piece_end;
+    }
 }
 
 static void
+apply_run_order(int *order)
+{
+    run_t *orig = malloc(sizeof(*orig) * n_runs);
+    segment_t *old = n_segments ? malloc(sizeof(*old) * n_segments) : NULL;
+    int n_old = n_segments;
+    int i;
+
+    memcpy(orig, runs, sizeof(*orig) * n_runs);
+    if (old) memcpy(old, segments, sizeof(*old) * n_segments);
+    segments = realloc(segments, sizeof(*segments) * (n_runs + n_old));
+    n_segments = 0;
+
+    for (i = 0; i < n_runs; i++) {
+	int k = order[i];
+
+	add_reordered_range(old, n_old, k > 0 ? orig[k-1].offset : 0, orig[k].offset);
+
+	runs[i] = orig[k];
+	runs[i].offset = segments[n_segments-1].pos + (segments[n_segments-1].end - segments[n_segments-1].start);
+	if (i > 0) {
+	    /* What follows a run is now whatever followed the run it jumps to in the input */
+	    runs[i-1].ends_with_retraction = orig[k-1].ends_with_retraction;
+	    runs[i-1].next_move_no_extrusion = orig[k-1].next_move_no_extrusion;
+	}
+    }
+
+    free(orig);
+    free(old);
+}
+
+/* Within each layer, print a tool's support first and its infill last so
+ * that merge_consecutive_runs() sees all of it as leading support and
+ * trailing infill that the transitions can purge into.
+ */
+
+static int
+path_order(path_t path)
+{
+    if (path == SUPPORT) return 0;
+    if (path == INFILL) return 2;
+    return 1;
+}
+
+static void
+reorder_runs_by_path()
+{
+    int *order = malloc(sizeof(*order) * n_runs);
+    int i, j, start, end;
+    int n_reordered = 0;
+
+    for (i = 0; i < n_runs; i++) order[i] = i;
+
+    for (start = 0; start < n_runs; start = end) {
+	for (end = start+1; end < n_runs && runs[end].z == runs[start].z && runs[end].t == runs[start].t; end++) {}
+
+	if (start == 0 || end == n_runs) continue;
+
+	for (i = start+1; i < end; i++) {
+	    int k = order[i];
+	    for (j = i; j > start && path_order(runs[order[j-1]].path) > path_order(runs[k].path); j--) order[j] = order[j-1];
+	    order[j] = k;
+	}
+
+	for (i = start; i < end && order[i] == i; i++) {}
+	n_reordered += i < end;
+    }
+
+    if (n_reordered > 0) {
+	apply_run_order(order);
+	fprintf(report_out, "Moved the support and infill next to the tool changes in %d layers\n", n_reordered);
+    }
+
+    free(order);
+}
+
+/* Reorder the runs within each layer so that the layer starts with the
+ * tool that finished the previous layer, ends with the tool that starts
+ * the next layer and all the runs of a tool are together.  A layer is only
+ * reordered if that removes tool changes.  The first and last layers are
+ * left alone because they also contain the start and end gcode.
+ */
+
+static int
+count_tool_changes(int *order, int start, int end, int prev_tool)
+{
+    int i, n = 0;
+
+    for (i = start; i < end; i++) {
+	n += runs[order[i]].t != prev_tool;
+	prev_tool = runs[order[i]].t;
+    }
+    return n + (runs[end].t != prev_tool);
+}
+
+static void
+reorder_runs_by_tool()
+{
+    int *order = malloc(sizeof(*order) * n_runs);
+    int *sorted = malloc(sizeof(*sorted) * n_runs);
+    int key[N_DRIVES];
+    int i, j, start, end;
+    int n_reordered = 0, n_before = 0, n_after = 0;
+
+    for (i = 0; i < n_runs; i++) order[i] = i;
+
+    for (start = 0; start < n_runs; start = end) {
+	int prev_tool;
+
+	for (end = start+1; end < n_runs && runs[end].z == runs[start].z; end++) {}
+
+	if (start == 0 || end == n_runs) continue;
+
+	prev_tool = runs[order[start-1]].t;
+	for (i = 0; i < N_DRIVES; i++) key[i] = N_DRIVES;
+	for (i = end-1; i >= start; i--) key[runs[i].t] = i - start;
+	key[runs[end].t] = n_runs;
+	key[prev_tool] = -1;
+
+	for (i = start; i < end; i++) {
+	    int k = order[i];
+	    for (j = i; j > start && key[runs[sorted[j-1]].t] > key[runs[k].t]; j--) sorted[j] = sorted[j-1];
+	    sorted[j] = k;
+	}
+
+	if (count_tool_changes(sorted, start, end, prev_tool) < count_tool_changes(order, start, end, prev_tool)) {
+	    memcpy(&order[start], &sorted[start], sizeof(*order) * (end - start));
+	    n_reordered++;
+	}
+    }
+
+    for (i = 1; i < n_runs; i++) n_before += runs[i].t != runs[i-1].t;
+
+    if (n_reordered > 0) apply_run_order(order);
+
+    for (i = 0, j = 1; j < n_runs; j++) {
+	if (runs[i].t == runs[j].t && runs[i].z == runs[j].z && runs[i].object == runs[j].object) {
+	    merge_run(&runs[i], &runs[j]);
+	    runs[i].next_move_no_extrusion = runs[j].next_move_no_extrusion;
+	} else {
+	    runs[++i] = runs[j];
+	    n_after += runs[i].t != runs[i-1].t;
+	}
+    }
+    n_runs = i+1;
+
+    if (n_reordered > 0) fprintf(report_out, "Reordered the tools in %d layers, removing %d tool changes\n", n_reordered, n_before - n_after);
+
+    free(order);
+    free(sorted);
+}
+
+static int
 prune_runs()
 {
+    if (purge_any_infill) {
+	if (printer->transition_in_infill || printer->transition_in_support) reorder_runs_by_path();
+	else fprintf(stderr, "Warning: --purge-any-infill needs transitionInInfill or transitionInSupport\n");
+    }
     merge_consecutive_runs();
     merge_negative_height_runs();
-    merge_compatible_runs();
+    if (! merge_compatible_runs()) return 0;
+    if (reorder_tools) reorder_runs_by_tool();
+    return 1;
 }
 
-static void
+/* A sequential print finishes each object before starting the next so
+ * the extrusion height drops back down to the first layer.
+ */
+
+static int
+starts_new_object(double z)
+{
+    return n_runs > 0 && z < start_z - printer->max_layer_height && z <= runs[0].z + EPSILON;
+}
+
+static int
 preprocess()
 {
     int check_next_move = 0;
@@ -560,8 +869,11 @@ preprocess()
 
     start_path = UNKNOWN_PATH;
     start_z = 0;
+    start_object = cur_object = 0;
     start_e = cur_max_e = 0;
     abs_max_e = abs_start_e = 0;
+    high_e = 0;
+    n_boundaries = n_segments = 0;
 
     while (1) {
 	token_t t = get_next_token();
@@ -579,14 +891,19 @@ preprocess()
 		    /* Delay setting this because we need to parse the retract_mm length first! */
 		    abs_max_e = abs_start_e = printer->prime_mm - retract_mm;
 		}
-		if (start_z != t.x.move.z) bed_usage_new_layer(bed_usage, t.x.move.z);
+		if (start_z != t.x.move.z) {
+		    if (starts_new_object(t.x.move.z)) cur_object++;
+		    bed_usage_new_layer(bed_usage, t.x.move.z, cur_object);
+		}
 		if (start_path == UNKNOWN_PATH) {
 		    start_path = cur_path;
 		    start_z = t.x.move.z;
+		    start_object = cur_object;
 		}
 	        if (t.x.move.z != start_z || start_path != cur_path) {
 		    add_run(t.pos);
 		    start_z = t.x.move.z;
+		    start_object = cur_object;
 		    cur_max_e = start_e = last_e;
 		    start_path = cur_path;
 		    check_next_move = 1;
@@ -598,6 +915,7 @@ preprocess()
 	    break;
 	case SET_E:
 	    add_run(t.pos);
+	    high_e += t.x.e - last_e;
 	    cur_max_e = start_e = last_e = t.x.e;
 	    break;
 	case FAN:
@@ -607,7 +925,7 @@ preprocess()
 	    if (tool != t.x.tool) {
 		if (! has_started) {
 		    fprintf(stderr, "** ERROR *** Tool change before in prefix gcode\n");
-		    exit(1);
+		    return 0;
 		}
 		add_run(t.pos);
 		cur_max_e = start_e = last_e;
@@ -621,8 +939,8 @@ preprocess()
 	    break;
 	case DONE:
 	    add_run(ftell(f));
-    	    prune_runs();
-	    return;
+	    n_objects = cur_object + 1;
+	    return prune_runs();
 	case KISS_EXT:
 	case OTHER:
 	    break;
@@ -634,9 +952,15 @@ static int is_first_layer = 1;
 static double layer_transition_e;
 static double transition_e;
 static double transition_pct;
+static double tower_pct[MAX_TOWERS];
+static transition_block_t *block;	/* the tower of the current transition */
+static tower_layer_t *tower_layer;
 static double ping_schedule_e;
 static double ping_complete_e;
+static double ping_complete_mm;
+static double object_e, object_max_e, object_mm_at_splice;
 static double total_ext[N_DRIVES];
+static double slow_until_e, slow_multiplier = 1;
 
 static double
 base_extrusion_speed(double layer_height)
@@ -664,6 +988,7 @@ move_to_and_extrude_common(double x, double y, double z, double e, double speed_
     if (isfinite(y)) fprintf(o, " Y%f", y);
     if (isfinite(z)) fprintf(o, " Z%f", z);
     if (isfinite(e)) {
+	if (e <= slow_until_e) speed_multiplier *= slow_multiplier;
 	fprintf(o, " E%f F%f\n", e_is_absolute ? e : e - transition_e, extrusion_speed(layer_height) * speed_multiplier);
 	transition_e = e;
     } else {
@@ -689,6 +1014,61 @@ move_to(double x, double y, double z)
     move_to_and_extrude(x, y, z, NAN, NAN);
 }
 
+/* Resume the input at a different run: retract, travel to where that run
+ * starts and put the extruder back into the state it expects.
+ */
+
+static void
+jump_to_segment(int i)
+{
+    segment_t *s = &segments[i];
+    gcode_state_t *state = &s->state;
+    double retracted = high_e - last_e;
+    double retract = fmax(retract_mm, state->retracted);
+    double z = fmax(last_z, state->z);
+    double e = 0;
+
+    cur_segment = i;
+    segment_delta = s->pos - s->start;
+    fseek(f, s->start, SEEK_SET);
+
+    if (! o) return;
+
+    fprintf(o, "; Reordered: resuming input at %ld\n", s->start);
+    if (e_is_absolute) fprintf(o, "G92 E0\n");
+    if (retract > retracted) {
+	e -= retract - retracted;
+	fprintf(o, "G1 E%f F%f\n", e_is_absolute ? e : -(retract - retracted), retract_mm_per_min);
+    }
+    /* Never go back down into a part of the layer that was already printed */
+    move_to(NAN, NAN, z + z_hop);
+    move_to(state->x, state->y, NAN);
+    move_to(NAN, NAN, z);
+    if (retract > state->retracted) {
+	e += retract - state->retracted;
+	fprintf(o, "G1 E%f F%f\n", e_is_absolute ? e : retract - state->retracted, retract_mm_per_min);
+    }
+    if (state->e_is_absolute != e_is_absolute) fprintf(o, "%s\n", state->e_is_absolute ? "M82" : "M83");
+    if (state->e_is_absolute) fprintf(o, "G92 E%f\n", state->e);
+    if (state->f > 0) fprintf(o, "G1 F%f\n", state->f);
+    if (state->fan != last_fan) {
+	if (state->fan > 0) fprintf(o, "M106 S%f\n", state->fan);
+	else fprintf(o, "M107\n");
+    }
+
+    last_x = state->x;
+    last_y = state->y;
+    last_z = z;
+    last_e = state->e;
+    last_f = state->f;
+    high_e = state->e + state->retracted;
+    last_fan = state->fan;
+    cur_path = state->path;
+    e_is_absolute = state->e_is_absolute;
+    tool = state->tool;
+    in_slic3r_crap = state->in_slic3r_crap;
+}
+
 static void
 do_retraction_transition()
 {
@@ -732,12 +1112,31 @@ add_splice(int drive, double mm, double pre_mm, extrusion_state_t *e)
     splices[n_splices].mm = mm + pre_mm;
     splices[n_splices].waste = e->acc_waste + pre_mm;
     splices[n_splices].transition_mm = e->acc_transition + pre_mm;
+    splices[n_splices].gcode_offset = ftell(o);
+    splices[n_splices].gcode_mm = mm;
     total_ext[drive] += splices[n_splices].mm - (n_splices == 0 ? 0 : splices[n_splices-1].mm);
     n_splices++;
 
     e->acc_waste = e->acc_transition = -pre_mm;
 }
 
+/* Splices between drives with the same filament go where the tool change
+ * was, before transition t and anything after pos.
+ */
+
+static void
+add_alias_splices(int t, long pos, extrusion_state_t *e)
+{
+    for (; next_alias_splice < n_alias_splices; next_alias_splice++) {
+	alias_splice_t *a = &alias_splices[next_alias_splice];
+
+	if (a->transition > t || a->offset > pos) break;
+	e->total_e += a->mm;
+	fprintf(o, "; splice at %2f (same filament)\n", e->total_e);
+	add_splice(a->drive, e->total_e, 0, e);
+    }
+}
+
 static void
 generate_pause(int ms)
 {
@@ -748,27 +1147,113 @@ generate_pause(int ms)
     if (ms > 0) fprintf(o, "G4 P%d\n", ms);
 }
 
+/* Jog pauses keep the head moving back and forth (without extruding) for
+ * roughly the same time as the dwell they replace.  G90 also makes E
+ * absolute again on Marlin, so relative E is restored after it.
+ */
+
+#define JOG_MM			5
+#define JOG_MM_PER_MIN		600
+
+static void
+generate_jog_pause(int ms, double x)
+{
+    double mm_per_min = JOG_MM_PER_MIN;
+    double ms_per_jog = JOG_MM / mm_per_min * 60 * 1000;
+    double centre_x = printer->circular ? 0 : printer->bed_x / 2;
+    double dir = x < centre_x ? 1 : -1;
+    int n = ceil(ms / ms_per_jog / 2) * 2;
+    int i;
+
+    fprintf(o, "G91\n");
+    for (i = 0; i < n; i++) {
+	fprintf(o, "G1 X%f F%f\n", i % 2 == 0 ? dir * JOG_MM : -dir * JOG_MM, mm_per_min);
+    }
+    fprintf(o, "G90\n");
+    if (! e_is_absolute) fprintf(o, "M83\n");
+}
+
+static int
+has_mechanical_ping()
+{
+    return printer->mechanical_ping_gcode && printer->mechanical_ping_gcode[0];
+}
+
+/* The output goes through the time estimator so what it has buffered
+ * has to be flushed before it is told what is being printed.
+ */
+
+static void
+set_time_context(time_category_t context)
+{
+    fflush(o);
+    print_time_set_context(print_time, context);
+}
+
+static void
+generate_ping_pause(int ms, double x)
+{
+    time_category_t context = print_time_get_context(print_time);
+
+    set_time_context(TIME_PING);
+    if (has_mechanical_ping()) {
+	const char *gcode = printer->mechanical_ping_gcode;
+
+	fprintf(o, "%s", gcode);
+	if (gcode[strlen(gcode)-1] != '\n') fprintf(o, "\n");
+    } else if (printer->jog_pauses) {
+	generate_jog_pause(ms, x);
+    } else {
+	generate_pause(ms);
+    }
+    set_time_context(context);
+}
+
 static void
 move_off_tower(double x, double y)
 {
     double new_x, new_y;
 
-    if (fabs(transition_block.x - x) < fabs(transition_block.x + transition_block.w - x)) {
-	new_x = transition_block.x - printer->nozzle;
+    if (fabs(block->x - x) < fabs(block->x + block->w - x)) {
+	new_x = block->x - printer->nozzle;
     } else {
-	new_x = transition_block.x + transition_block.w + printer->nozzle;
+	new_x = block->x + block->w + printer->nozzle;
     }
 
-    if (fabs(transition_block.y - y) < fabs(transition_block.y + transition_block.h - y)) {
-	new_y = transition_block.y - printer->nozzle;
+    if (fabs(block->y - y) < fabs(block->y + block->h - y)) {
+	new_y = block->y - printer->nozzle;
     } else {
-	new_y = transition_block.y + transition_block.h + printer->nozzle;
+	new_y = block->y + block->h + printer->nozzle;
     }
 
     if (fabs(x  - new_x) < fabs(y - new_y)) move_to(new_x, NAN, NAN);
     else move_to(NAN, new_y, NAN);
 }
 
+static int
+ping_moves_off_tower()
+{
+    return printer->ping_off_tower && ! printer->side_transitions;
+}
+
+/* --stop-at-ping: the gcode ends at the ping.  Whatever is still written
+ * while unwinding back to produce_gcode() is thrown away.
+ */
+
+static FILE *stopped_o;
+static char *discard_buf;
+static size_t discard_len;
+
+static void
+stop_output()
+{
+    FILE *discard;
+
+    if (stopped_o || (discard = open_memstream(&discard_buf, &discard_len)) == NULL) return;
+    stopped_o = o;
+    o = discard;
+}
+
 static void
 check_ping_start(double x, double y, double start_total_e)
 {
@@ -782,14 +1267,11 @@ check_ping_start(double x, double y, double start_total_e)
 	n_pings++;
 
 	fprintf(o, "; ping %d pause 1 at %f\n", n_pings, pings[n_pings-1].mm);
-	if (stop_at_ping == n_pings) {
-		fclose(o);
-		exit(0);
-	}
+	if (stop_at_ping == n_pings) stop_output();
 
-	if (printer->ping_off_tower) move_off_tower(x, y);
-	generate_pause(13000);
-	if (printer->ping_off_tower) move_to(x, y, NAN);
+	if (ping_moves_off_tower()) move_off_tower(x, y);
+	generate_ping_pause(13000, x);
+	if (ping_moves_off_tower()) move_to(x, y, NAN);
 	undo_retraction_transition();
     }
 }
@@ -801,14 +1283,60 @@ check_ping_complete(double x, double y)
 	fprintf(o, "; ping %d pause 2 at %f (%.2fmm extra)\n", n_pings, pings[n_pings-1].mm + 20 + (transition_e - ping_complete_e), transition_e - ping_complete_e);
 	do_retraction_transition();
 	ping_complete_e = 0;
-	if (printer->ping_off_tower) move_off_tower(x, y);
-	generate_pause(7000);
-        if (printer->ping_off_tower) move_to(x, y, NAN);
+	if (ping_moves_off_tower()) move_off_tower(x, y);
+	generate_ping_pause(7000, x);
+        if (ping_moves_off_tower()) move_to(x, y, NAN);
 	undo_retraction_transition();
 	fprintf(o, "; Resuming transition block\n");
     }
 }
 
+/* Pings that are placed in the object are tracked by absolute filament
+ * position.  The position is the total at the last splice plus however
+ * much new filament the object has extruded since then.
+ */
+
+static double
+object_position(extrusion_state_t *e)
+{
+    return e->total_e + object_max_e - object_mm_at_splice;
+}
+
+static void
+track_object_extrusion(token_t *t)
+{
+    object_e += t->x.move.e - last_e;
+    if (object_e > object_max_e) object_max_e = object_e;
+}
+
+static void
+check_object_ping(extrusion_state_t *e)
+{
+    double mm = object_position(e);
+
+    if (n_pings < n_planned_pings && mm >= planned_pings[n_pings]) {
+	/* Recorded after the retraction, like the pings in the tower */
+	pings[n_pings].mm = mm;
+	if (! printer->pings_ignore_retraction) pings[n_pings].mm -= retract_mm;
+	n_pings++;
+
+	fprintf(o, "; ping %d pause 1 at %f in the object\n", n_pings, pings[n_pings-1].mm);
+	if (stop_at_ping == n_pings) stop_output();
+
+	do_retraction_last_e();
+	generate_ping_pause(13000, last_x);
+	undo_retraction_last_e();
+	ping_complete_mm = mm + 20;
+    } else if (ping_complete_mm > 0 && mm >= ping_complete_mm) {
+	fprintf(o, "; ping %d pause 2 at %f in the object (%.2fmm extra)\n", n_pings, mm, mm - ping_complete_mm);
+	do_retraction_last_e();
+	generate_ping_pause(7000, last_x);
+	undo_retraction_last_e();
+	ping_complete_mm = 0;
+	fprintf(o, "; Resuming object\n");
+    }
+}
+
 typedef enum {
     BOTTOM_LEFT = 0, BOTTOM_RIGHT, TOP_RIGHT, TOP_LEFT
 } corner_t;
@@ -830,10 +1358,10 @@ transition_block_corner_x(int corner, double early)
 {
     corner = corner % 4;
     switch(corner) {
-    case 0: return transition_block.x;
-    case 1: return transition_block.x + transition_block.w - early;
-    case 2: return transition_block.x + transition_block.w;
-    case 3: return transition_block.x + early;
+    case 0: return block->x;
+    case 1: return block->x + block->w - early;
+    case 2: return block->x + block->w;
+    case 3: return block->x + early;
     }
     assert(0);
 }
@@ -843,10 +1371,10 @@ transition_block_corner_y(int corner, double early)
 {
     corner = corner % 4;
     switch(corner) {
-    case 0: return transition_block.y + early;
-    case 1: return transition_block.y;
-    case 2: return transition_block.y + transition_block.h - early;
-    case 3: return transition_block.y + transition_block.h;
+    case 0: return block->y + early;
+    case 1: return block->y;
+    case 2: return block->y + block->h - early;
+    case 3: return block->y + block->h;
     }
     assert(0);
 }
@@ -884,25 +1412,25 @@ typedef struct {
 static double
 transition_block_adjusted_x(layer_t *l)
 {
-    return transition_block.x + (l->use_perimeter ? printer->nozzle/2 : 0);
+    return block->x + (tower_layer->use_perimeter ? printer->nozzle/2 : 0);
 }
 
 static double
 transition_block_adjusted_y(layer_t *l)
 {
-    return transition_block.y + (l->use_perimeter ? printer->nozzle/2 : 0);
+    return block->y + (tower_layer->use_perimeter ? printer->nozzle/2 : 0);
 }
 
 static double
 transition_block_adjusted_w(layer_t *l)
 {
-    return transition_block.w - 2*(l->use_perimeter ? printer->nozzle/2 : 0);
+    return block->w - 2*(tower_layer->use_perimeter ? printer->nozzle/2 : 0);
 }
 
 static double
 transition_block_adjusted_h(layer_t *l)
 {
-    return transition_block.h - 2*(l->use_perimeter ? printer->nozzle/2 : 0);
+    return block->h - 2*(tower_layer->use_perimeter ? printer->nozzle/2 : 0);
 }
 
 static double
@@ -983,12 +1511,12 @@ record_move_and_extrude(xye_t *xye, xy_t *xy, double e)
 static void
 transition_fill(layer_t *l, transition_t *t, double start_total_e)
 {
-    double stride0 = (1 / l->density) * printer->nozzle;
+    double stride0 = (1 / tower_layer->density) * printer->nozzle;
     double stride = sqrt(2 * stride0 * stride0);
     double x_stride = stride;
     double y_stride = stride;
     xy_t xy, next_xy;
-    int is_last = t->num == l->transition0 + l->n_transitions - 1;
+    int is_last = t->num == tower_layer->last;
     corner_t corner = layer_to_corner(l);
     static xye_t xye[10000];
     int n_xye = 0;
@@ -1026,7 +1554,7 @@ transition_fill(layer_t *l, transition_t *t, double start_total_e)
 
     scale = ((t->pre_mm + t->post_mm) - (start)) / (xye[n_xye-1].e - start);
 
-    fprintf(o, "; Filling in the tower portion, density = %f, extrusion-width = %f\n", l->density, printer->nozzle * scale);
+    fprintf(o, "; Filling in the tower portion, density = %f, extrusion-width = %f\n", tower_layer->density, printer->nozzle * scale);
 
     transition_e = start;
     for (i = 0; i < n_xye; i++) {
@@ -1043,6 +1571,74 @@ transition_fill(layer_t *l, transition_t *t, double start_total_e)
     }
 }
 
+/* Side transitions park the nozzle off the bed, either at a fixed position
+ * or just past the configured edge of the bed, and purge in place.
+ */
+
+static void
+side_transition_xy(xy_t *xy)
+{
+    const char *edge = printer->purge_edge ? printer->purge_edge : "west";
+    double offset = printer->purge_edge_offset;
+    double min_x = 0, max_x = printer->bed_x, min_y = 0, max_y = printer->bed_y;
+
+    if (printer->purge_in_place) {
+	xy->x = printer->purge_x;
+	xy->y = printer->purge_y;
+	return;
+    }
+
+    xy->x = last_x;
+    xy->y = last_y;
+
+    if (printer->circular) {
+	double r = printer->diameter / 2;
+
+	if (strcasecmp(edge, "north") == 0 || strcasecmp(edge, "south") == 0) {
+	    double x = fmin(fmax(last_x, -r), r);
+	    min_y = -sqrt(r*r - x*x);
+	    max_y = -min_y;
+	} else {
+	    double y = fmin(fmax(last_y, -r), r);
+	    min_x = -sqrt(r*r - y*y);
+	    max_x = -min_x;
+	}
+    }
+
+    if (strcasecmp(edge, "north") == 0) xy->y = max_y + offset;
+    else if (strcasecmp(edge, "south") == 0) xy->y = min_y - offset;
+    else if (strcasecmp(edge, "east") == 0) xy->x = max_x + offset;
+    else xy->x = min_x - offset;
+}
+
+static void
+side_transition_extrude(double e)
+{
+    fprintf(o, "G1 E%f F%f\n", e_is_absolute ? e : e - transition_e, printer->purge_speed * 60 * (e <= slow_until_e ? slow_multiplier : 1));
+    transition_e = e;
+}
+
+static void
+side_transition_purge(transition_t *t, xy_t *xy, double start_total_e)
+{
+    double mm = t->pre_mm + t->post_mm;
+
+    fprintf(o, "; Purging off the bed at %f,%f\n", xy->x, xy->y);
+
+    while (1) {
+	double next_e = mm;
+
+	check_ping_start(xy->x, xy->y, start_total_e);
+	check_ping_complete(xy->x, xy->y);
+
+	if (transition_e >= mm - EPSILON) break;
+
+	if (ping_schedule_e > transition_e && ping_schedule_e < next_e) next_e = ping_schedule_e;
+	if (ping_complete_e > transition_e && ping_complete_e < next_e) next_e = ping_complete_e;
+	side_transition_extrude(next_e);
+    }
+}
+
 static void
 report_speed(FILE *o, layer_t *l, double mm_per_min)
 {
@@ -1058,12 +1654,26 @@ static void
 generate_transition(layer_t *l, transition_t *t, extrusion_state_t *e)
 {
     double original_e, start_total_e;
+    double travel_z = l->z + z_hop;
+    int lifted = 0;
     xy_t start_xy;
 
     start_total_e = e->total_e + t->mm_from_runs;
+    block = &transition_blocks[t->tower];
+
+    /* A tool change between the objects of a sequential print happens
+     * once the slicer has lifted the nozzle clear of them, so travel to
+     * the tower and back at that height.
+     */
+    if (n_objects > 1 && last_z > travel_z + EPSILON) {
+	travel_z = last_z;
+	lifted = 1;
+    }
+    tower_layer = &l->towers[t->tower];
 
     if (t->from != t->to) {
 	e->total_e += t->mm_from_runs;
+	object_mm_at_splice = object_max_e;
 	fprintf(o, "; splice at %2f = %2f + %.2f\n", e->total_e + t->pre_mm, e->total_e, t->pre_mm);
 	add_splice(t->from, e->total_e, t->pre_mm, e);
     }
@@ -1073,30 +1683,40 @@ generate_transition(layer_t *l, transition_t *t, extrusion_state_t *e)
     fprintf(o, "; transition: %d->%d at %f splice length %f\n", t->from, t->to, start_total_e, n_splices > 1 ? splices[n_splices-1].mm - splices[n_splices-2].mm : splices[n_splices-1].mm);
     if (t->needs_retraction) fprintf(o, ";     retraction needed\n");
     fprintf(o, ";     length: %f (%f || %f)\n", t->pre_mm + t->post_mm, t->pre_mm, t->post_mm);
-    fprintf(o, ";      speed: ");
-    report_speed(o, l, extrusion_speed(l->h));
-    if (l->transition0 == t->num && l->use_perimeter) {
-	fprintf(o, ", perimeter: ");
-	report_speed(o, l, extrusion_speed(l->h) * printer->perimeter_speed_multiplier);
+    if (! printer->side_transitions) {
+	fprintf(o, ";      speed: ");
+	report_speed(o, l, extrusion_speed(l->h));
+	if (tower_layer->first == t->num && tower_layer->use_perimeter) {
+	    fprintf(o, ", perimeter: ");
+	    report_speed(o, l, extrusion_speed(l->h) * printer->perimeter_speed_multiplier);
+	}
+	fprintf(o, "\n");
     }
-    fprintf(o, "\n");
 
+    set_time_context(TIME_TOWER);
     if (t->needs_retraction) do_retraction_last_e();
-    move_to(NAN, NAN, l->z + z_hop);
+    move_to(NAN, NAN, travel_z);
 
     if (last_fan > 0) fprintf(o, "M107\n");
 
-    if (l->transition0 == t->num) {
-	transition_pct = 0;
-	layer_transition_e = 0;
-    }
+    if (l->transition0 == t->num) layer_transition_e = 0;
+    if (tower_layer->first == t->num) tower_pct[t->tower] = 0;
+    transition_pct = tower_pct[t->tower];
 
-    pct_to_xy(l, 0, transition_pct, &start_xy);
-    move_to(start_xy.x, start_xy.y, NAN);
-    if (z_hop) move_to(NAN, NAN, l->z);
+    if (printer->side_transitions) {
+	side_transition_xy(&start_xy);
+	move_to(start_xy.x, start_xy.y, NAN);
+    } else {
+	pct_to_xy(l, 0, transition_pct, &start_xy);
+	move_to(start_xy.x, start_xy.y, NAN);
+	if (z_hop || lifted) move_to(NAN, NAN, l->z);
+    }
 
     if (t->ping) {
 	ping_schedule_e = 20 + retract_mm;
+    } else if (ping_in_object) {
+	ping_schedule_e = n_pings < n_planned_pings ? fmax(planned_pings[n_pings] - start_total_e, EPSILON) : 0;
+	ping_complete_e = ping_complete_mm > 0 ? fmax(ping_complete_mm - start_total_e, EPSILON) : 0;
     } else {
 	ping_schedule_e = ping_complete_e = 0;
     }
@@ -1105,26 +1725,38 @@ generate_transition(layer_t *l, transition_t *t, extrusion_state_t *e)
 
     fprintf(o, "G92 E0\n");
     transition_e = 0;
+    slow_until_e = t->pre_mm;
+    slow_multiplier = t->speed_multiplier;
 
-    if (l->transition0 == t->num && l->use_perimeter) draw_perimeter(l, t);
-    transition_fill(l, t, start_total_e);
+    if (printer->side_transitions) {
+	side_transition_purge(t, &start_xy, start_total_e);
+    } else {
+	if (tower_layer->first == t->num && tower_layer->use_perimeter) draw_perimeter(l, t);
+	transition_fill(l, t, start_total_e);
+	tower_pct[t->tower] = transition_pct;
+    }
 
     fprintf(o, "; transition done: %d->%d actually used %f mm for %f (%f || %f) at %f\n", t->from, t->to, transition_e, t->pre_mm + t->post_mm, t->pre_mm, t->post_mm, start_total_e + transition_e);
 
 
+    if (ping_in_object) ping_complete_mm = ping_complete_e > 0 ? start_total_e + ping_complete_e : 0;
+
+    slow_until_e = 0;
+    slow_multiplier = 1;
+
     e->acc_transition  += t->infill_mm + t->pre_mm + t->post_mm + t->support_mm;
     e->acc_transition  += transition_e - (t->pre_mm + t->post_mm);
     e->acc_waste       += transition_e;
     e->total_e         += transition_e;
     layer_transition_e += transition_e;
 
-    assert(t->num != l->transition0 + l->n_transitions - 1 || fabs(transition_pct - 1) < 0.001);
+    assert(printer->side_transitions || t->num != tower_layer->last || fabs(transition_pct - 1) < 0.001);
 
     do_retraction_transition();
 
-    if (z_hop) move_to(NAN, NAN, l->z+z_hop);
+    if (z_hop || lifted) move_to(NAN, NAN, travel_z);
 
-    if (t->next_move_no_extrusion) {
+    if (t->next_move_no_extrusion && ! lifted) {
 	e->next_move_full = 1;
     } else {
 	move_to(last_x, last_y, NAN);
@@ -1133,8 +1765,13 @@ generate_transition(layer_t *l, transition_t *t, extrusion_state_t *e)
 
     if (t->needs_retraction) undo_retraction_transition();
 
+    /* The object carries on from where it left off, which matters when
+     * another transition follows at the same place.
+     */
+    last_e = original_e;
     if (e_is_absolute) fprintf(o, "G92 E%f\n", original_e);
     if (last_fan > 0) fprintf(o, "M106 S%f\n", last_fan);
+    set_time_context(TIME_OBJECT);
 }
 
 static void
@@ -1172,25 +1809,37 @@ produce_gcode()
     extrusion_state_t e = { 0, };
     double squash_e = NAN;
 
-    last_e = last_x = last_y = last_z = 0;
+    last_e = last_x = last_y = last_z = high_e = 0;
+    last_fan = 0;
+    is_first_layer = 1;
+    n_splices = n_pings = 0;
+    next_alias_splice = 0;
+    memset(total_ext, 0, sizeof(total_ext));
+    object_e = object_max_e = 0;
+    object_mm_at_splice = retract_mm - printer->prime_mm;
+    ping_complete_mm = 0;
 
     rewind_input();
-    while (1) {
+    while (! stopped_o) {
 	token_t token = get_next_token();
 
-	if (t < n_transitions && token.pos >= transitions[t].offset) {
+	while (t < n_transitions && token.pos >= transitions[t].offset) {
+	    add_alias_splices(t, token.pos, &e);
 	    generate_transition(&layers[l], &transitions[t], &e);
 	    t++;
 	    if (layers[l].transition0 + layers[l].n_transitions == t) {
 		l++;
-		is_first_layer = 0;
+		is_first_layer = l < n_layers && layers[l].object != layers[l-1].object;
 	    }
 	    assert(l >= n_layers || (layers[l].transition0 <= t && t < layers[l].transition0 + layers[l].n_transitions));
 	}
+	add_alias_splices(t, token.pos, &e);
 
 	switch(token.t) {
 	case MOVE:
 	    //assert(t == 0 || l >= n_layers || token.x.move.e == last_e || token.x.move.z == layers[l].z);
+	    if (ping_in_object) check_object_ping(&e);
+	    track_object_extrusion(&token);
 	    update_last_state(&token);
 	    if (cur_path == INTERFACE && squash_interface) {
 		e.next_move_full = 1;
@@ -1221,7 +1870,7 @@ produce_gcode()
 	    break;
 	case DONE:
 	    e.total_e += transition_final_mm + transition_final_waste;
-	    add_splice(tool, e.total_e, 0, &e);
+	    add_splice(transition_final_drive, e.total_e, 0, &e);
 	    splices[n_splices-1].waste += transition_final_waste;
 	    return;
 	case KISS_EXT:
@@ -1240,6 +1889,7 @@ produce_gcode()
 	    }
 	    break;
 	case SET_E:
+	    high_e += token.x.e - last_e;
 	    last_e = token.x.e;
 	    fprintf(o, "%s", buf);
 	    break;
@@ -1253,24 +1903,230 @@ produce_gcode()
     }
 }
 
-void gcode_to_runs(const char *fname)
+/* Forget everything about the previous input so that another one can be
+ * converted by the same process.
+ */
+
+static void
+reset_input_state()
 {
-    if ((f = fopen(fname, "r")) == NULL) {
-	perror(fname);
-	return;
+    slicer = UNKNOWN;
+    n_runs = 0;
+    n_objects = 1;
+    memset(used_tool, 0, sizeof(used_tool));
+    memset(tool_mm, 0, sizeof(tool_mm));
+    seen_tool = n_used_tools = 0;
+    cur_path = NORMAL;
+    last_x = last_y = last_z = last_e = last_f = 0;
+    retract_mm = retract_mm_per_min = z_hop = 0;
+    travel_mm_per_min = s3d_default_speed = infill_mm_per_min = first_layer_mm_per_min = 0;
+    flow_max_mm3_per_sec = DBL_MAX;
+    n_boundaries = n_segments = 0;
+}
+
+static void
+reset_input()
+{
+    gcode_close_input();
+    reset_input_state();
+}
+
+/* The result of pass 1 (the runs, where they are in the input, the bed
+ * usage and what was learnt about the slicer) is cached in runs_cache_dir
+ * under a hash of the input and of the settings pass 1 depends on.  Bump
+ * RUNS_CACHE_VERSION whenever pass 1 changes what it produces.
+ */
+
+#define RUNS_CACHE_VERSION	1
+#define RUNS_CACHE_MAGIC	"g2m-runs"
+
+typedef struct {
+    char magic[8];
+    int version;
+    unsigned long long key;
+    int sizes[4];
+} runs_cache_header_t;
+
+static unsigned long long
+runs_cache_key()
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int version = RUNS_CACHE_VERSION;
+    static char in_buf[64*1024];
+    size_t len, total = 0;
+
+    h = HASH(h, version);
+    h = HASH(h, printer->prime_mm);
+    h = HASH(h, printer->max_layer_height);
+    h = HASH(h, printer->transition_in_infill);
+    h = HASH(h, printer->transition_in_support);
+    h = HASH(h, printer->circular);
+    h = HASH(h, printer->diameter);
+    h = HASH(h, printer->bed_x);
+    h = HASH(h, printer->bed_y);
+    h = HASH(h, squash_interface);
+    h = HASH(h, purge_any_infill);
+    h = HASH(h, reorder_tools);
+
+    rewind(f);
+    while ((len = fread(in_buf, 1, sizeof(in_buf), f)) > 0) {
+	h = hash_bytes(h, in_buf, len);
+	total += len;
     }
+    h = HASH(h, total);
 
-    preprocess();
+    return h;
 }
 
-void gcode_to_msf_gcode(const char *output_fname)
+static void
+runs_cache_header(runs_cache_header_t *hdr, unsigned long long key)
 {
-    if ((o = fopen(output_fname, "w")) == NULL) {
-	perror(output_fname);
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, RUNS_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = RUNS_CACHE_VERSION;
+    hdr->key = key;
+    hdr->sizes[0] = sizeof(run_t);
+    hdr->sizes[1] = sizeof(boundary_t);
+    hdr->sizes[2] = sizeof(segment_t);
+    hdr->sizes[3] = N_GCODE_PARAMS;
+}
+
+static char *
+runs_cache_fname(unsigned long long key, const char *suffix)
+{
+    char *fname = malloc(strlen(runs_cache_dir) + strlen(suffix) + 30);
+
+    sprintf(fname, "%s/%016llx.runs%s", runs_cache_dir, key, suffix);
+    return fname;
+}
+
+#define WRITE(v, n) (fwrite(v, sizeof(*(v)), n, c) == (n))
+#define READ(v, n) (fread(v, sizeof(*(v)), n, c) == (n))
+
+static void
+save_runs(unsigned long long key)
+{
+    runs_cache_header_t hdr;
+    char *fname = runs_cache_fname(key, "");
+    char *tmp = runs_cache_fname(key, ".tmp");
+    FILE *c;
+    int i, ok;
+
+    if ((c = fopen(tmp, "w")) == NULL) {
+	perror(tmp);
+	free(fname);
+	free(tmp);
 	return;
     }
 
+    runs_cache_header(&hdr, key);
+    ok = WRITE(&hdr, 1) && WRITE(&slicer, 1) && WRITE(&cur_path, 1) && WRITE(&last_f, 1);
+    for (i = 0; ok && i < N_GCODE_PARAMS; i++) ok = WRITE(gcode_params[i].value, 1);
+    ok = ok && WRITE(&n_runs, 1) && WRITE(runs, n_runs) && WRITE(&n_objects, 1) &&
+	 WRITE(used_tool, N_DRIVES) && WRITE(&n_used_tools, 1) && WRITE(&seen_tool, 1) && WRITE(tool_mm, N_DRIVES) &&
+	 WRITE(&n_boundaries, 1) && WRITE(boundaries, n_boundaries) &&
+	 WRITE(&n_segments, 1) && WRITE(segments, n_segments) &&
+	 bed_usage_save(bed_usage, c);
+
+    if (fclose(c) != 0) ok = 0;
+    if (! ok || rename(tmp, fname) != 0) {
+	perror(fname);
+	unlink(tmp);
+    }
+    free(fname);
+    free(tmp);
+}
+
+static int
+load_runs(unsigned long long key)
+{
+    runs_cache_header_t hdr, want;
+    char *fname = runs_cache_fname(key, "");
+    bed_usage_t *b = NULL;
+    FILE *c;
+    int i, ok;
+
+    if ((c = fopen(fname, "r")) == NULL) {
+	free(fname);
+	return 0;
+    }
+
+    runs_cache_header(&want, key);
+    ok = READ(&hdr, 1) && memcmp(&hdr, &want, sizeof(hdr)) == 0 &&
+	 READ(&slicer, 1) && READ(&cur_path, 1) && READ(&last_f, 1);
+    for (i = 0; ok && i < N_GCODE_PARAMS; i++) ok = READ(gcode_params[i].value, 1);
+    ok = ok && READ(&n_runs, 1) && n_runs >= 0 && n_runs <= MAX_RUNS && READ(runs, n_runs) && READ(&n_objects, 1) &&
+	 READ(used_tool, N_DRIVES) && READ(&n_used_tools, 1) && READ(&seen_tool, 1) && READ(tool_mm, N_DRIVES) &&
+	 READ(&n_boundaries, 1) && n_boundaries >= 0;
+    if (ok && n_boundaries > a_boundaries) {
+	a_boundaries = n_boundaries;
+	boundaries = realloc(boundaries, sizeof(*boundaries) * a_boundaries);
+    }
+    ok = ok && READ(boundaries, n_boundaries) && READ(&n_segments, 1) && n_segments >= 0;
+    if (ok) segments = realloc(segments, sizeof(*segments) * (n_segments + 1));
+    ok = ok && READ(segments, n_segments) && (b = bed_usage_load(c)) != NULL;
+    fclose(c);
+
+    if (! ok) {
+	fprintf(stderr, "%s: invalid, the gcode is processed again\n", fname);
+	free(fname);
+	reset_input_state();
+	return 0;
+    }
+
+    fprintf(report_out, "Reusing the first pass over the gcode from %s\n", fname);
+    free(fname);
+    if (bed_usage) bed_usage_destroy(bed_usage);
+    bed_usage = b;
+    return 1;
+}
+
+int gcode_to_runs(FILE *in)
+{
+    unsigned long long key = 0;
+
+    reset_input();
+    f = in;
+
+    if (runs_cache_dir) {
+	key = runs_cache_key();
+	if (load_runs(key)) {
+	    rewind_input();
+	    return 1;
+	}
+    }
+
+    rewind_input();
+    if (! preprocess()) return 0;
+
+    if (runs_cache_dir) save_runs(key);
+    return 1;
+}
+
+void gcode_close_input()
+{
+    if (f) fclose(f);
+    f = NULL;
+}
+
+int gcode_to_msf_gcode(FILE *out)
+{
+    int completed;
+
+    if (print_time) print_time_destroy(print_time);
+    print_time = print_time_new();
+    o = print_time_wrap(print_time, out);
+
     produce_gcode();
+    if ((completed = (stopped_o == NULL)) == 0) {
+	fclose(o);
+	free(discard_buf);
+	discard_buf = NULL;
+	o = stopped_o;
+	stopped_o = NULL;
+    }
     fclose(o);
     o = NULL;
+
+    return completed;
 }
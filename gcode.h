@@ -2,6 +2,7 @@
 #define __GCODE_H__
 
 #include "bed-usage.h"
+#include "print-time.h"
 
 #define MAX_RUNS        100000
 #define N_DRIVES 4
@@ -13,6 +14,8 @@ typedef struct {
     double z;
     double e;
     long   offset;
+    double x, y;
+    int    object;		/* which object of a sequential print */
     path_t path;
     int    next_move_no_extrusion;
     int    ends_with_retraction;
@@ -28,6 +31,8 @@ typedef struct {
     double mm;
     double waste;
     double transition_mm;
+    long   gcode_offset;	/* where the transition starts in the output */
+    double gcode_mm;	/* and the filament used when it starts */
 } splice_t;
 
 typedef struct {
@@ -36,6 +41,7 @@ typedef struct {
 
 extern run_t runs[MAX_RUNS];
 extern int n_runs;
+extern int n_objects;
 extern int used_tool[N_DRIVES];
 extern bed_usage_t *bed_usage;
 
@@ -50,9 +56,20 @@ extern int gcode_trace;
 extern int validate_only;
 extern int debug_tool_changes;
 extern int stop_at_ping;
+extern FILE *report_out;	/* what the conversion reports, see convert_set_report() */
 extern int squash_interface;
+extern int reorder_tools;
+extern int purge_any_infill;
+extern const char *runs_cache_dir;
+extern print_time_t *print_time;
 
-void gcode_to_runs(const char *fname);
-void gcode_to_msf_gcode(const char *output_fname);
+/* Both take over the stream.  The input is kept for producing the gcode
+ * and closed by the next gcode_to_runs() or gcode_close_input().
+ * gcode_to_runs() returns 0 if the gcode can't be converted and
+ * gcode_to_msf_gcode() returns 0 if it stopped at stop_at_ping.
+ */
+int gcode_to_runs(FILE *in);
+int gcode_to_msf_gcode(FILE *out);
+void gcode_close_input(void);
 
 #endif
@@ -3,375 +3,310 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <float.h>
+#include "batch.h"
+#include "convert.h"
 #include "gcode.h"
-#include "materials.h"
+#include "plate.h"
 #include "printer.h"
+#include "server.h"
+#include "spool.h"
+#include "sweep.h"
 #include "transition-block.h"
 
-static int summary = 0;
-static int print_bed_usage = 0;
-const char *output_fname;
+#define MATERIALS_FNAME	"config/materials.yml"
 
 static void
-output_summary()
+usage()
 {
-    int i, j, k;
-    int layer = 1;
-    double last_layer_z = 0;
-    double total[N_DRIVES] = { 0, };
-    char buf[500];
-
-    printf("Layer by layer extrusions\n");
-    printf("-------------------------\n");
-    for (i = 0; i < n_runs; i = j) {
-	double layer_total = 0;
-	int gap = N_DRIVES * 26 + 5;
-
-	printf("%5d %6.02f %6.02f", layer++, runs[i].z - last_layer_z, runs[i].z);
-	last_layer_z = runs[i].z;
-	for (j = i; j < n_runs && runs[i].z == runs[j].z; j++) {
-	    total[runs[j].t] += runs[j].e;
-	    buf[0] = '\0';
-	    if (runs[j].leading_support_mm > 0) sprintf(&buf[strlen(buf)], "%.2f|", runs[j].leading_support_mm);
-	    sprintf(&buf[strlen(buf)], "%.2f", runs[j].e);
-	    if (runs[j].trailing_infill_mm > 0) sprintf(&buf[strlen(buf)], "=%.2f", runs[j].trailing_infill_mm);
-	    printf(" %20s [%d]%c%c", buf, runs[j].t, runs[j].next_move_no_extrusion ? '!' : ' ', runs[j].ends_with_retraction ? 'R' : ' ');
-	    layer_total += runs[j].e;
-	    gap -= 26;
-	}
-	printf("%*c %10.2f totals:", gap, ' ', layer_total);
-	for (k = 0; k < N_DRIVES; k++) {
-	    printf(" %12.2f", total[k]);
-	}
-	printf("\n");
-    }
-    for (i = 0; i < N_DRIVES; i++) {
-	if (total[i]) printf("T%d: %.2f mm\n", i, total[i]);
-    }
-    printf("\n");
-    transition_block_dump_transitions(stdout);
+    fprintf(stderr, "usage: [<flags> | <colour> | <material> | <strength> | --output fname] printer.yml gcode.gcode\n");
+    fprintf(stderr, "       [--jobs n] --batch jobs.txt\n");
+    fprintf(stderr, "       --daemon socket\n");
+    fprintf(stderr, "       [--jobs n] --spool in-dir out-dir\n");
+    fprintf(stderr, "       [--jobs n] --sweep key=v1,v2,... [--sweep ...] <arguments of a conversion>\n");
+    fprintf(stderr, "       --compile-printer printer.yml | --compile-materials materials.yml\n");
+    fprintf(stderr, "  <colour>:   -cX colour to set the colour of drive \"X\" to \"colour\"\n");
+    fprintf(stderr, "  <material>: -mX material to set the material of drive \"X\" to \"material\"\n");
+    fprintf(stderr, "  <strength>: -sX strength to set the strength of the material's colour (WEAK, MEDIUM or STRONG)\n");
+    fprintf(stderr, "  <flags>: any number of:\n");
+    fprintf(stderr, "           --validate:     only plan the transitions and report whether the print can be made,\n");
+    fprintf(stderr, "                           writing nothing and exiting with 2 if it can't (1 is any other error)\n");
+    fprintf(stderr, "           --summary:      provide a more detailed summary of the print\n");
+    fprintf(stderr, "           --bed-usage:    show the usage of the print bed\n");
+    fprintf(stderr, "           --reduce-pings: ping less frequently as the print gets longer and longer\n");
+    fprintf(stderr, "           --sparse-tower: combine tower layers without a colour change up to max_layer_height\n");
+    fprintf(stderr, "           --ping-in-object: allow pings while printing the object instead of only in the tower\n");
+    fprintf(stderr, "           --reorder-tools: change the order of the tools within a layer to reduce the number of splices\n");
+    fprintf(stderr, "           --global-purge: decide where to purge (tower, infill, support) over the whole print instead of per transition\n");
+    fprintf(stderr, "           --purge-any-infill: print the infill of a layer last so all of it can be used for purging\n");
+    fprintf(stderr, "           --towers n:     split the transitions between n towers, each placed near the parts it serves\n");
+    fprintf(stderr, "           --splice-sim:   report where the printer has to wait for the palette to splice\n");
+    fprintf(stderr, "           --fix-starvation: slow down or lengthen transitions so the printer doesn't wait for splices\n");
+    fprintf(stderr, "           --plate g x y:  also print the sliced job g moved by x,y, sharing the tower with it\n");
+    fprintf(stderr, "           --alias x y:    drives x and y have the same filament, switch between them without a transition\n");
+    fprintf(stderr, "           --alias-drives: alias drives with the same material and colour\n");
+    fprintf(stderr, "           --purge-lengths f: use the purge lengths calibrated for pairs of colours in f\n");
+    fprintf(stderr, "           --cache dir:    reuse the first pass over the same gcode from dir when only the colours,\n");
+    fprintf(stderr, "                           materials or tower settings change\n");
+    fprintf(stderr, "           --msf-only:     only write the .msf again when the .msf.gcode of an earlier conversion\n");
+    fprintf(stderr, "                           with --cache would be the same, like when only the colours change\n");
+    fprintf(stderr, "  --batch:   convert each line of jobs.txt, which has the arguments of one\n");
+    fprintf(stderr, "             conversion, on n workers (default the number of cores)\n");
+    fprintf(stderr, "  --daemon:  convert on requests made on the Unix socket, see server.c\n");
+    fprintf(stderr, "  --spool:   convert the gcode written into in-dir into out-dir, n at a time,\n");
+    fprintf(stderr, "             with the settings from x.gcode.args, a \"; gcode2msf:\" comment\n");
+    fprintf(stderr, "             or in-dir/gcode2msf.args, see spool.c\n");
+    fprintf(stderr, "  --sweep:   parse the gcode once and compare the splices, pings, waste, tower size\n");
+    fprintf(stderr, "             and time of every combination of the values of printer yaml keys or of\n");
+    fprintf(stderr, "             reduce-pings, sparse-tower, global-purge, ping-in-object and towers\n");
+    fprintf(stderr, "  --compile-printer, --compile-materials: check the yaml and write a binary\n");
+    fprintf(stderr, "             snapshot of it to x.yml.bin, which is loaded instead until the yaml changes\n");
+    fprintf(stderr, "  debugging flags not normally needed are:\n");
+    fprintf(stderr, "           --debug-tool-changes: Leave Tx in the output to visualize the tool changes [DO NOT PRINT]\n");
+    fprintf(stderr, "           --stop-at-ping x: stop producing gcode at the start of ping \"x\"\n");
+    fprintf(stderr, "           --trace:        trace the gcode as it is processed\n");
 }
 
-static char *
-float_to_hex(double f, char *buf)
-{
-    unsigned v;
-    if (f == 0) strcpy(buf, "0");
-    else {
-	int shift = 0;
-
-	if (f < 0) v = 1 << 31;
-	else v = 0;
-	f = fabs(f);
+/* Apply the arguments (after argv[0]) of one conversion to c.  Returns 0
+ * if they aren't valid and -1 if a file they name can't be loaded.
+ */
 
-	while (f >= 2) {
-	   f /= 2;
-	   shift++;
-	}
-	while (f < 1) {
-	   f *= 2;
-	   shift--;
-	}
-	f = f - 1;
-	v |= (unsigned) (f * (0x800000 + 0.5));
-	v |= (shift + 0x7f) << 23;
-
-	sprintf(buf, "%x", v);
-    }
+static int
+parse_args(convert_t *c, int argc, char **argv)
+{
+    convert_options_t *o = convert_options(c);
+    const char *output_fname = NULL;
 
-    return buf;
-}
+    while (argc > 2) {
+	    if (strcmp(argv[1], "--validate") == 0) o->validate_only = 1;
+	    else if (strcmp(argv[1], "--summary") == 0) o->summary = 1;
+	    else if (strcmp(argv[1], "--bed-usage") == 0) o->bed_usage = 1;
+	    else if (strcmp(argv[1], "--trace") == 0) o->gcode_trace = 1;
+	    else if (strcmp(argv[1], "--extrusions") == 0) o->extrusions = 1;
+	    else if (strcmp(argv[1], "--reduce-pings") == 0) o->reduce_pings = 1;
+	    else if (strcmp(argv[1], "--sparse-tower") == 0) o->sparse_tower = 1;
+	    else if (strcmp(argv[1], "--ping-in-object") == 0) o->ping_in_object = 1;
+	    else if (strcmp(argv[1], "--reorder-tools") == 0) o->reorder_tools = 1;
+	    else if (strcmp(argv[1], "--global-purge") == 0) o->global_purge = 1;
+	    else if (strcmp(argv[1], "--purge-any-infill") == 0) o->purge_any_infill = 1;
+	    else if (strcmp(argv[1], "--splice-sim") == 0) o->splice_sim = 1;
+	    else if (strcmp(argv[1], "--fix-starvation") == 0) o->fix_starvation = 1;
+	    else if (strcmp(argv[1], "--debug-tool-changes") == 0) o->debug_tool_changes = 1;
+	    else if (strcmp(argv[1], "--alias-drives") == 0) o->alias_drives = 1;
+	    else if (strcmp(argv[1], "--msf-only") == 0) o->msf_only = 1;
+	    else if (argc > 2 && strcmp(argv[1], "--towers") == 0) {
+		o->n_towers = atoi(argv[2]);
+		if (o->n_towers < 1 || o->n_towers > MAX_TOWERS) {
+		    fprintf(stderr, "Invalid number of towers: %s, must be between 1 and %d\n", argv[2], MAX_TOWERS);
+		    return 0;
+		}
+		argc--;
+		argv++;
+	    } else if (argc > 4 && strcmp(argv[1], "--plate") == 0) {
+		if (! convert_add_plate_job(c, argv[2], atof(argv[3]), atof(argv[4]))) {
+		    fprintf(stderr, "Too many jobs on the plate, at most %d are supported\n", MAX_PLATE_JOBS);
+		    return 0;
+		}
+		argc -= 3;
+		argv += 3;
+	    } else if (argc > 3 && strcmp(argv[1], "--alias") == 0) {
+		int a = atoi(argv[2]), b = atoi(argv[3]);
+
+		if (a < 1 || a > N_DRIVES || b < 1 || b > N_DRIVES) {
+		    fprintf(stderr, "Invalid drives to alias: %s %s, must be between 1 and %d\n", argv[2], argv[3], N_DRIVES);
+		    return 0;
+		}
+		convert_set_alias(c, a-1, b-1);
+		argc -= 2;
+		argv += 2;
+	    } else if (argc > 2 && strcmp(argv[1], "--purge-lengths") == 0) {
+		if (! convert_set_purge_lengths(c, argv[2])) {
+		    perror(argv[2]);
+		    return -1;
+		}
+		argc--;
+		argv++;
+	    } else if (argc > 2 && strcmp(argv[1], "--cache") == 0) {
+		convert_set_cache_dir(c, argv[2]);
+		argc--;
+		argv++;
+	    } else if (argc > 2 && strcmp(argv[1], "--stop-at-ping") == 0) {
+		o->stop_at_ping = atoi(argv[2]);
+		argc--;
+		argv++;
+	    } else if (argc > 2 && (strcmp(argv[1], "--output") == 0 || strcmp(argv[1], "-o") == 0)) {
+		output_fname = argv[2];
+		argc--;
+		argv++;
+	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 'c' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
+		convert_set_material(c, atoi(&argv[1][2])-1, NULL, argv[2], UNKNOWN);
+		argc--;
+		argv++;
+	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 'm' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
+		convert_set_material(c, atoi(&argv[1][2])-1, argv[2], NULL, UNKNOWN);
+		argc--;
+		argv++;
+	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 's' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
+		colour_strength_t s;
 
-static void
-produce_msf_colours(FILE *o)
-{
-    int i;
-    int first = 1;
+		if (strcasecmp(argv[2], "weak") == 0) s = WEAK;
+		else if (strcasecmp(argv[2], "medium") == 0) s = MEDIUM;
+		else if (strcasecmp(argv[2], "strong") == 0) s = STRONG;
+		else {
+		    fprintf(stderr, "Invalid colour strength: %s, valid values of WEAK, MEDIUM or STRONG\n", argv[2]);
+		    return 0;
+		}
 
-    fprintf(o, "cu:");
-    for (i = 0; i < N_DRIVES; i++) {
-	if (! first) fprintf(o, ";");
-	first = 0;
-	if (used_tool[i]) {
-	    active_material_t *m = get_active_material(i);
-	    const char *c = m->colour;
-	    fprintf(o, "%d %s%s%s", m->m->id+1, c ? c : "", c ? " " : "", m->m->type);
-	} else {
-	    fprintf(o, "0");
-	}
+		convert_set_material(c, atoi(&argv[1][2])-1, NULL, NULL, s);
+		argc--;
+		argv++;
+	    } else if (argv[1][0] == '-') {
+		fprintf(stderr, "unknown argument: %s\n", argv[1]);
+		return 0;
+	    } else {
+		break;
+	    }
+	    argc--;
+	    argv++;
     }
-    fprintf(o, ";\r\n");
-}
 
-static void
-produce_msf_splices(FILE *o)
-{
-    int i;
-    char buf[20];
+    if (argc != 3) return 0;
 
-    for (i = 0; i < n_splices; i++) {
-	 fprintf(o, "(%02x,%s)\r\n", splices[i].drive, float_to_hex(splices[i].mm, buf));
+    if (! convert_set_printer(c, argv[1])) {
+	perror(argv[1]);
+	return -1;
     }
-}
 
-static void
-produce_msf_pings(FILE *o)
-{
-    int i;
-    char buf[20];
+    convert_set_input_file(c, argv[2]);
+    convert_set_output_file(c, output_fname ? output_fname : argv[2]);
 
-    for (i = 0; i < n_pings; i++) {
-	fprintf(o, "(64,%s)\r\n", float_to_hex(pings[i].mm, buf));
-    }
+    return 1;
 }
 
-static void
-produce_msf_splice_configuration(FILE *o, int id1, int id2)
-{
-    char buf1[20], buf2[20];
-    material_splice_t *splice;
+#define MAX_JOB_ARGS	100
 
-    if (! o) return;
-    splice = materials_find_splice(id1, id2);
-    fprintf(o, "(%d%d,%s,%s,%d)\r\n", id1+1, id2+1, float_to_hex(splice->heat, buf1), float_to_hex(splice->compression, buf2), splice->reverse);
-}
+/* A job is a line with the arguments of one conversion separated by white
+ * space.  Returns NULL if they aren't valid.
+ */
 
-static void
-count_or_produce_splice_configurations(FILE *o, int *n_out)
+static convert_t *
+job_from_line(char *line)
 {
-    int i, j;
-    int materials[N_DRIVES];
-    int n_materials = 0;
-    int n = 0;
-
-    for (i = 0; i < N_DRIVES; i++) {
-	active_material_t *m = get_active_material(i);
-	if (! used_tool[i]) continue;
-	for (j = 0; j < n_materials; j++) {
-	    if (materials[j] == m->m->id) break;
-	}
-	if (j >= n_materials) materials[n_materials++] = m->m->id;
+    char *args[MAX_JOB_ARGS];
+    int n_args = 1;
+    char *arg;
+    convert_t *c;
+
+    args[0] = "gcode2msf";
+    for (arg = strtok(line, " \t\r\n"); arg && n_args < MAX_JOB_ARGS; arg = strtok(NULL, " \t\r\n")) {
+	args[n_args++] = arg;
     }
 
-    for (i = 0; i < n_materials; i++) {
-	produce_msf_splice_configuration(o, materials[i], materials[i]);
-	n++;
-	for (j = i+1; j < n_materials; j++) {
-	    produce_msf_splice_configuration(o, materials[i], materials[j]);
-	    produce_msf_splice_configuration(o, materials[j], materials[i]);
-	    n += 2;
-	}
+    if ((c = convert_new(MATERIALS_FNAME)) == NULL) {
+	perror(MATERIALS_FNAME);
+	return NULL;
     }
-
-    if (n_out) *n_out = n;
-}
-
-static void
-produce_msf_splice_configurations(FILE *o)
-{
-    count_or_produce_splice_configurations(o, NULL);
+    if (parse_args(c, n_args, args) <= 0) {
+	convert_destroy(c);
+	return NULL;
+    }
+    return c;
 }
 
 static int
-msf_splice_configurations_n()
+is_blank_or_comment(const char *line)
 {
-    int n;
-
-    count_or_produce_splice_configurations(NULL, &n);
-    return n;
+    while (isspace(*line)) line++;
+    return *line == '\0' || *line == '#';
 }
 
-static void
-produce_msf(const char *fname)
-{
-    FILE *o;
-    char buf[20];
+/* Blank lines and lines starting with # are skipped */
 
-    if ((o = fopen(fname, "w")) == NULL) {
-	perror(fname);
-	return;
-    }
-
-    fprintf(o, "MSF1.4\r\n");
-    produce_msf_colours(o);
-    fprintf(o, "ppm:%s\r\n", float_to_hex(printer->pv / printer->calibration_len, buf));
-    fprintf(o, "lo:%04x\r\n", printer->loading_offset);
-    fprintf(o, "ns:%04x\r\n", n_splices);
-    fprintf(o, "np:%04x\r\n", n_pings);
-    fprintf(o, "nh:0000\r\n");
-    fprintf(o, "na:%04x\r\n", msf_splice_configurations_n());
-    // TODO na:
-    produce_msf_splices(o);
-    produce_msf_pings(o);
-    produce_msf_splice_configurations(o);
-}
-
-static void
-output_material_usage_and_transition_block()
+static int
+batch(const char *fname, int n_workers)
 {
-    double used[N_DRIVES] = {0, };
-    double waste[N_DRIVES] = { 0, };
-    double transition_mm[N_DRIVES] = { 0, };
-    double total_used;
-    double total_waste = 0;
-    double total_transition_mm = 0;
-    double last = 0;
-    int i;
-
-    printf("transition block:  (%.2f, %.2f) x (%.2f, %.2f)\n", transition_block.x, transition_block.y, transition_block.w, transition_block.h);
-    printf("transition layers: %d\n", n_transitions);
-    printf("number of splices: %d\n", n_splices);
-    printf("number of pings:   %d\n", n_pings);
-
-    for (i = 0; i < n_splices; i++) {
-	int d = splices[i].drive;
-
-	used[d] += splices[i].mm - last;
-	waste[d] += splices[i].waste;
-	transition_mm[d] += splices[i].transition_mm;
-	total_waste += splices[i].waste;
-	total_transition_mm += splices[i].transition_mm;
-	last = splices[i].mm;
+    FILE *f;
+    char *line = NULL;
+    size_t len = 0;
+    convert_t **jobs = NULL;
+    int n_jobs = 0, a_jobs = 0;
+    int line_no = 0;
+    int failed, i;
+
+    if ((f = fopen(fname, "r")) == NULL) {
+	perror(fname);
+	return 1;
     }
 
-    total_used = splices[n_splices-1].mm;
+    while (getline(&line, &len, f) >= 0) {
+	line_no++;
+	if (is_blank_or_comment(line)) continue;
 
-    printf("\nFilament usage:\n");
-    if (total_waste < total_transition_mm) {
-	printf("Saved %.2f%% filament using infill & support\n", (total_transition_mm - total_waste) / total_transition_mm*100);
-    }
-
-    for (i = 0; i < N_DRIVES; i++) {
-	if (used[i]) {
-	    printf("T%d: %9.2f mm + %9.2f mm waste => %9.2f mm (%.2f m)", i, used[i]-waste[i], waste[i], used[i], used[i]/1000);
-	    if (waste[i] < transition_mm[i]) printf(" saved %.2f mm", transition_mm[i] - waste[i]);
-	    printf("\n");
+	if (n_jobs >= a_jobs) {
+	    a_jobs = a_jobs ? a_jobs * 2 : 64;
+	    jobs = realloc(jobs, sizeof(*jobs) * a_jobs);
+	}
+	if ((jobs[n_jobs] = job_from_line(line)) == NULL) {
+	    fprintf(stderr, "%s:%d: invalid job\n", fname, line_no);
+	    return 1;
 	}
+	n_jobs++;
     }
-    printf("-------------------------------------------------------------------\n");
-    printf("    %9.2f mm + %9.2f mm waste => %9.2f mm (%.2f m)", total_used - total_waste, total_waste, total_used, total_used / 1000);
-    if (total_waste < total_transition_mm) printf(" saved %.2f mm", total_transition_mm - total_waste);
-    printf("\n");
-}
-
-static int
-ends_with(const char *str, const char *suffix)
-{
-    int len_str = strlen(str);
-    int len_suffix = strlen(suffix);
-
-    return len_str > len_suffix && strcmp(&str[len_str - len_suffix], suffix) == 0;
-}
+    free(line);
+    fclose(f);
 
-static char *
-get_msf_fname(const char *base)
-{
-    char *fname;
+    failed = batch_run(jobs, n_jobs, n_workers);
+    for (i = 0; i < n_jobs; i++) convert_destroy(jobs[i]);
+    free(jobs);
 
-    fname = malloc(strlen(base) + 20);
-    strcpy(fname, base);
-    if (ends_with(fname, ".gcode")) fname[strlen(fname)-6] = '\0';
-    if (! ends_with(fname, ".msf")) strcat(fname, ".msf");
-    return fname;
-}
-
-static void process(const char *fname)
-{
-    char *msf_fname;
-    char *gcode_fname;
-
-    msf_fname = get_msf_fname(output_fname ? output_fname : fname);
-    gcode_fname = malloc(strlen(msf_fname) + 20);
-    sprintf(gcode_fname, "%s.gcode", msf_fname);
-
-    gcode_to_runs(fname);
-    transition_block_create_from_runs();
-    printf("Outputting to %s\n", msf_fname);
-
-    gcode_to_msf_gcode(gcode_fname);
-    produce_msf(msf_fname);
-    if (summary) output_summary();
-    if (print_bed_usage) bed_usage_print(bed_usage, stdout);
-    output_material_usage_and_transition_block();
+    return failed > 0;
 }
 
 int main(int argc, char **argv)
 {
-    init_active_materials();
-
-    while (argc > 2) {
-	    if (strcmp(argv[1], "--validate") == 0) validate_only = 1;
-	    else if (strcmp(argv[1], "--summary") == 0) summary = 1;
-	    else if (strcmp(argv[1], "--bed-usage") == 0) print_bed_usage = 1;
-	    else if (strcmp(argv[1], "--trace") == 0) gcode_trace = 1;
-	    else if (strcmp(argv[1], "--extrusions") == 0) extrusions = 1;
-	    else if (strcmp(argv[1], "--reduce-pings") == 0) reduce_pings = 1;
-	    else if (strcmp(argv[1], "--debug-tool-changes") == 0) debug_tool_changes = 1;
-	    else if (argc > 2 && strcmp(argv[1], "--stop-at-ping") == 0) {
-		stop_at_ping = atoi(argv[2]);
-		argc--;
-		argv++;
-	    } else if (argc > 2 && (strcmp(argv[1], "--output") == 0 || strcmp(argv[1], "-o") == 0)) {
-		output_fname = argv[2];
-		argc--;
-		argv++;
-	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 'c' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
-		set_active_material(atoi(&argv[1][2])-1, NULL, argv[2], UNKNOWN);
-		argc--;
-		argv++;
-	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 'm' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
-		set_active_material(atoi(&argv[1][2])-1, argv[2], NULL, UNKNOWN);
-		argc--;
-		argv++;
-	    } else if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 's' && isdigit(argv[1][2]) && argv[1][3] == '\0') {
-		colour_strength_t s;
-
-		if (strcasecmp(argv[2], "weak") == 0) s = WEAK;
-		else if (strcasecmp(argv[2], "medium") == 0) s = MEDIUM;
-		else if (strcasecmp(argv[2], "strong") == 0) s = STRONG;
-		else {
-		    fprintf(stderr, "Invalid colour strength: %s, valid values of WEAK, MEDIUM or STRONG\n", argv[2]);
-		    goto usage;
-		}
-
-		set_active_material(atoi(&argv[1][2])-1, NULL, NULL, s);
-		argc--;
-		argv++;
-	    } else if (argv[1][0] == '-') {
-		fprintf(stderr, "unknown argument: %s\n", argv[1]);
-usage:
-		fprintf(stderr, "usage: [<flags> | <colour> | <material> | <strength> | --output fname] printer.yml gcode.gcode\n");
-		fprintf(stderr, "  <colour>:   -cX colour to set the colour of drive \"X\" to \"colour\"\n");
-		fprintf(stderr, "  <material>: -mX material to set the material of drive \"X\" to \"material\"\n");
-		fprintf(stderr, "  <strength>: -sX strength to set the strength of the material's colour (WEAK, MEDIUM or STRONG)\n");
-		fprintf(stderr, "  <flags>: any number of:\n");
-		fprintf(stderr, "           --summary:      provide a more detailed summary of the print\n");
-		fprintf(stderr, "           --bed-usage:    show the usage of the print bed\n");
-		fprintf(stderr, "           --reduce-pings: ping less frequently as the print gets longer and longer\n");
-		fprintf(stderr, "  debugging flags not normally needed are:\n");
-		fprintf(stderr, "           --debug-tool-changes: Leave Tx in the output to visualize the tool changes [DO NOT PRINT]\n");
-		fprintf(stderr, "           --stop-at-ping x: stop producing gcode at the start of ping \"x\"\n");
-		fprintf(stderr, "           --trace:        trace the gcode as it is processed\n");
-		exit(0);
-	    } else {
-		break;
-	    }
-	    argc--;
-	    argv++;
+    convert_t *c;
+    int n_workers = 0;
+    int is_sweep = 0;
+    int ok;
+
+    if (argc > 3 && strcmp(argv[1], "--jobs") == 0) {
+	n_workers = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
     }
+    if (argc == 3 && strcmp(argv[1], "--compile-printer") == 0) return ! printer_compile(argv[2]);
+    if (argc == 3 && strcmp(argv[1], "--compile-materials") == 0) return ! materials_compile(argv[2]);
+    while (argc > 3 && strcmp(argv[1], "--sweep") == 0) {
+	if (! sweep_add_axis(argv[2])) {
+	    fprintf(stderr, "Invalid sweep: %s, expecting key=value,value,... with at most %d keys and %d values\n", argv[2], MAX_SWEEP_AXES, MAX_SWEEP_VALUES);
+	    exit(1);
+	}
+	is_sweep = 1;
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0) return batch(argv[2], n_workers);
+    if (argc == 3 && strcmp(argv[1], "--daemon") == 0) return ! server_run(argv[2], job_from_line);
+    if (argc == 4 && strcmp(argv[1], "--spool") == 0) return ! spool_run(argv[2], argv[3], n_workers, job_from_line);
 
-    if (argc != 3) goto usage;
+    if ((c = convert_new(MATERIALS_FNAME)) == NULL) {
+	perror(MATERIALS_FNAME);
+	exit(1);
+    }
 
-    if (! materials_load("config/materials.yml")) {
-	perror("materials.yaml");
+    switch (parse_args(c, argc, argv)) {
+    case 0:
+	usage();
+	exit(0);
+    case -1:
 	exit(1);
     }
 
-    if (! printer_load(argv[1])) {
-	perror(argv[1]);
+    if (is_sweep) {
+	if (! sweep_run(c, n_workers)) exit(1);
+    } else if ((ok = convert_run(c)) <= 0) {
+	exit(ok < 0 ? 2 : 1);
     }
+    convert_destroy(c);
 
-    fprintf(stderr, "Using printer: %s\n", printer->name);
-    process(argv[2]);
+    return 0;
 }
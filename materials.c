@@ -1,21 +1,44 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <malloc.h>
 #include <string.h>
 #include <yaml.h>
 #include "gcode.h"
 #include "materials.h"
+#include "snapshot.h"
 #include "yaml-wrapper.h"
 
 #define MAX_MATERIALS	1000
 #define MAX_SPLICES	10000
+#define MAX_PURGE_LENGTHS 1000
+
+/* The materials are found by name and the splices by the pair of ids
+ * through open addressed hashes of their index+1 (0 is empty), each at
+ * least twice the size of what it indexes.
+ */
+#define MATERIALS_HASH_SIZE	2048
+#define SPLICES_HASH_SIZE	32768
+#define SPLICES_HASH_BITS	15
 
 static material_t materials[MAX_MATERIALS];
 static int n_materials;
+static int materials_hash[MATERIALS_HASH_SIZE];
 static material_splice_t material_splices[MAX_SPLICES];
 static int n_material_splices;
+static int splices_hash[SPLICES_HASH_SIZE];
 
 static active_material_t active_materials[N_DRIVES];
+static struct {
+    char *from, *to;
+    double mm;
+} purge_lengths[MAX_PURGE_LENGTHS];
+static int n_purge_lengths;
+static int n_materials_purge_lengths;	/* the rest are from purge_lengths_load() */
+static const snapshot_header_t *mapped;	/* the strings are in it rather than strdup()ed */
+static double drive_purge_lengths[N_DRIVES][N_DRIVES];
+static int drive_alias[N_DRIVES] = { 0, 1, 2, 3 };
+int auto_alias_drives = 0;
 
 static struct {
     const char *colour;
@@ -32,34 +55,81 @@ static struct {
 
 #define N_DEFAULT_COLOUR_STRENGTHS (sizeof(default_colour_strengths) / sizeof(default_colour_strengths[0]))
 
+static int *
+material_slot(const char *name)
+{
+    unsigned h = 2166136261u;
+    const char *c;
+
+    for (c = name; *c; c++) h = (h ^ (unsigned char) *c) * 16777619u;
+
+    for (h &= MATERIALS_HASH_SIZE-1; materials_hash[h]; h = (h+1) & (MATERIALS_HASH_SIZE-1)) {
+	if (strcmp(materials[materials_hash[h]-1].name, name) == 0) break;
+    }
+    return &materials_hash[h];
+}
+
+static int *
+splice_slot(int incoming, int outgoing)
+{
+    unsigned h = ((unsigned) incoming * MAX_MATERIALS + outgoing) * 2654435761u >> (32 - SPLICES_HASH_BITS);
+
+    for (; splices_hash[h]; h = (h+1) & (SPLICES_HASH_SIZE-1)) {
+	material_splice_t *s = &material_splices[splices_hash[h]-1];
+	if (s->incoming == incoming && s->outgoing == outgoing) break;
+    }
+    return &splices_hash[h];
+}
+
+static void
+reindex(void)
+{
+    int i;
+
+    memset(materials_hash, 0, sizeof(materials_hash));
+    memset(splices_hash, 0, sizeof(splices_hash));
+    for (i = 0; i < n_materials; i++) *material_slot(materials[i].name) = i+1;
+    for (i = 0; i < n_material_splices; i++) *splice_slot(material_splices[i].incoming, material_splices[i].outgoing) = i+1;
+}
+
+/* Both return NULL once the table is full */
+
 static material_t *
 find_or_create_material(const char *name)
 {
-     int i;
+    int *slot = material_slot(name);
 
-     for (i = 0; i < n_materials; i++) {
-	if (strcmp(materials[i].name, name) == 0) return &materials[i];
-     }
+    if (*slot) return &materials[*slot-1];
 
-     materials[n_materials].id = n_materials;
-     materials[n_materials].name = strdup(name);
-     n_materials++;
+    if (n_materials >= MAX_MATERIALS) {
+	fprintf(stderr, "Too many materials, can't add %s (at most %d)\n", name, MAX_MATERIALS);
+	return NULL;
+    }
 
-     return &materials[n_materials-1];
+    materials[n_materials].id = n_materials;
+    materials[n_materials].name = strdup(name);
+    n_materials++;
+    *slot = n_materials;
+
+    return &materials[n_materials-1];
 }
 
 static material_splice_t *
 find_or_create_splice(material_t *incoming, material_t *outgoing)
 {
-     int i;
+    int *slot = splice_slot(incoming->id, outgoing->id);
+
+    if (*slot) return &material_splices[*slot-1];
 
-    for (i = 0; i < n_material_splices; i++) {
-	if (material_splices[i].incoming == incoming->id && material_splices[i].outgoing == outgoing->id) return &material_splices[i];
+    if (n_material_splices >= MAX_SPLICES) {
+	fprintf(stderr, "Too many material combinations, can't add %s to %s (at most %d)\n", incoming->name, outgoing->name, MAX_SPLICES);
+	return NULL;
     }
 
     material_splices[n_material_splices].incoming = incoming->id;
     material_splices[n_material_splices].outgoing = outgoing->id;
     n_material_splices++;
+    *slot = n_material_splices;
 
     return &material_splices[n_material_splices-1];
 }
@@ -82,17 +152,18 @@ process_combination(yaml_wrapper_t *p, material_splice_t *splice)
 		if (strcmp(key, "heatFactor") == 0) splice->heat = atof(value);
 		else if (strcmp(key, "compressionFactor") == 0) splice->compression = atof(value);
 		else if (strcmp(key, "reverse") == 0) splice->reverse = atoi(value);
-		else printf("unknown combination parameter: %s = %s\n", key, value);
+		else fprintf(stderr, "unknown combination parameter: %s = %s\n", key, value);
 	    }
 	    yaml_event_delete(&event2);
 	}
 	yaml_event_delete(&event);
     }
 }
-static void
+static int
 process_combinations(yaml_wrapper_t *p, material_t *incoming)
 {
     material_t *outgoing;
+    material_splice_t *splice;
     yaml_event_t event;
 
     while (yaml_wrapper_event(p, &event)) {
@@ -101,17 +172,70 @@ process_combinations(yaml_wrapper_t *p, material_t *incoming)
 	    break;
 	}
 	if (event.type == YAML_SCALAR_EVENT) {
-	    outgoing = find_or_create_material((char *) event.data.scalar.value);
-	    process_combination(p, find_or_create_splice(incoming, outgoing));
+	    if ((outgoing = find_or_create_material((char *) event.data.scalar.value)) == NULL ||
+		(splice = find_or_create_splice(incoming, outgoing)) == NULL) {
+		yaml_event_delete(&event);
+		return 0;
+	    }
+	    process_combination(p, splice);
 	}
 	yaml_event_delete(&event);
     }
+    return 1;
 }
 
-static void
+/* Purge lengths are keyed by the outgoing colour and then the incoming colour */
+
+static int
+process_purge_lengths_from(yaml_wrapper_t *p, const char *from)
+{
+    yaml_event_t event, event2;
+    int ok = 1;
+
+    while (ok && yaml_wrapper_event(p, &event)) {
+	if (event.type == YAML_MAPPING_END_EVENT) {
+	    yaml_event_delete(&event);
+	    break;
+	}
+	if (event.type == YAML_SCALAR_EVENT && yaml_wrapper_event(p, &event2)) {
+	    if (event2.type == YAML_SCALAR_EVENT && n_purge_lengths >= MAX_PURGE_LENGTHS) {
+		fprintf(stderr, "Too many purge lengths, can't add %s to %s (at most %d)\n", from, (char *) event.data.scalar.value, MAX_PURGE_LENGTHS);
+		ok = 0;
+	    } else if (event2.type == YAML_SCALAR_EVENT) {
+		purge_lengths[n_purge_lengths].from = strdup(from);
+		purge_lengths[n_purge_lengths].to = strdup((char *) event.data.scalar.value);
+		purge_lengths[n_purge_lengths].mm = atof((char *) event2.data.scalar.value);
+		n_purge_lengths++;
+	    }
+	    yaml_event_delete(&event2);
+	}
+	yaml_event_delete(&event);
+    }
+    return ok;
+}
+
+static int
+process_purge_lengths(yaml_wrapper_t *p)
+{
+    yaml_event_t event;
+    int ok = 1;
+
+    while (ok && yaml_wrapper_event(p, &event)) {
+	if (event.type == YAML_MAPPING_END_EVENT) {
+	    yaml_event_delete(&event);
+	    break;
+	}
+	if (event.type == YAML_SCALAR_EVENT) ok = process_purge_lengths_from(p, (char *) event.data.scalar.value);
+	yaml_event_delete(&event);
+    }
+    return ok;
+}
+
+static int
 process_material(yaml_wrapper_t *p, material_t *m)
 {
     yaml_event_t event, event2;
+    int ok = 1;
 
     for (;;) {
 	if (! yaml_wrapper_event(p, &event)) break;
@@ -130,8 +254,12 @@ process_material(yaml_wrapper_t *p, material_t *m)
 		    yaml_event_delete(&event);
 		    break;
 		}
-		if (event2.type == YAML_MAPPING_START_EVENT) process_combinations(p, m);
+		if (event2.type == YAML_MAPPING_START_EVENT) ok = process_combinations(p, m);
 		yaml_event_delete(&event2);
+		if (! ok) {
+		    yaml_event_delete(&event);
+		    break;
+		}
 	    }
 	} else if (event.type == YAML_MAPPING_END_EVENT) {
 	    yaml_event_delete(&event);
@@ -139,39 +267,214 @@ process_material(yaml_wrapper_t *p, material_t *m)
 	}
 	yaml_event_delete(&event);
     }
+    return ok;
 }
 
-void
+int
 init_active_materials()
 {
     int i;
 
     for (i = 0; i < N_DRIVES; i++) {
 	if (active_materials[i].m == NULL) {
-	    active_materials[i].m = find_or_create_material("Default PLA");
+	    if ((active_materials[i].m = find_or_create_material("Default PLA")) == NULL) return 0;
 	    active_materials[i].colour = NULL;
 	    active_materials[i].strength = MEDIUM;
 	}
     }
+    return 1;
 }
 
-int
-materials_load(const char *fname)
+void
+reset_active_materials()
+{
+    int i;
+
+    for (i = 0; i < N_DRIVES; i++) {
+	free(active_materials[i].colour);
+	active_materials[i].m = NULL;
+	active_materials[i].colour = NULL;
+	drive_alias[i] = i;
+    }
+}
+
+static int
+load_yaml(const char *fname)
 {
     yaml_wrapper_t *p;
     yaml_event_t event;
-    int had_error;
+    int ok = 1;
 
     if ((p = yaml_wrapper_new(fname)) == NULL) return 0;
 
-    while (yaml_wrapper_event(p, &event)) {
-	if (event.type == YAML_SCALAR_EVENT) {
+    while (ok && yaml_wrapper_event(p, &event)) {
+	if (event.type == YAML_SCALAR_EVENT && strcmp((char *) event.data.scalar.value, "purgeLengths") == 0) {
+	    ok = process_purge_lengths(p);
+	} else if (event.type == YAML_SCALAR_EVENT) {
 	    material_t *m = find_or_create_material((char *) event.data.scalar.value);
-	    process_material(p, m);
+	    ok = m != NULL && process_material(p, m);
 	}
 	yaml_event_delete(&event);
     }
 
+    ok = ok && ! yaml_wrapper_had_error(p);
+
+    yaml_wrapper_delete(p);
+
+    return ok;
+}
+
+/* The snapshot has the splices, the purge lengths and then the materials,
+ * with the strings as offsets into the snapshot's strings.  It is loaded
+ * into empty tables, so they are taken as they are, and stays mapped until
+ * the tables are reset.
+ */
+
+typedef struct {
+    double mm;
+    int from, to;
+} snapshot_purge_length_t;
+
+typedef struct {
+    int id;
+    int name, type;
+} snapshot_material_t;
+
+static int
+load_snapshot(const char *fname)
+{
+    const snapshot_header_t *h;
+    const material_splice_t *splices;
+    const snapshot_purge_length_t *lengths;
+    const snapshot_material_t *m;
+    int n_splices, n_lengths, n;
+    int i;
+
+    if ((h = snapshot_map(fname, SNAPSHOT_MATERIALS, sizeof(material_splice_t))) == NULL) return 0;
+
+    n_splices = h->counts[0];
+    n_lengths = h->counts[1];
+    n = h->counts[2];
+    if (n > MAX_MATERIALS || n_splices > MAX_SPLICES || n_lengths > MAX_PURGE_LENGTHS) {
+	snapshot_unmap(h);
+	return 0;
+    }
+
+    splices = (const material_splice_t *) (h + 1);
+    lengths = (const snapshot_purge_length_t *) (splices + n_splices);
+    m = (const snapshot_material_t *) (lengths + n_lengths);
+
+    for (i = 0; i < n; i++) {
+	materials[i].id = m[i].id;
+	materials[i].name = snapshot_string(h, m[i].name);
+	materials[i].type = snapshot_string(h, m[i].type);
+    }
+    n_materials = n;
+    memcpy(material_splices, splices, sizeof(*splices) * n_splices);
+    n_material_splices = n_splices;
+    reindex();
+
+    for (i = 0; i < n_lengths; i++) {
+	purge_lengths[i].from = (char *) snapshot_string(h, lengths[i].from);
+	purge_lengths[i].to = (char *) snapshot_string(h, lengths[i].to);
+	purge_lengths[i].mm = lengths[i].mm;
+    }
+    n_purge_lengths = n_lengths;
+    mapped = h;
+
+    return 1;
+}
+
+/* Loading again replaces everything, so materials, combinations and
+ * purge lengths that were taken out of the file go away.
+ */
+
+static void
+reset_tables(void)
+{
+    int i;
+
+    for (i = 0; i < n_purge_lengths; i++) {
+	if (mapped && i < n_materials_purge_lengths) continue;
+	free(purge_lengths[i].from);
+	free(purge_lengths[i].to);
+    }
+    for (i = 0; i < n_materials && ! mapped; i++) {
+	free((char *) materials[i].name);
+	free((char *) materials[i].type);
+    }
+    memset(materials, 0, sizeof(materials[0]) * n_materials);
+    memset(material_splices, 0, sizeof(material_splices[0]) * n_material_splices);
+    n_materials = n_material_splices = n_purge_lengths = n_materials_purge_lengths = 0;
+    snapshot_unmap(mapped);
+    mapped = NULL;
+    reindex();
+}
+
+int
+materials_load(const char *fname)
+{
+    int ok;
+
+    reset_tables();
+    ok = load_snapshot(fname) || load_yaml(fname);
+
+    n_materials_purge_lengths = n_purge_lengths;
+    return ok;
+}
+
+/* Validated on an empty table so that the snapshot only has this file */
+
+int
+materials_compile(const char *fname)
+{
+    static snapshot_purge_length_t lengths[MAX_PURGE_LENGTHS];
+    static snapshot_material_t m[MAX_MATERIALS];
+    snapshot_writer_t *w;
+    int i;
+
+    reset_tables();
+    if (! load_yaml(fname)) {
+	fprintf(stderr, "%s: can't be parsed, not compiled\n", fname);
+	return 0;
+    }
+
+    if ((w = snapshot_writer_new(fname, SNAPSHOT_MATERIALS, sizeof(material_splice_t))) == NULL) return 0;
+    for (i = 0; i < n_purge_lengths; i++) {
+	lengths[i].mm = purge_lengths[i].mm;
+	lengths[i].from = snapshot_add_string(w, purge_lengths[i].from);
+	lengths[i].to = snapshot_add_string(w, purge_lengths[i].to);
+    }
+    for (i = 0; i < n_materials; i++) {
+	m[i].id = materials[i].id;
+	m[i].name = snapshot_add_string(w, materials[i].name);
+	m[i].type = snapshot_add_string(w, materials[i].type);
+    }
+    snapshot_add_records(w, n_material_splices, material_splices, sizeof(material_splices[0]));
+    snapshot_add_records(w, n_purge_lengths, lengths, sizeof(lengths[0]));
+    snapshot_add_records(w, n_materials, m, sizeof(m[0]));
+
+    return snapshot_writer_finish(w);
+}
+
+/* Replaces the purge lengths of the last call, NULL just drops them */
+
+int
+purge_lengths_load(const char *fname)
+{
+    yaml_wrapper_t *p;
+    int had_error;
+
+    while (n_purge_lengths > n_materials_purge_lengths) {
+	n_purge_lengths--;
+	free(purge_lengths[n_purge_lengths].from);
+	free(purge_lengths[n_purge_lengths].to);
+    }
+
+    if (fname == NULL) return 1;
+    if ((p = yaml_wrapper_new(fname)) == NULL) return 0;
+
+    process_purge_lengths(p);
     had_error = yaml_wrapper_had_error(p);
 
     yaml_wrapper_delete(p);
@@ -179,19 +482,54 @@ materials_load(const char *fname)
     return ! had_error;
 }
 
+/* Look up the purge length of every pair of drives once their colours are
+ * known, -1 if it isn't calibrated.
+ */
+
+void
+init_purge_lengths()
+{
+    int from, to, i;
+
+    for (from = 0; from < N_DRIVES; from++) {
+	for (to = 0; to < N_DRIVES; to++) {
+	    const char *out = active_materials[from].colour, *in = active_materials[to].colour;
+
+	    drive_purge_lengths[from][to] = -1;
+	    if (! out || ! in) continue;
+	    for (i = n_purge_lengths-1; i >= 0; i--) {
+		if (strcasecmp(purge_lengths[i].from, out) == 0 && strcasecmp(purge_lengths[i].to, in) == 0) {
+		    drive_purge_lengths[from][to] = purge_lengths[i].mm;
+		    break;
+		}
+	    }
+	}
+    }
+}
+
+double
+get_purge_length(int from, int to)
+{
+    return drive_purge_lengths[from][to];
+}
+
 material_t *const
 materials_find(const char *name)
 {
-    return find_or_create_material(name);
+    int *slot = material_slot(name);
+
+    return *slot ? &materials[*slot-1] : NULL;
 }
 
 material_splice_t *const
 materials_find_splice(int incoming, int outgoing)
 {
-    return find_or_create_splice(&materials[incoming], &materials[outgoing]);
+    int *slot = splice_slot(incoming, outgoing);
+
+    return *slot ? &material_splices[*slot-1] : NULL;
 }
 
-void
+int
 set_active_material(int drive, const char *name, const char *colour, colour_strength_t strength)
 {
     if (colour && strength == UNKNOWN) {
@@ -206,12 +544,16 @@ set_active_material(int drive, const char *name, const char *colour, colour_stre
 	if (strength == UNKNOWN) strength = MEDIUM;
     }
 
-    if (name) active_materials[drive].m = find_or_create_material(name);
+    if (name && (active_materials[drive].m = materials_find(name)) == NULL) {
+	fprintf(stderr, "Unknown material: %s\n", name);
+	return 0;
+    }
     if (colour) {
 	if (active_materials[drive].colour) free(active_materials[drive].colour);
         active_materials[drive].colour = strdup(colour);
     }
     active_materials[drive].strength = strength;
+    return 1;
 }
 
 active_material_t *
@@ -219,3 +561,26 @@ get_active_material(int drive)
 {
     return &active_materials[drive];
 }
+
+/* Drives loaded with the same filament, either declared or (with
+ * auto_alias_drives) because they have the same material and colour.
+ */
+
+void
+set_drive_alias(int drive, int same_as)
+{
+    int i, old = drive_alias[drive];
+
+    for (i = 0; i < N_DRIVES; i++) {
+	if (drive_alias[i] == old) drive_alias[i] = drive_alias[same_as];
+    }
+}
+
+int
+drives_are_aliased(int a, int b)
+{
+    active_material_t *ma = &active_materials[a], *mb = &active_materials[b];
+
+    if (drive_alias[a] == drive_alias[b]) return 1;
+    return auto_alias_drives && ma->m == mb->m && ma->colour && mb->colour && strcasecmp(ma->colour, mb->colour) == 0;
+}
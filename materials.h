@@ -27,6 +27,20 @@ typedef struct {
 int
 materials_load(const char *fname);
 
+/* Check fname and snapshot it for materials_load(), returns 0 if it has problems */
+int
+materials_compile(const char *fname);
+
+int
+purge_lengths_load(const char *fname);
+
+void
+init_purge_lengths(void);
+
+double
+get_purge_length(int from, int to);
+
+/* NULL if the material or the combination isn't in materials.yml */
 material_t *const
 materials_find(const char *name);
 
@@ -36,12 +50,25 @@ materials_find_splice(int incoming, int outgoing);
 active_material_t *
 get_active_material(int drive);
 
-void
+/* Returns 0 if the default material can't be added */
+int
 init_active_materials(void);
 
 void
+reset_active_materials(void);
+
+/* Returns 0 if the material isn't in materials.yml */
+int
 set_active_material(int drive, const char *name, const char *colour, colour_strength_t strength);
 
+extern int auto_alias_drives;
+
+void
+set_drive_alias(int drive, int same_as);
+
+int
+drives_are_aliased(int a, int b);
+
 #endif
 
 
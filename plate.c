@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "plate.h"
+#include "util.h"
+
+/* Merge separately sliced jobs onto one plate.
+ *
+ * Each job is cut into chunks, one per layer, at the first z move after
+ * the layer's last extrusion so that the retraction at the end of a layer
+ * stays with it.  The chunks of all the jobs are then printed in order of
+ * height.  Whenever the output switches to another job, that job's state
+ * (tool, fan, position, positioning and extrusion mode and E position) is
+ * restored before its chunk, travelling above everything printed so far.
+ * The moves of a job are shifted by its offset.
+ */
+
+#define EPSILON	0.0000001
+#define Z_HOP	2.0
+
+typedef struct {
+    double x, y, z, e, f;
+    double fan;
+    int tool;
+    int is_relative, e_is_absolute;
+} job_state_t;
+
+typedef struct {
+    int start, end;		/* lines [start, end) */
+    double z;
+    job_state_t state;		/* when the chunk starts */
+} chunk_t;
+
+typedef struct {
+    plate_job_t *job;
+    char **lines;
+    int n_lines, a_lines;
+    chunk_t *chunks;
+    int n_chunks, a_chunks;
+    int body_end;		/* the end gcode starts here */
+    int is_first;
+    job_state_t end_state;
+    double travel_f;
+    int next;			/* next chunk to print */
+} plate_t;
+
+static int
+read_lines(plate_t *p)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t len = 0;
+
+    if ((f = fopen(p->job->fname, "r")) == NULL) {
+	perror(p->job->fname);
+	return 0;
+    }
+
+    while (getline(&line, &len, f) >= 0) {
+	if (p->n_lines >= p->a_lines) {
+	    p->a_lines = p->a_lines ? p->a_lines * 2 : 1024;
+	    p->lines = realloc(p->lines, sizeof(*p->lines) * p->a_lines);
+	}
+	p->lines[p->n_lines++] = strdup(line);
+    }
+
+    free(line);
+    fclose(f);
+    return 1;
+}
+
+static void
+add_chunk(plate_t *p, int start, double z, job_state_t *state)
+{
+    if (p->n_chunks >= p->a_chunks) {
+	p->a_chunks = p->a_chunks ? p->a_chunks * 2 : 256;
+	p->chunks = realloc(p->chunks, sizeof(*p->chunks) * p->a_chunks);
+    }
+    if (p->n_chunks > 0) p->chunks[p->n_chunks-1].end = start;
+    p->chunks[p->n_chunks].start = start;
+    p->chunks[p->n_chunks].z = z;
+    p->chunks[p->n_chunks].state = *state;
+    p->n_chunks++;
+}
+
+static int
+is_move(const char *l)
+{
+    return strncmp(l, "G1 ", 3) == 0 || strncmp(l, "G0 ", 3) == 0;
+}
+
+/* Returns 1 if the line moves in x or y */
+
+static int
+update_state(job_state_t *s, const char *l)
+{
+    double v;
+    int moves_xy = 0;
+
+    if (is_move(l)) {
+	if (find_arg(l, 'X', &v)) { s->x = s->is_relative ? s->x + v : v; moves_xy = 1; }
+	if (find_arg(l, 'Y', &v)) { s->y = s->is_relative ? s->y + v : v; moves_xy = 1; }
+	if (find_arg(l, 'Z', &v)) s->z = s->is_relative ? s->z + v : v;
+	if (find_arg(l, 'E', &v)) s->e = s->e_is_absolute && ! s->is_relative ? v : s->e + v;
+	if (find_arg(l, 'F', &v)) s->f = v;
+    } else if (strncmp(l, "G90", 3) == 0) {
+	s->is_relative = 0;
+    } else if (strncmp(l, "G91", 3) == 0) {
+	s->is_relative = 1;
+    } else if (strncmp(l, "M82", 3) == 0) {
+	s->e_is_absolute = 1;
+    } else if (strncmp(l, "M83", 3) == 0) {
+	s->e_is_absolute = 0;
+    } else if (strncmp(l, "G92 ", 4) == 0) {
+	if (find_arg(l, 'E', &v)) s->e = v;
+    } else if (strncmp(l, "M106 ", 5) == 0) {
+	if (find_arg(l, 'S', &v)) s->fan = v;
+    } else if (strncmp(l, "M107", 4) == 0) {
+	s->fan = 0;
+    } else if (l[0] == 'T' && isdigit(l[1])) {
+	s->tool = atoi(&l[1]);
+    }
+
+    return moves_xy;
+}
+
+static int
+split_into_layers(plate_t *p)
+{
+    job_state_t s = { 0, }, z_move_state = { 0, };
+    double layer_z = NAN;
+    int z_move = -1, last_extrusion = -1;
+    int i;
+
+    s.e_is_absolute = 1;
+
+    for (i = 0; i < p->n_lines; i++) {
+	const char *l = p->lines[i];
+	job_state_t n = s;
+	int moves_xy = update_state(&n, l);
+
+	if (is_move(l) && n.z != s.z && z_move < 0) {
+	    z_move = i;
+	    z_move_state = s;
+	}
+
+	if (moves_xy && n.e > s.e) {
+	    if (! isfinite(layer_z) || fabs(n.z - layer_z) > EPSILON) {
+		if (isfinite(layer_z) && n.z < layer_z) {
+		    fprintf(stderr, "%s: extrusion at height %f after height %f, can't merge a sequential print\n", p->job->fname, n.z, layer_z);
+		    return 0;
+		}
+		if (z_move >= 0) add_chunk(p, z_move, n.z, &z_move_state);
+		else add_chunk(p, i, n.z, &s);
+		layer_z = n.z;
+	    }
+	    last_extrusion = i;
+	    z_move = -1;
+	    p->end_state = n;
+	} else if (moves_xy && n.f > p->travel_f) {
+	    p->travel_f = n.f;
+	}
+	s = n;
+    }
+
+    if (p->n_chunks == 0) {
+	fprintf(stderr, "%s: no extrusions to merge\n", p->job->fname);
+	return 0;
+    }
+
+    /* The last layer keeps the moves after its last extrusion (retracting
+     * and moving away) up to the end gcode.
+     */
+    for (i = last_extrusion+1; i < p->n_lines && is_move(p->lines[i]) && (z_move < 0 || i < z_move); i++) {
+	update_state(&p->end_state, p->lines[i]);
+    }
+    p->body_end = i;
+    p->chunks[p->n_chunks-1].end = p->body_end;
+
+    return 1;
+}
+
+/* Only absolute X and Y need to move, anything else is copied as is */
+
+static void
+output_line(FILE *o, plate_t *p, const char *l, int is_relative)
+{
+    const char *c;
+
+    if ((p->job->dx == 0 && p->job->dy == 0) || is_relative || (strncmp(l, "G1 ", 3) != 0 && strncmp(l, "G0 ", 3) != 0)) {
+	fputs(l, o);
+	return;
+    }
+
+    for (c = l; *c; c++) {
+	if (*c == ';') {
+	    fputs(c, o);
+	    return;
+	}
+	if ((*c == 'X' || *c == 'Y') && c > l && c[-1] == ' ') {
+	    char *end;
+	    double v = strtod(c+1, &end);
+
+	    if (end != c+1) {
+		fprintf(o, "%c%.3f", *c, v + (*c == 'X' ? p->job->dx : p->job->dy));
+		c = end - 1;
+		continue;
+	    }
+	}
+	fputc(*c, o);
+    }
+}
+
+/* G90 also makes E absolute on Marlin, so the extrusion mode comes after
+ * the positioning mode.
+ */
+
+static void
+output_extrusion_mode(FILE *o, job_state_t *s)
+{
+    fprintf(o, "%s\n", s->e_is_absolute ? "M82" : "M83");
+    if (s->e_is_absolute) fprintf(o, "G92 E%f\n", s->e);
+}
+
+/* The travel is made absolute and above everything printed so far.  It
+ * comes down to where the chunk starts with absolute positioning, where
+ * the chunk's own z move goes, and to the job's z with relative
+ * positioning, where the moves carry on from it.
+ */
+
+static void
+output_switch(FILE *o, plate_t *p, chunk_t *c, int *tool, double top_z)
+{
+    job_state_t *s = &c->state;
+
+    fprintf(o, "; Plate: continuing %s\n", p->job->fname);
+    if (s->tool != *tool) fprintf(o, "T%d\n", s->tool);
+    if (s->fan > 0) fprintf(o, "M106 S%f\n", s->fan);
+    else fprintf(o, "M107\n");
+    fprintf(o, "G90\n");
+    fprintf(o, "G1 Z%.3f\n", fmax(top_z, s->z) + Z_HOP);
+    fprintf(o, "G1 X%.3f Y%.3f", s->x + p->job->dx, s->y + p->job->dy);
+    if (p->travel_f > 0) fprintf(o, " F%.0f", p->travel_f);
+    fprintf(o, "\n");
+    fprintf(o, "G1 Z%.3f\n", s->is_relative ? s->z : c->z);
+    if (s->is_relative) fprintf(o, "G91\n");
+    output_extrusion_mode(o, s);
+    if (s->f > 0 && s->f != p->travel_f) fprintf(o, "G1 F%.0f\n", s->f);
+    *tool = s->tool;
+}
+
+/* Only the first job's start of the main gcode is kept, it is where the
+ * priming goes.
+ */
+
+static int
+is_start_marker(const char *l)
+{
+    return strncmp(l, "; *** Main G-code ***", 21) == 0 || strncmp(l, "; layer 1, ", 11) == 0;
+}
+
+static void
+output_lines(FILE *o, plate_t *p, int start, int end, int is_relative)
+{
+    int i;
+
+    for (i = start; i < end; i++) {
+	if (strncmp(p->lines[i], "G90", 3) == 0) is_relative = 0;
+	else if (strncmp(p->lines[i], "G91", 3) == 0) is_relative = 1;
+	if (! p->is_first && is_start_marker(p->lines[i])) continue;
+	output_line(o, p, p->lines[i], is_relative);
+    }
+}
+
+int
+plate_merge(plate_job_t *jobs, int n_jobs, FILE *o, FILE *report)
+{
+    plate_t *plates = calloc(sizeof(*plates), n_jobs);
+    int cur = 0, tallest = 0, tool;
+    double top_z = 0;
+    int i, ok = 1;
+    int n_layers = 0;
+
+    for (i = 0; i < n_jobs && ok; i++) {
+	plates[i].job = &jobs[i];
+	plates[i].is_first = i == 0;
+	ok = read_lines(&plates[i]) && split_into_layers(&plates[i]);
+	if (ok && plates[i].chunks[plates[i].n_chunks-1].z > plates[tallest].chunks[plates[tallest].n_chunks-1].z) tallest = i;
+    }
+
+    if (ok) {
+	for (i = 0; i < plates[0].chunks[0].start; i++) fputs(plates[0].lines[i], o);
+	tool = plates[0].chunks[0].state.tool;
+
+	while (1) {
+	    plate_t *p = NULL;
+	    chunk_t *c;
+
+	    for (i = 0; i < n_jobs; i++) {
+		plate_t *this = &plates[i];
+		if (this->next < this->n_chunks && (! p || this->chunks[this->next].z < p->chunks[p->next].z - EPSILON)) p = this;
+	    }
+	    if (! p) break;
+
+	    c = &p->chunks[p->next++];
+	    if (p != &plates[cur]) {
+		output_switch(o, p, c, &tool, top_z);
+		cur = p - plates;
+	    }
+	    output_lines(o, p, c->start, c->end, c->state.is_relative);
+	    top_z = fmax(top_z, c->z);
+	    tool = p->next < p->n_chunks ? p->chunks[p->next].state.tool : p->end_state.tool;
+	    n_layers++;
+	}
+
+	/* Only the extrusion state matters for the end gcode, switching the
+	 * tool would make it look like the last tool of the print.
+	 */
+	if (tallest != cur) {
+	    job_state_t *s = &plates[tallest].end_state;
+
+	    fprintf(o, "; Plate: ending with %s\n", plates[tallest].job->fname);
+	    fprintf(o, "%s\n", s->is_relative ? "G91" : "G90");
+	    output_extrusion_mode(o, s);
+	}
+	output_lines(o, &plates[tallest], plates[tallest].body_end, plates[tallest].n_lines, plates[tallest].end_state.is_relative);
+
+	fprintf(report, "Merged %d jobs into %d layers\n", n_jobs, n_layers);
+    }
+
+    for (i = 0; i < n_jobs; i++) {
+	int j;
+
+	for (j = 0; j < plates[i].n_lines; j++) free(plates[i].lines[j]);
+	free(plates[i].lines);
+	free(plates[i].chunks);
+    }
+    free(plates);
+
+    return ok;
+}
@@ -0,0 +1,20 @@
+#ifndef __PLATE_H__
+#define __PLATE_H__
+
+#include <stdio.h>
+
+#define MAX_PLATE_JOBS	16
+
+typedef struct {
+    const char *fname;
+    double dx, dy;
+} plate_job_t;
+
+/* Interleave the layers of the jobs by height into a single print written
+ * to o, saying what was merged on report.  The first job supplies the start
+ * gcode and the tallest one the end gcode.  Returns 0 if a job can't be
+ * merged.
+ */
+int plate_merge(plate_job_t *jobs, int n_jobs, FILE *o, FILE *report);
+
+#endif
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "printer.h"
+#include "print-time.h"
+#include "util.h"
+
+/* Estimate how long the printer takes to print the gcode.
+ *
+ * This follows what the firmware does: every move accelerates and
+ * decelerates at a constant acceleration (a trapezoid velocity profile)
+ * and the speed it can carry through a corner is limited by the junction
+ * deviation.  The moves are planned with a fixed lookahead, like the
+ * firmware's planner buffer, assuming the printer has to be able to stop
+ * at the end of the buffer.
+ *
+ * Every move is charged to a category depending on what is being printed
+ * (the context) and what kind of move it is.
+ */
+
+#define LOOKAHEAD	32
+#define EPSILON		0.0000001
+
+typedef struct {
+    double len;
+    double nominal;
+    double max_entry;
+    double entry;
+    time_category_t category;
+} block_t;
+
+struct print_timeS {
+    time_category_t context;
+    double x, y, z, e, f;
+    int is_relative, e_is_absolute;
+    double seconds[N_TIME_CATEGORIES];
+    block_t blocks[LOOKAHEAD];
+    int n_blocks;
+    double exit;
+    double last_u[4];
+    double last_nominal;
+    double retracted;
+    FILE *f_out;
+    long written;
+    char line[1024];
+    int line_len;
+};
+
+static const char *category_names[N_TIME_CATEGORIES] = {
+    "object", "tower fill", "tower travel", "retractions/z-hops", "ping pauses"
+};
+
+print_time_t *
+print_time_new(void)
+{
+    print_time_t *pt;
+
+    pt = calloc(sizeof(*pt), 1);
+    pt->e_is_absolute = 1;
+
+    return pt;
+}
+
+void
+print_time_set_context(print_time_t *pt, time_category_t context)
+{
+    pt->context = context;
+}
+
+time_category_t
+print_time_get_context(print_time_t *pt)
+{
+    return pt->context;
+}
+
+static double
+trapezoid_seconds(double len, double v0, double v1, double v, double a)
+{
+    double accel_len = (v*v - v0*v0) / (2*a);
+    double decel_len = (v*v - v1*v1) / (2*a);
+
+    if (accel_len + decel_len <= len) {
+	return (v - v0) / a + (v - v1) / a + (len - accel_len - decel_len) / v;
+    } else {
+	double peak = sqrt((2*a*len + v0*v0 + v1*v1) / 2);
+	return (peak - v0) / a + (peak - v1) / a;
+    }
+}
+
+static void
+plan(print_time_t *pt)
+{
+    double a = printer->acceleration;
+    double next_entry = 0;
+    int i;
+
+    for (i = pt->n_blocks-1; i >= 0; i--) {
+	block_t *b = &pt->blocks[i];
+
+	b->entry = fmin(b->max_entry, sqrt(next_entry*next_entry + 2*a*b->len));
+	next_entry = b->entry;
+    }
+
+    pt->blocks[0].entry = pt->exit;
+    for (i = 1; i < pt->n_blocks; i++) {
+	block_t *prev = &pt->blocks[i-1];
+
+	pt->blocks[i].entry = fmin(pt->blocks[i].entry, sqrt(prev->entry*prev->entry + 2*a*prev->len));
+    }
+}
+
+static void
+retire_block(print_time_t *pt)
+{
+    block_t *b = &pt->blocks[0];
+    double exit;
+
+    plan(pt);
+    exit = pt->n_blocks > 1 ? pt->blocks[1].entry : 0;
+    pt->seconds[b->category] += trapezoid_seconds(b->len, b->entry, exit, b->nominal, printer->acceleration);
+    pt->exit = exit;
+
+    pt->n_blocks--;
+    memmove(&pt->blocks[0], &pt->blocks[1], sizeof(pt->blocks[0]) * pt->n_blocks);
+}
+
+static void
+flush_blocks(print_time_t *pt)
+{
+    while (pt->n_blocks > 0) retire_block(pt);
+    pt->last_nominal = 0;
+}
+
+static double
+junction_speed(print_time_t *pt, double u[4], double nominal)
+{
+    double cos_theta = -(u[0]*pt->last_u[0] + u[1]*pt->last_u[1] + u[2]*pt->last_u[2] + u[3]*pt->last_u[3]);
+    double sin_half, v;
+
+    if (pt->last_nominal <= 0) return 0;
+    if (cos_theta > 0.999999) return 0;
+    if (cos_theta < -0.999999) return fmin(nominal, pt->last_nominal);
+
+    sin_half = sqrt(0.5 * (1 - cos_theta));
+    v = sqrt(printer->acceleration * printer->junction_deviation * sin_half / (1 - sin_half));
+
+    return fmin(v, fmin(nominal, pt->last_nominal));
+}
+
+static void
+add_move(print_time_t *pt, double dx, double dy, double dz, double de, time_category_t category)
+{
+    double len = sqrt(dx*dx + dy*dy + dz*dz);
+    double u[4] = { 0, };
+    block_t *b;
+
+    if (len > 0) {
+	u[0] = dx / len;
+	u[1] = dy / len;
+	u[2] = dz / len;
+    } else if (de != 0) {
+	len = fabs(de);
+	u[3] = de / len;
+    } else {
+	return;
+    }
+
+    if (pt->f <= 0) return;
+
+    if (pt->n_blocks >= LOOKAHEAD) retire_block(pt);
+
+    b = &pt->blocks[pt->n_blocks++];
+    b->len = len;
+    b->nominal = pt->f / 60;
+    b->max_entry = junction_speed(pt, u, b->nominal);
+    b->category = category;
+
+    memcpy(pt->last_u, u, sizeof(u));
+    pt->last_nominal = b->nominal;
+}
+
+/* Filament pushed without moving only counts as undoing a retraction
+ * up to what was retracted, anything more is a purge (side transitions).
+ */
+
+static time_category_t
+move_category(print_time_t *pt, double dx, double dy, double dz, double de)
+{
+    int moves_xy = dx != 0 || dy != 0;
+    int is_retraction = ! moves_xy && (de <= 0 || de <= pt->retracted + EPSILON);
+
+    if (de < 0 && ! moves_xy) pt->retracted -= de;
+    else if (de > 0) pt->retracted = fmax(pt->retracted - de, 0);
+
+    if (pt->context == TIME_PING) return TIME_PING;
+    if (is_retraction) return TIME_RETRACTION;
+    if (pt->context == TIME_TOWER) return de > 0 ? TIME_TOWER : TIME_TOWER_TRAVEL;
+    return TIME_OBJECT;
+}
+
+void
+print_time_line(print_time_t *pt, const char *line)
+{
+    double v;
+
+    if (strncmp(line, "G1 ", 3) == 0 || strncmp(line, "G0 ", 3) == 0) {
+	double x = pt->x, y = pt->y, z = pt->z, e = pt->e;
+
+	if (find_arg(line, 'F', &v)) pt->f = v;
+	if (find_arg(line, 'X', &v)) x = pt->is_relative ? pt->x + v : v;
+	if (find_arg(line, 'Y', &v)) y = pt->is_relative ? pt->y + v : v;
+	if (find_arg(line, 'Z', &v)) z = pt->is_relative ? pt->z + v : v;
+	if (find_arg(line, 'E', &v)) e = pt->e_is_absolute && ! pt->is_relative ? v : pt->e + v;
+
+	add_move(pt, x - pt->x, y - pt->y, z - pt->z, e - pt->e, move_category(pt, x - pt->x, y - pt->y, z - pt->z, e - pt->e));
+
+	pt->x = x;
+	pt->y = y;
+	pt->z = z;
+	pt->e = e;
+    } else if (strncmp(line, "G4 ", 3) == 0) {
+	flush_blocks(pt);
+	if (find_arg(line, 'P', &v)) pt->seconds[pt->context] += v / 1000;
+	else if (find_arg(line, 'S', &v)) pt->seconds[pt->context] += v;
+    } else if (strncmp(line, "G92 ", 4) == 0) {
+	if (find_arg(line, 'E', &v)) pt->e = v;
+    } else if (strncmp(line, "G90", 3) == 0) {
+	pt->is_relative = 0;
+    } else if (strncmp(line, "G91", 3) == 0) {
+	pt->is_relative = 1;
+    } else if (strncmp(line, "M82", 3) == 0) {
+	pt->e_is_absolute = 1;
+    } else if (strncmp(line, "M83", 3) == 0) {
+	pt->e_is_absolute = 0;
+    } else if (strncmp(line, "G28", 3) == 0) {
+	flush_blocks(pt);
+	pt->x = pt->y = pt->z = 0;
+    }
+}
+
+/* The blocks still waiting in the lookahead are counted at their nominal speed */
+
+double
+print_time_elapsed(print_time_t *pt)
+{
+    double seconds = 0;
+    int i;
+
+    for (i = 0; i < N_TIME_CATEGORIES; i++) seconds += pt->seconds[i];
+    for (i = 0; i < pt->n_blocks; i++) seconds += pt->blocks[i].len / pt->blocks[i].nominal;
+
+    return seconds;
+}
+
+double
+print_time_category(print_time_t *pt, time_category_t category)
+{
+    flush_blocks(pt);
+    return pt->seconds[category];
+}
+
+static ssize_t
+wrap_write(void *cookie, const char *buf, size_t size)
+{
+    print_time_t *pt = cookie;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+	if (buf[i] == '\n') {
+	    pt->line[pt->line_len] = '\0';
+	    print_time_line(pt, pt->line);
+	    pt->line_len = 0;
+	} else if (pt->line_len < sizeof(pt->line) - 1) {
+	    pt->line[pt->line_len++] = buf[i];
+	}
+    }
+
+    if (fwrite(buf, 1, size, pt->f_out) != size) return -1;
+    pt->written += size;
+
+    return size;
+}
+
+static int
+wrap_seek(void *cookie, off64_t *offset, int whence)
+{
+    print_time_t *pt = cookie;
+
+    if (whence != SEEK_CUR || *offset != 0) return -1;
+    *offset = pt->written;
+    return 0;
+}
+
+static int
+wrap_close(void *cookie)
+{
+    print_time_t *pt = cookie;
+
+    if (pt->line_len > 0) {
+	pt->line[pt->line_len] = '\0';
+	print_time_line(pt, pt->line);
+	pt->line_len = 0;
+    }
+    flush_blocks(pt);
+
+    return fclose(pt->f_out);
+}
+
+FILE *
+print_time_wrap(print_time_t *pt, FILE *f)
+{
+    cookie_io_functions_t io = { NULL, wrap_write, wrap_seek, wrap_close };
+
+    pt->f_out = f;
+    pt->written = 0;
+
+    return fopencookie(pt, "w", io);
+}
+
+static void
+print_duration(FILE *o, double seconds)
+{
+    fprintf(o, "%d:%02d:%02d", (int) (seconds / 3600), (int) fmod(seconds / 60, 60), (int) fmod(seconds, 60));
+}
+
+void
+print_time_report(print_time_t *pt, FILE *o)
+{
+    double total;
+    int i;
+
+    flush_blocks(pt);
+    total = print_time_elapsed(pt);
+
+    fprintf(o, "estimated time:    ");
+    print_duration(o, total);
+    fprintf(o, "\n");
+    for (i = 0; i < N_TIME_CATEGORIES; i++) {
+	fprintf(o, "    %-20s ", category_names[i]);
+	print_duration(o, pt->seconds[i]);
+	fprintf(o, " (%.1f%%)\n", total > 0 ? pt->seconds[i] / total * 100 : 0);
+    }
+}
+
+void
+print_time_destroy(print_time_t *pt)
+{
+    free(pt);
+}
@@ -0,0 +1,32 @@
+#ifndef __PRINT_TIME_H__
+#define __PRINT_TIME_H__
+
+#include <stdio.h>
+
+typedef enum {
+    TIME_OBJECT = 0, TIME_TOWER, TIME_TOWER_TRAVEL, TIME_RETRACTION, TIME_PING, N_TIME_CATEGORIES
+} time_category_t;
+
+typedef struct print_timeS print_time_t;
+
+print_time_t *print_time_new(void);
+
+/* What is being printed: TIME_OBJECT, TIME_TOWER or TIME_PING */
+void print_time_set_context(print_time_t *, time_category_t context);
+
+time_category_t print_time_get_context(print_time_t *);
+
+void print_time_line(print_time_t *, const char *line);
+
+double print_time_elapsed(print_time_t *);
+
+double print_time_category(print_time_t *, time_category_t);
+
+/* Returns a stream that times everything written to it before passing it on to f */
+FILE *print_time_wrap(print_time_t *, FILE *f);
+
+void print_time_report(print_time_t *, FILE *);
+
+void print_time_destroy(print_time_t *);
+
+#endif
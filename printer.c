@@ -3,6 +3,7 @@
 #include <string.h>
 #include <math.h>
 #include "printer.h"
+#include "snapshot.h"
 #include "yaml-wrapper.h"
 
 static struct {
@@ -10,6 +11,7 @@ static struct {
     size_t offset;
     enum { BOOLEAN, DOUBLE, INT, STRING } type;
     int max_depth;
+    const char *parent;
 } keys[] = {
     { "name", offsetof(printer_t, name), STRING, -1 },
     { "circular", offsetof(printer_t, circular), BOOLEAN, -1 },
@@ -38,24 +40,97 @@ static struct {
     { "prime_mm", offsetof(printer_t, prime_mm), DOUBLE, -1 },
     { "pings_ignore_retraction", offsetof(printer_t, pings_ignore_retraction), BOOLEAN, -1 },
     { "ping_stabilize_mm", offsetof(printer_t, ping_stabilize_mm), DOUBLE, -1 },
+    { "method", offsetof(printer_t, transition_method), INT, -1, "transitions" },
+    { "purgeSpeed", offsetof(printer_t, purge_speed), DOUBLE, -1, "sideTransitions" },
+    { "purgeInPlace", offsetof(printer_t, purge_in_place), BOOLEAN, -1, "sideTransitions" },
+    { "x", offsetof(printer_t, purge_x), DOUBLE, -1, "coordinates" },
+    { "y", offsetof(printer_t, purge_y), DOUBLE, -1, "coordinates" },
+    { "purgeEdge", offsetof(printer_t, purge_edge), STRING, -1, "sideTransitions" },
+    { "purgeEdgeOffset", offsetof(printer_t, purge_edge_offset), DOUBLE, -1, "sideTransitions" },
+    { "jogPauses", offsetof(printer_t, jog_pauses), BOOLEAN, -1, "pings" },
+    { "mechanicalPingGCode", offsetof(printer_t, mechanical_ping_gcode), STRING, -1, "pings" },
+    { "earlyPingMM", offsetof(printer_t, early_ping_mm), DOUBLE, -1, "pings" },
+    { "earlyPingSpacing", offsetof(printer_t, early_ping_spacing), DOUBLE, -1, "pings" },
+    { "pingSpacing", offsetof(printer_t, ping_spacing), DOUBLE, -1, "pings" },
+    { "reducedPingMM", offsetof(printer_t, reduced_ping_mm), DOUBLE, -1, "pings" },
+    { "reducedPingSpacing", offsetof(printer_t, reduced_ping_spacing), DOUBLE, -1, "pings" },
+    { "minimalPingMM", offsetof(printer_t, minimal_ping_mm), DOUBLE, -1, "pings" },
+    { "minimalPingSpacing", offsetof(printer_t, minimal_ping_spacing), DOUBLE, -1, "pings" },
+    { "pingSeconds", offsetof(printer_t, ping_seconds), DOUBLE, -1, "pings" },
+    { "spliceSeconds", offsetof(printer_t, splice_seconds), DOUBLE, -1, "palette" },
+    { "bufferLength", offsetof(printer_t, buffer_len), DOUBLE, -1, "palette" },
+    { "feedRate", offsetof(printer_t, splice_feed_rate), DOUBLE, -1, "palette" },
+    { "acceleration", offsetof(printer_t, acceleration), DOUBLE, -1, "motion" },
+    { "junctionDeviation", offsetof(printer_t, junction_deviation), DOUBLE, -1, "motion" },
+    { "extruderClearanceRadius", offsetof(printer_t, clearance_radius), DOUBLE, -1, "sequential" },
+    { "extruderClearanceHeight", offsetof(printer_t, clearance_height), DOUBLE, -1, "sequential" },
 };
 
 #define N_KEYS (sizeof(keys) / sizeof(keys[0]))
+#define MAX_DEPTH 16
 
 printer_t *printer;
 
-int
-printer_load(const char *fname)
+static void
+set_value(printer_t *to, int ki, const char *value)
+{
+    void *p = ((unsigned char *) to) + keys[ki].offset;
+    char **s = (char **) p;
+    double *d = (double *) p;
+    int *i = (int *) p;
+
+    switch(keys[ki].type) {
+    case BOOLEAN:
+	*i = strcmp(value, "true") == 0;
+	break;
+    case DOUBLE:
+	*d = atof(value);
+	break;
+    case INT:
+	*i = atoi(value);
+	break;
+    case STRING:
+	if (*s) free(*s);
+	*s = strdup(value);
+	break;
+    }
+}
+
+/* Returns the number of problems found in the yaml, -1 if it can't be read.
+ * Keys that aren't used here (the rest of the Chroma profile) are ignored.
+ */
+
+static int
+load_yaml(const char *fname)
 {
     yaml_wrapper_t *p;
     yaml_event_t event, event2;
     int ki;
     int depth = 0;
+    char parents[MAX_DEPTH][100] = { "", };
+    int n_problems = 0;
 
-    if ((p = yaml_wrapper_new(fname)) == NULL) return 0;
+    if ((p = yaml_wrapper_new(fname)) == NULL) return -1;
 
     printer = calloc(sizeof(*printer), 1);
     printer->ping_stabilize_mm = 5000;
+    printer->transition_method = TRANSITION_TOWER;
+    printer->purge_speed = 4;
+    printer->early_ping_mm = 2000;
+    printer->early_ping_spacing = 350;
+    printer->ping_spacing = 425;
+    printer->reduced_ping_mm = 10000;
+    printer->reduced_ping_spacing = 425*2;
+    printer->minimal_ping_mm = 50000;
+    printer->minimal_ping_spacing = 425*2*4;
+    printer->ping_seconds = 20;
+    printer->splice_seconds = 45;
+    printer->buffer_len = 400;
+    printer->splice_feed_rate = 20;
+    printer->acceleration = 1000;
+    printer->junction_deviation = 0.05;
+    printer->clearance_radius = 20;
+    printer->clearance_height = 20;
 
     for (;;) {
 	if (! yaml_wrapper_event(p, &event)) break;
@@ -73,6 +148,9 @@ process_event:
 	    }
 
 	    if (event2.type != YAML_SCALAR_EVENT) {
+		if (depth + 1 < MAX_DEPTH) {
+		    strncpy(parents[depth+1], key, sizeof(parents[0]) - 1);
+		}
 		yaml_event_delete(&event);
 		event = event2;
 		goto process_event;
@@ -82,27 +160,9 @@ process_event:
 
 	    for (ki = 0; ki < N_KEYS; ki++) {
 		if (strcmp(key, keys[ki].key) == 0) {
-		    void *p = ((unsigned char *) printer) + keys[ki].offset;
-		    char **s = (char **) p;
-		    double *d = (double *) p;
-		    int *i = (int *) p;
-
-		    if (keys[ki].max_depth  < 0 || depth <= keys[ki].max_depth) {
-			switch(keys[ki].type) {
-			case BOOLEAN:
-			    *i = strcmp(value, "true") == 0;
-			    break;
-			case DOUBLE:
-			    *d = atof(value);
-			    break;
-			case INT:
-			    *i = atoi(value);
-			    break;
-			case STRING:
-			    if (*s) free(*s);
-			    *s = strdup(value);
-			    break;
-			}
+		    if ((keys[ki].max_depth  < 0 || depth <= keys[ki].max_depth) &&
+			(keys[ki].parent == NULL || (depth < MAX_DEPTH && strcmp(parents[depth], keys[ki].parent) == 0))) {
+			set_value(printer, ki, value);
 		    }
 		}
 	    }
@@ -112,8 +172,115 @@ process_event:
 	yaml_event_delete(&event);
     }
 
+    if (yaml_wrapper_had_error(p)) n_problems++;
+    yaml_wrapper_delete(p);
+
     if (printer->max_layer_height <= 0) printer->max_layer_height = printer->nozzle * 0.8;
     printer->print_speed_mm_per_min *= 60;
+    printer->side_transitions = printer->transition_method == SIDE_TRANSITIONS;
+
+    return n_problems;
+}
+
+/* The strings are written as offsets into the snapshot's strings, they are
+ * copied so the snapshot isn't kept mapped.
+ */
+
+static int
+load_snapshot(const char *fname)
+{
+    const snapshot_header_t *h;
+    int ki;
+
+    if ((h = snapshot_map(fname, SNAPSHOT_PRINTER, sizeof(*printer))) == NULL) return 0;
+    if (h->counts[0] != 1) {
+	snapshot_unmap(h);
+	return 0;
+    }
+
+    printer = malloc(sizeof(*printer));
+    memcpy(printer, h + 1, sizeof(*printer));
+    for (ki = 0; ki < N_KEYS; ki++) {
+	if (keys[ki].type == STRING) {
+	    char **s = (char **) (((unsigned char *) printer) + keys[ki].offset);
+	    const char *str = snapshot_string(h, (long) *s);
+
+	    *s = str ? strdup(str) : NULL;
+	}
+    }
+    snapshot_unmap(h);
+
+    return 1;
+}
+
+int
+printer_load(const char *fname)
+{
+    if (load_snapshot(fname)) return 1;
+    return load_yaml(fname) >= 0;
+}
+
+static int
+validate(const char *fname)
+{
+    int n_problems = 0;
+
+#define CHECK(cond, what) if (! (cond)) { fprintf(stderr, "%s: %s\n", fname, what); n_problems++; }
+    CHECK(printer->name, "no name");
+    CHECK(printer->nozzle > 0, "nozzleDiameter must be set");
+    CHECK(printer->filament > 0, "filamentDiameter must be set");
+    CHECK(printer->circular ? printer->diameter > 0 : printer->bed_x > 0 && printer->bed_y > 0, "the size of the printBed must be set");
+    CHECK(printer->pv > 0 && printer->calibration_len > 0, "printValue and calibrationGCodeLength must be set");
+    CHECK(printer->transition_len > 0, "purgeLength must be set");
+    CHECK(printer->min_density >= 0 && printer->min_density <= 1, "minDensity must be between 0 and 1");
+    CHECK(printer->min_bottom_density >= 0 && printer->min_bottom_density <= 1, "minBottomDensity must be between 0 and 1");
+    CHECK(printer->transition_method == TRANSITION_TOWER || printer->transition_method == SIDE_TRANSITIONS, "unknown transitions method");
+#undef CHECK
+
+    return n_problems;
+}
+
+int
+printer_compile(const char *fname)
+{
+    snapshot_writer_t *w;
+    printer_t p;
+    int ki, n_problems;
+
+    if ((n_problems = load_yaml(fname)) < 0) return 0;
+    n_problems += validate(fname);
+    if (n_problems > 0) {
+	fprintf(stderr, "%s: %d problems, not compiled\n", fname, n_problems);
+	return 0;
+    }
+
+    if ((w = snapshot_writer_new(fname, SNAPSHOT_PRINTER, sizeof(p))) == NULL) return 0;
+    p = *printer;
+    for (ki = 0; ki < N_KEYS; ki++) {
+	if (keys[ki].type == STRING) {
+	    char **s = (char **) (((unsigned char *) &p) + keys[ki].offset);
+
+	    *s = (char *) (long) snapshot_add_string(w, *s);
+	}
+    }
+    snapshot_add_records(w, 1, &p, sizeof(p));
+
+    return snapshot_writer_finish(w);
+}
+
+/* Keys that appear more than once (x, y) set the first of them */
+
+int
+printer_set(printer_t *p, const char *key, const char *value)
+{
+    int ki;
+
+    for (ki = 0; ki < N_KEYS && strcmp(key, keys[ki].key) != 0; ki++) {}
+    if (ki >= N_KEYS) return 0;
+
+    set_value(p, ki, value);
+    if (keys[ki].offset == offsetof(printer_t, print_speed_mm_per_min)) p->print_speed_mm_per_min *= 60;
+    p->side_transitions = p->transition_method == SIDE_TRANSITIONS;
 
     return 1;
 }
@@ -27,14 +27,46 @@ typedef struct {
     int ping_off_tower;
     double prime_mm;
     int pings_ignore_retraction;
-    int ping_stabilize_mm;
+    double ping_stabilize_mm;
+    int    transition_method;
+    int    side_transitions;
+    double purge_speed;
+    int    purge_in_place;
+    double purge_x, purge_y;
+    char  *purge_edge;
+    double purge_edge_offset;
+    int    jog_pauses;
+    char  *mechanical_ping_gcode;
+    double early_ping_mm, early_ping_spacing;
+    double ping_spacing;
+    double reduced_ping_mm, reduced_ping_spacing;
+    double minimal_ping_mm, minimal_ping_spacing;
+    double ping_seconds;
+    double splice_seconds;
+    double buffer_len;
+    double splice_feed_rate;
+    double acceleration;
+    double junction_deviation;
+    double clearance_radius, clearance_height;
 } printer_t;
 
+#define TRANSITION_TOWER	1
+#define SIDE_TRANSITIONS	2
+
 extern printer_t *printer;
 
+/* Uses the snapshot made by printer_compile() while the yaml is unchanged */
 int
 printer_load(const char *fname);
 
+/* Validate the yaml and write its snapshot, returns 0 if it isn't valid */
+int
+printer_compile(const char *fname);
+
+/* Set the value of one key of the yaml, returns 0 if there's no such key */
+int
+printer_set(printer_t *p, const char *key, const char *value);
+
 double filament_length_to_mm3(double len);
 double filament_mm3_to_length(double len);
 double speed_to_flow_rate(double mm_per_min, double layer_height);
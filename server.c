@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "gcode.h"
+#include "print-time.h"
+#include "transition-block.h"
+#include "server.h"
+
+/* Convert on request over a Unix socket, keeping the printers and the
+ * materials loaded between requests (they are loaded
+ * again when their files change).
+ *
+ * Everything on the socket is framed as a header line "<name> <length>"
+ * followed by that many bytes.  A request is a "convert" frame holding the
+ * same arguments as the command line.  The reply is a sequence of frames:
+ *
+ *   status	"ok" or "failed"
+ *   msf	the MSF
+ *   gcode	the name of the G-code file written
+ *   stats	"name value" lines: splices, pings, transitions, filament_mm
+ *		and seconds
+ *   log	everything the conversion printed
+ *   end	(empty)
+ *
+ * Any number of requests can be sent on a connection and are answered in
+ * order.  Each conversion is run in a child so a client waiting on one
+ * doesn't hold up the others and whatever it leaves behind (or a
+ * conversion that exits) doesn't affect the next one.
+ */
+
+#define MAX_REQUEST	(64*1024)
+
+static FILE *reply, *reply_log;
+static int replied;
+
+static void
+write_frame(FILE *o, const char *name, const char *data, size_t len)
+{
+    fprintf(o, "%s %zu\n", name, len);
+    fwrite(data, 1, len, o);
+}
+
+static char *
+read_all(FILE *f, size_t *len)
+{
+    char *buf;
+    long size;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    buf = malloc(size + 1);
+    *len = fread(buf, 1, size, f);
+    buf[*len] = '\0';
+    return buf;
+}
+
+static void
+write_file_frame(FILE *o, const char *name, const char *fname)
+{
+    FILE *f;
+    char *buf;
+    size_t len;
+
+    if (! fname || (f = fopen(fname, "r")) == NULL) {
+	write_frame(o, name, "", 0);
+	return;
+    }
+    buf = read_all(f, &len);
+    write_frame(o, name, buf, len);
+    free(buf);
+    fclose(f);
+}
+
+static void
+write_stats_frame(FILE *o)
+{
+    char *buf = NULL;
+    size_t len;
+    FILE *s = open_memstream(&buf, &len);
+
+    fprintf(s, "splices %d\n", n_splices);
+    fprintf(s, "pings %d\n", n_pings);
+    fprintf(s, "transitions %d\n", n_transitions);
+    fprintf(s, "filament_mm %.2f\n", n_splices > 0 ? splices[n_splices-1].mm : 0);
+    fprintf(s, "seconds %.0f\n", print_time ? print_time_elapsed(print_time) : 0);
+    fclose(s);
+
+    write_frame(o, "stats", buf, len);
+    free(buf);
+}
+
+static void
+reply_failed(FILE *o, const char *log, size_t len)
+{
+    write_frame(o, "status", "failed", 6);
+    write_frame(o, "log", log, len);
+    write_frame(o, "end", "", 0);
+    fflush(o);
+}
+
+/* A conversion that exits part way still gets its reply */
+
+static void
+reply_at_exit(void)
+{
+    char *buf;
+    size_t len;
+
+    if (replied || ! reply) return;
+    fflush(stdout);
+    fflush(stderr);
+    buf = read_all(reply_log, &len);
+    reply_failed(reply, buf, len);
+    free(buf);
+}
+
+/* Runs in the child with everything it prints going to a temporary file */
+
+static void
+convert_and_reply(convert_t *c, FILE *o)
+{
+    char *buf;
+    size_t len;
+    int ok;
+
+    reply = o;
+    reply_log = tmpfile();
+    atexit(reply_at_exit);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fileno(reply_log), 1);
+    dup2(fileno(reply_log), 2);
+
+    ok = convert_run(c) > 0;
+    fflush(stdout);
+    fflush(stderr);
+    replied = 1;
+
+    write_frame(o, "status", ok ? "ok" : "failed", ok ? 2 : 6);
+    if (ok) {
+	int validate_only = convert_options(c)->validate_only;
+
+	write_file_frame(o, "msf", validate_only ? NULL : convert_msf_fname(c));
+	write_frame(o, "gcode", convert_gcode_fname(c), validate_only ? 0 : strlen(convert_gcode_fname(c)));
+	write_stats_frame(o);
+    }
+    buf = read_all(reply_log, &len);
+    write_frame(o, "log", buf, len);
+    write_frame(o, "end", "", 0);
+    fflush(o);
+}
+
+/* The connections are all served by the one process so that the printers
+ * and materials it has loaded are kept for all of them.  Only the
+ * conversions are forked, one at a time per connection.  The requests of
+ * a connection that is converting are left on the socket until it's done.
+ */
+
+#define MAX_CONNECTIONS	64
+
+typedef struct {
+    int fd;		/* -1 once the client has gone */
+    FILE *o;
+    char *buf;		/* what has been read of the next request */
+    size_t len;
+    pid_t pid;		/* of its conversion, 0 if none is running */
+    convert_t *c;
+} connection_t;
+
+static connection_t conns[MAX_CONNECTIONS];
+static int n_conns;
+static int listen_fd;
+
+static void
+close_connection(connection_t *conn)
+{
+    if (conn->fd < 0) return;
+    fclose(conn->o);
+    close(conn->fd);
+    free(conn->buf);
+    conn->fd = -1;
+    conn->buf = NULL;
+    conn->len = 0;
+}
+
+/* A connection is only dropped once its conversion is done too */
+
+static void
+remove_connection(int i)
+{
+    close_connection(&conns[i]);
+    conns[i] = conns[--n_conns];
+}
+
+static void
+start_conversion(connection_t *conn, char *args, server_parse_t parse)
+{
+    int i;
+
+    if ((conn->c = parse(args)) == NULL) {
+	const char *msg = "invalid arguments\n";
+
+	reply_failed(conn->o, msg, strlen(msg));
+	return;
+    }
+
+    fflush(conn->o);
+    if ((conn->pid = fork()) == 0) {
+	signal(SIGCHLD, SIG_DFL);
+	close(listen_fd);
+	for (i = 0; i < n_conns; i++) {
+	    if (&conns[i] != conn && conns[i].fd >= 0) {
+		close(fileno(conns[i].o));
+		close(conns[i].fd);
+	    }
+	}
+	convert_and_reply(conn->c, conn->o);
+	exit(0);
+    }
+    if (conn->pid < 0) {
+	const char *msg = "can't start the conversion\n";
+
+	perror("fork");
+	conn->pid = 0;
+	reply_failed(conn->o, msg, strlen(msg));
+	convert_destroy(conn->c);
+	conn->c = NULL;
+    }
+}
+
+static void
+finish_conversion(connection_t *conn, int status)
+{
+    if (WIFSIGNALED(status) && conn->fd >= 0) {
+	const char *msg = "conversion crashed\n";
+
+	reply_failed(conn->o, msg, strlen(msg));
+    }
+    convert_destroy(conn->c);
+    conn->c = NULL;
+    conn->pid = 0;
+}
+
+/* Starts the next request read in full, returns 0 if the connection is
+ * broken and should be closed.
+ */
+
+static int
+next_request(connection_t *conn, server_parse_t parse)
+{
+    char name[32];
+    char *nl;
+    size_t len, header;
+
+    while (conn->pid == 0 && (nl = memchr(conn->buf, '\n', conn->len)) != NULL) {
+	*nl = '\0';
+	if (sscanf(conn->buf, "%31s %zu", name, &len) != 2 || len > MAX_REQUEST) return 0;
+	header = nl - conn->buf + 1;
+	if (conn->len < header + len) {
+	    *nl = '\n';
+	    return 1;
+	}
+
+	if (strcmp(name, "convert") == 0) {
+	    char *args = malloc(len + 1);
+
+	    memcpy(args, conn->buf + header, len);
+	    args[len] = '\0';
+	    start_conversion(conn, args, parse);
+	    free(args);
+	} else {
+	    const char *msg = "unknown request\n";
+
+	    reply_failed(conn->o, msg, strlen(msg));
+	}
+	conn->len -= header + len;
+	memmove(conn->buf, conn->buf + header + len, conn->len);
+    }
+
+    /* Until its newline, all there is of a request is the start of its header */
+    return conn->pid != 0 || conn->len <= 64;
+}
+
+static void
+read_request(connection_t *conn, server_parse_t parse)
+{
+    ssize_t got;
+
+    conn->buf = realloc(conn->buf, conn->len + MAX_REQUEST + 64);
+    if ((got = read(conn->fd, conn->buf + conn->len, MAX_REQUEST + 64)) <= 0) {
+	close_connection(conn);
+	return;
+    }
+    conn->len += got;
+    if (! next_request(conn, parse)) close_connection(conn);
+}
+
+/* Only there so that a conversion finishing interrupts the poll */
+
+static void
+child_exited(int sig)
+{
+}
+
+int
+server_run(const char *socket_fname, server_parse_t parse)
+{
+    struct sockaddr_un addr;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, child_exited);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_fname) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket name is too long\n", socket_fname);
+	return 0;
+    }
+    strcpy(addr.sun_path, socket_fname);
+    unlink(socket_fname);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 5) < 0) {
+	perror(socket_fname);
+	return 0;
+    }
+
+    printf("Listening on %s\n", socket_fname);
+    fflush(stdout);
+
+    while (1) {
+	struct pollfd pfds[MAX_CONNECTIONS + 1];
+	pid_t pid;
+	int status;
+	int i;
+
+	/* A connection that is converting isn't read until it's done */
+	pfds[0].fd = n_conns < MAX_CONNECTIONS ? listen_fd : -1;
+	pfds[0].events = POLLIN;
+	for (i = 0; i < n_conns; i++) {
+	    pfds[i+1].fd = conns[i].pid == 0 ? conns[i].fd : -1;
+	    pfds[i+1].events = POLLIN;
+	}
+
+	if (poll(pfds, n_conns + 1, 1000) < 0 && errno != EINTR) {
+	    perror("poll");
+	    return 0;
+	}
+
+	for (i = 0; i < n_conns; i++) {
+	    if (pfds[i+1].fd >= 0 && (pfds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) read_request(&conns[i], parse);
+	}
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	    for (i = 0; i < n_conns && conns[i].pid != pid; i++) {}
+	    if (i == n_conns) continue;
+	    finish_conversion(&conns[i], status);
+	    if (conns[i].fd >= 0 && ! next_request(&conns[i], parse)) close_connection(&conns[i]);
+	}
+
+	for (i = 0; i < n_conns; i++) {
+	    if (conns[i].fd < 0 && conns[i].pid == 0) remove_connection(i--);
+	}
+
+	if (pfds[0].fd >= 0 && (pfds[0].revents & POLLIN)) {
+	    int fd;
+
+	    if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+		if (errno != EINTR) perror("accept");
+		continue;
+	    }
+	    memset(&conns[n_conns], 0, sizeof(conns[n_conns]));
+	    conns[n_conns].fd = fd;
+	    if ((conns[n_conns].o = fdopen(dup(fd), "w")) == NULL) {
+		perror("fdopen");
+		close(fd);
+		continue;
+	    }
+	    n_conns++;
+	}
+    }
+}
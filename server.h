@@ -0,0 +1,14 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "convert.h"
+
+/* Turns the arguments of a request into a conversion, NULL if invalid */
+typedef convert_t *(*server_parse_t)(char *args);
+
+/* Accept conversion requests on the Unix socket socket_fname until killed.
+ * Returns only if the socket can't be set up.
+ */
+int server_run(const char *socket_fname, server_parse_t parse);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC	"g2m-conf"
+
+struct snapshot_writerS {
+    char *fname;
+    snapshot_header_t h;
+    int n_counts;
+    FILE *records, *strings;
+    char *records_buf, *strings_buf;
+    size_t records_len, strings_len;
+};
+
+static char *
+snapshot_fname(const char *fname)
+{
+    char *snap = malloc(strlen(fname) + 5);
+
+    sprintf(snap, "%s.bin", fname);
+    return snap;
+}
+
+static long long
+mtime_ns(struct stat *st)
+{
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+const snapshot_header_t *
+snapshot_map(const char *fname, snapshot_kind_t kind, int record_size)
+{
+    char *snap = snapshot_fname(fname);
+    struct stat st, snap_st;
+    snapshot_header_t *h;
+    int fd;
+
+    fd = open(snap, O_RDONLY);
+    free(snap);
+    if (fd < 0) return NULL;
+
+    if (stat(fname, &st) < 0 || fstat(fd, &snap_st) < 0 || snap_st.st_size < sizeof(*h)) {
+	close(fd);
+	return NULL;
+    }
+
+    h = mmap(NULL, snap_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return NULL;
+
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != SNAPSHOT_VERSION ||
+	h->kind != kind || h->record_size != record_size || h->len != snap_st.st_size ||
+	h->source_size != st.st_size || h->source_mtime != mtime_ns(&st)) {
+	munmap(h, snap_st.st_size);
+	return NULL;
+    }
+
+    return h;
+}
+
+void
+snapshot_unmap(const snapshot_header_t *h)
+{
+    if (h) munmap((void *) h, h->len);
+}
+
+const char *
+snapshot_string(const snapshot_header_t *h, int offset)
+{
+    if (offset < 0 || offset >= h->len - h->strings) return NULL;
+    return (const char *) h + h->strings + offset;
+}
+
+snapshot_writer_t *
+snapshot_writer_new(const char *fname, snapshot_kind_t kind, int record_size)
+{
+    snapshot_writer_t *w = calloc(sizeof(*w), 1);
+    struct stat st;
+
+    if (stat(fname, &st) < 0) {
+	free(w);
+	return NULL;
+    }
+
+    w->fname = strdup(fname);
+    memcpy(w->h.magic, SNAPSHOT_MAGIC, sizeof(w->h.magic));
+    w->h.version = SNAPSHOT_VERSION;
+    w->h.kind = kind;
+    w->h.source_size = st.st_size;
+    w->h.source_mtime = mtime_ns(&st);
+    w->h.record_size = record_size;
+    w->records = open_memstream(&w->records_buf, &w->records_len);
+    w->strings = open_memstream(&w->strings_buf, &w->strings_len);
+
+    return w;
+}
+
+int
+snapshot_add_string(snapshot_writer_t *w, const char *s)
+{
+    long offset;
+
+    if (! s) return -1;
+    offset = ftell(w->strings);
+    fwrite(s, 1, strlen(s) + 1, w->strings);
+    return offset;
+}
+
+/* Each array of records is padded so that the next one stays aligned */
+
+void
+snapshot_add_records(snapshot_writer_t *w, int count, const void *records, size_t size)
+{
+    static const char zeros[8];
+
+    if (w->n_counts < SNAPSHOT_MAX_COUNTS) w->h.counts[w->n_counts++] = count;
+    fwrite(records, size, count, w->records);
+    fwrite(zeros, 1, (8 - (size * count) % 8) % 8, w->records);
+}
+
+int
+snapshot_writer_finish(snapshot_writer_t *w)
+{
+    char *snap = snapshot_fname(w->fname);
+    char *tmp = malloc(strlen(snap) + 5);
+    FILE *f;
+    int ok = 0;
+
+    fclose(w->records);
+    fclose(w->strings);
+    w->h.strings = sizeof(w->h) + w->records_len;
+    w->h.len = w->h.strings + w->strings_len;
+
+    sprintf(tmp, "%s.tmp", snap);
+    if ((f = fopen(tmp, "w")) != NULL) {
+	ok = fwrite(&w->h, sizeof(w->h), 1, f) == 1 &&
+	     fwrite(w->records_buf, 1, w->records_len, f) == w->records_len &&
+	     fwrite(w->strings_buf, 1, w->strings_len, f) == w->strings_len;
+	if (fclose(f) != 0) ok = 0;
+	if (ok) ok = rename(tmp, snap) == 0;
+	if (! ok) unlink(tmp);
+    }
+    if (! ok) perror(snap);
+
+    free(snap);
+    free(tmp);
+    free(w->fname);
+    free(w->records_buf);
+    free(w->strings_buf);
+    free(w);
+    return ok;
+}
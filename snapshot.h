@@ -0,0 +1,53 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+
+/* A binary snapshot of a yaml config is kept in fname.bin and is used
+ * instead of the yaml for as long as the yaml hasn't changed since it was
+ * made.  It holds the records the config is loaded into, as they are in
+ * memory, followed by the strings they point to.  Bump SNAPSHOT_VERSION
+ * whenever what is written changes.
+ */
+
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_MAX_COUNTS	4
+
+typedef enum { SNAPSHOT_PRINTER = 1, SNAPSHOT_MATERIALS } snapshot_kind_t;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int kind;
+    long long source_size;
+    long long source_mtime;
+    int record_size;		/* of the main record, to catch layout changes */
+    int counts[SNAPSHOT_MAX_COUNTS];
+    int pad;
+    long long strings;		/* where the strings start */
+    long long len;
+} snapshot_header_t;
+
+/* Returns the snapshot of fname mapped into memory if it is up to date,
+ * otherwise NULL.  The records start right after the header.
+ */
+const snapshot_header_t *snapshot_map(const char *fname, snapshot_kind_t kind, int record_size);
+
+void snapshot_unmap(const snapshot_header_t *h);
+
+/* NULL for the offset of a NULL string */
+const char *snapshot_string(const snapshot_header_t *h, int offset);
+
+typedef struct snapshot_writerS snapshot_writer_t;
+
+snapshot_writer_t *snapshot_writer_new(const char *fname, snapshot_kind_t kind, int record_size);
+
+/* Returns the offset to record for the string, -1 for NULL */
+int snapshot_add_string(snapshot_writer_t *, const char *s);
+
+void snapshot_add_records(snapshot_writer_t *, int count, const void *records, size_t size);
+
+/* Write the snapshot next to the yaml, returns 0 if it can't be written */
+int snapshot_writer_finish(snapshot_writer_t *);
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gcode.h"
+#include "printer.h"
+#include "print-time.h"
+#include "transition-block.h"
+#include "util.h"
+#include "splice-sim.h"
+
+/* Model whether the palette can splice as fast as the printer uses the
+ * filament.  Each splice takes a fixed cycle plus the time to feed the
+ * segment and the palette can't get more than its buffer ahead of the
+ * printer.  When a splice isn't finished by the time the printer reaches
+ * it, the printer stalls.
+ */
+
+#define MIN_TOWER_SPEED_MULTIPLIER	0.25
+#define MIN_STALL_SECONDS		0.1
+
+typedef struct {
+    double mm;
+    double seconds;
+} time_point_t;
+
+static time_point_t *timeline;
+static int n_timeline, a_timeline;
+
+stall_t *stalls;
+int n_stalls;
+
+static void
+add_time_point(double mm, double seconds)
+{
+    if (n_timeline > 0 && mm < timeline[n_timeline-1].mm) mm = timeline[n_timeline-1].mm;
+
+    if (n_timeline >= a_timeline) {
+	a_timeline = a_timeline ? a_timeline * 2 : 1024;
+	timeline = realloc(timeline, sizeof(*timeline) * a_timeline);
+    }
+    timeline[n_timeline].mm = mm;
+    timeline[n_timeline].seconds = seconds;
+    n_timeline++;
+}
+
+/* Walk the output, timing it with the print time estimator, and map the
+ * filament position (anchored at each splice) to when it is printed.
+ */
+
+static void
+estimate_times(FILE *f)
+{
+    char buf[1024];
+    double e = 0;
+    double extruded = 0, anchor_extruded = 0, anchor_mm = 0;
+    int e_is_absolute = 1, is_relative = 0;
+    int splice = 0;
+    long pos = 0;
+    print_time_t *pt;
+
+    pt = print_time_new();
+    n_timeline = 0;
+    add_time_point(0, 0);
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	double v;
+
+	while (splice < n_splices && splices[splice].gcode_offset <= pos) {
+	    anchor_mm = splices[splice].gcode_mm;
+	    anchor_extruded = extruded;
+	    splice++;
+	}
+	pos = ftell(f);
+
+	print_time_line(pt, buf);
+
+	if (strncmp(buf, "G1 ", 3) == 0 || strncmp(buf, "G0 ", 3) == 0) {
+	    if (find_arg(buf, 'E', &v)) {
+		double ne = e_is_absolute && ! is_relative ? v : e + v;
+
+		if (ne != e) {
+		    extruded += ne - e;
+		    add_time_point(anchor_mm + extruded - anchor_extruded, print_time_elapsed(pt));
+		}
+		e = ne;
+	    }
+	} else if (strncmp(buf, "G92 ", 4) == 0) {
+	    if (find_arg(buf, 'E', &v)) e = v;
+	} else if (strncmp(buf, "G90", 3) == 0) {
+	    is_relative = 0;
+	} else if (strncmp(buf, "G91", 3) == 0) {
+	    is_relative = 1;
+	} else if (strncmp(buf, "M82", 3) == 0) {
+	    e_is_absolute = 1;
+	} else if (strncmp(buf, "M83", 3) == 0) {
+	    e_is_absolute = 0;
+	}
+    }
+
+    print_time_destroy(pt);
+}
+
+static double
+time_at_mm(double mm)
+{
+    int lo = 0, hi = n_timeline-1;
+
+    if (mm <= timeline[0].mm) return timeline[0].seconds;
+    if (mm >= timeline[hi].mm) return timeline[hi].seconds;
+
+    while (hi - lo > 1) {
+	int mid = (lo + hi) / 2;
+	if (timeline[mid].mm < mm) lo = mid;
+	else hi = mid;
+    }
+
+    if (timeline[hi].mm == timeline[lo].mm) return timeline[hi].seconds;
+    return timeline[lo].seconds + (mm - timeline[lo].mm) / (timeline[hi].mm - timeline[lo].mm) * (timeline[hi].seconds - timeline[lo].seconds);
+}
+
+int
+splice_sim_run(FILE *gcode)
+{
+    double spliced = 0, delay = 0, last_mm = 0;
+    int i;
+
+    n_stalls = 0;
+    estimate_times(gcode);
+
+    stalls = realloc(stalls, sizeof(*stalls) * (n_splices + 1));
+
+    for (i = 0; i < n_splices - 1; i++) {
+	double mm = splices[i].mm;
+	double needed = time_at_mm(mm) + delay;
+	double start = fmax(spliced, time_at_mm(mm - printer->buffer_len) + delay);
+
+	spliced = start + printer->splice_seconds + (mm - last_mm) / printer->splice_feed_rate;
+	if (spliced > needed + MIN_STALL_SECONDS) {
+	    stalls[n_stalls].splice = i;
+	    stalls[n_stalls].seconds = spliced - needed;
+	    stalls[n_stalls].at = needed;
+	    delay += spliced - needed;
+	    n_stalls++;
+	}
+	last_mm = mm;
+    }
+
+    return n_stalls;
+}
+
+void
+splice_sim_report(FILE *o)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < n_stalls; i++) total += stalls[i].seconds;
+
+    fprintf(o, "palette stalls:    %d (%.0f seconds waiting for splices)\n", n_stalls, total);
+    for (i = 0; i < n_stalls; i++) {
+	fprintf(o, "    splice %d at %.2f mm: waits %.1f seconds at %.0f:%02.0f\n", stalls[i].splice+1, splices[stalls[i].splice].mm, stalls[i].seconds, floor(stalls[i].at / 60), fmod(stalls[i].at, 60));
+    }
+}
+
+static transition_t *
+splice_transition(int splice)
+{
+    int i, n = 0;
+
+    for (i = 0; i < n_transitions; i++) {
+	if (transitions[i].from != transitions[i].to && n++ == splice) return &transitions[i];
+    }
+    return NULL;
+}
+
+/* Slow the tower down before each stalled splice and, if that isn't
+ * enough, make the transition longer, just enough to cover the stall.
+ */
+
+int
+splice_sim_fix()
+{
+    int i, n_fixed = 0;
+
+    for (i = 0; i < n_stalls; i++) {
+	transition_t *t = splice_transition(stalls[i].splice);
+	double mm = splices[stalls[i].splice].mm;
+	double stall = stalls[i].seconds;
+	double pre_seconds, multiplier;
+
+	if (! t || t->pre_mm <= 0) continue;
+
+	pre_seconds = time_at_mm(mm) - time_at_mm(mm - t->pre_mm);
+	if (pre_seconds <= 0) continue;
+
+	multiplier = fmax(t->speed_multiplier * pre_seconds / (pre_seconds + stall), MIN_TOWER_SPEED_MULTIPLIER);
+	if (multiplier < t->speed_multiplier) {
+	    double slower_seconds = pre_seconds * t->speed_multiplier / multiplier;
+
+	    stall -= slower_seconds - pre_seconds;
+	    pre_seconds = slower_seconds;
+	    t->speed_multiplier = multiplier;
+	    n_fixed++;
+	}
+
+	if (stall > 0) {
+	    double gain = pre_seconds / t->pre_mm - 1 / printer->splice_feed_rate;
+
+	    if (gain > 0 && transition_block_lengthen(t, stall / gain) > 0) n_fixed++;
+	}
+    }
+
+    return n_fixed;
+}
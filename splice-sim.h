@@ -0,0 +1,19 @@
+#ifndef __SPLICE_SIM_H__
+#define __SPLICE_SIM_H__
+
+#include <stdio.h>
+
+typedef struct {
+    int    splice;
+    double seconds;
+    double at;
+} stall_t;
+
+extern stall_t *stalls;
+extern int n_stalls;
+
+int splice_sim_run(FILE *gcode);
+void splice_sim_report(FILE *o);
+int splice_sim_fix();
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "spool.h"
+#include "util.h"
+
+/* A hot folder: every gcode file written (or moved) into the input
+ * directory is converted into the output directory.
+ *
+ * The settings of a job are the arguments of the command line without the
+ * gcode file, the first of:
+ *
+ *   x.gcode.args			next to x.gcode
+ *   "; gcode2msf: <settings>"	a comment in the first lines of x.gcode
+ *   gcode2msf.args			in the input directory
+ *
+ * The settings can't say where the output goes (-o, --output, --cache) or
+ * stop it being written (--validate), the spooler decides that.
+ *
+ * Each job is converted to temporary files in the output directory which
+ * are renamed to x.msf.gcode and then x.msf once it is done, so x.msf
+ * appearing means the job is complete.  What the conversion printed goes
+ * to x.log.  A file written again while it is being converted is
+ * converted again once the running conversion is done.  The state of the
+ * queue is kept in spool.status in the output directory.
+ */
+
+#define MAX_SETTINGS		4096
+#define MAX_HEADER_LINES	200
+#define SETTINGS_COMMENT	"; gcode2msf:"
+#define DIR_SETTINGS		"gcode2msf.args"
+
+static const char *output_flags[] = { "-o", "--output", "--cache", "--validate" };
+
+#define N_OUTPUT_FLAGS	(sizeof(output_flags) / sizeof(output_flags[0]))
+
+typedef struct {
+    char *name;
+    double queued;
+    pid_t pid;
+} spool_job_t;
+
+static spool_job_t *jobs;
+static int n_jobs, a_jobs;
+static int n_running, n_converted, n_failed;
+static int n_timed;
+static double last_latency, total_latency, max_latency;
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *
+path(const char *dir, const char *name, const char *suffix)
+{
+    char *p = malloc(strlen(dir) + strlen(name) + strlen(suffix) + 2);
+
+    sprintf(p, "%s/%s%s", dir, name, suffix);
+    return p;
+}
+
+static int
+is_job_name(const char *name)
+{
+    return name[0] != '.' && ends_with(name, ".gcode") && ! ends_with(name, ".msf.gcode") && strchr(name, ' ') == NULL;
+}
+
+static void
+queue_job(const char *name)
+{
+    int i;
+
+    for (i = 0; i < n_jobs; i++) {
+	if (jobs[i].pid == 0 && strcmp(jobs[i].name, name) == 0) return;
+    }
+    if (n_jobs >= a_jobs) {
+	a_jobs = a_jobs ? a_jobs * 2 : 64;
+	jobs = realloc(jobs, sizeof(*jobs) * a_jobs);
+    }
+    jobs[n_jobs].name = strdup(name);
+    jobs[n_jobs].queued = now();
+    jobs[n_jobs].pid = 0;
+    n_jobs++;
+}
+
+/* The outputs and the log are named after the job, so the same job can
+ * only be converted once at a time.
+ */
+
+static int
+is_running(const char *name)
+{
+    int i;
+
+    for (i = 0; i < n_jobs; i++) {
+	if (jobs[i].pid > 0 && strcmp(jobs[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void
+remove_job(int i)
+{
+    free(jobs[i].name);
+    memmove(&jobs[i], &jobs[i+1], sizeof(*jobs) * (n_jobs - i - 1));
+    n_jobs--;
+}
+
+/* Jobs that were dropped while the spooler wasn't running */
+
+static void
+queue_unconverted(const char *in_dir, const char *out_dir)
+{
+    DIR *d;
+    struct dirent *e;
+
+    if ((d = opendir(in_dir)) == NULL) return;
+    while ((e = readdir(d)) != NULL) {
+	char *msf;
+	struct stat st;
+
+	if (! is_job_name(e->d_name)) continue;
+	msf = path(out_dir, e->d_name, "");
+	strcpy(&msf[strlen(msf) - 6], ".msf");
+	if (stat(msf, &st) < 0) queue_job(e->d_name);
+	free(msf);
+    }
+    closedir(d);
+}
+
+static int
+read_settings_file(const char *fname, char *settings)
+{
+    FILE *f;
+    int ok;
+
+    if ((f = fopen(fname, "r")) == NULL) return 0;
+    ok = fgets(settings, MAX_SETTINGS, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+static int
+read_settings_comment(const char *fname, char *settings)
+{
+    FILE *f;
+    char buf[MAX_SETTINGS];
+    int i, ok = 0;
+
+    if ((f = fopen(fname, "r")) == NULL) return 0;
+    for (i = 0; ! ok && i < MAX_HEADER_LINES && fgets(buf, sizeof(buf), f) != NULL; i++) {
+	if (strncmp(buf, SETTINGS_COMMENT, strlen(SETTINGS_COMMENT)) == 0) {
+	    strcpy(settings, buf + strlen(SETTINGS_COMMENT));
+	    ok = 1;
+	}
+    }
+    fclose(f);
+    return ok;
+}
+
+static int
+job_settings(const char *in_dir, const char *name, char *settings)
+{
+    char *sidecar = path(in_dir, name, ".args");
+    char *gcode = path(in_dir, name, "");
+    char *dir_settings = path(in_dir, DIR_SETTINGS, "");
+    int ok;
+
+    ok = read_settings_file(sidecar, settings) || read_settings_comment(gcode, settings) || read_settings_file(dir_settings, settings);
+    settings[strcspn(settings, "\r\n")] = '\0';
+
+    free(sidecar);
+    free(gcode);
+    free(dir_settings);
+    return ok;
+}
+
+static const char *
+find_output_flag(const char *settings)
+{
+    char buf[MAX_SETTINGS];
+    char *arg;
+    unsigned i;
+
+    strcpy(buf, settings);
+    for (arg = strtok(buf, " \t"); arg; arg = strtok(NULL, " \t")) {
+	for (i = 0; i < N_OUTPUT_FLAGS; i++) {
+	    if (strcmp(arg, output_flags[i]) == 0) return output_flags[i];
+	}
+    }
+    return NULL;
+}
+
+static int
+rename_output(const char *tmp, const char *out_dir, const char *name, const char *suffix)
+{
+    char *from = path(out_dir, tmp, suffix);
+    char *to = path(out_dir, name, suffix);
+    int ok = rename(from, to) == 0;
+
+    if (! ok) perror(to);
+    free(from);
+    free(to);
+    return ok;
+}
+
+/* Runs in the child: convert to temporary files and rename them into
+ * place once they are complete.
+ */
+
+static void
+convert_job(convert_t *c, const char *out_dir, const char *tmp, const char *base)
+{
+    char *log = path(out_dir, base, ".log");
+    int fd;
+
+    if ((fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+    }
+
+    if (convert_run(c) <= 0) exit(1);
+    fflush(stdout);
+    if (! rename_output(tmp, out_dir, base, ".msf.gcode") || ! rename_output(tmp, out_dir, base, ".msf")) exit(1);
+    exit(0);
+}
+
+static void
+start_job(spool_job_t *job, const char *in_dir, const char *out_dir, spool_parse_t parse)
+{
+    char settings[MAX_SETTINGS] = "";
+    const char *flag;
+    char *args, *base, *tmp;
+    convert_t *c;
+    pid_t pid;
+
+    base = strdup(job->name);
+    base[strlen(base) - 6] = '\0';
+    tmp = malloc(strlen(base) + 6);
+    sprintf(tmp, ".%s.tmp", base);
+
+    if (! job_settings(in_dir, job->name, settings)) {
+	fprintf(stderr, "%s: no settings, skipping it\n", job->name);
+	job->pid = -1;
+    } else if ((flag = find_output_flag(settings)) != NULL) {
+	fprintf(stderr, "%s: %s can't be used in the settings, skipping it\n", job->name, flag);
+	job->pid = -1;
+    } else {
+	args = malloc(strlen(out_dir) + strlen(tmp) + strlen(settings) + strlen(in_dir) + strlen(job->name) + 20);
+	sprintf(args, "-o %s/%s %s %s/%s", out_dir, tmp, settings, in_dir, job->name);
+	if ((c = parse(args)) == NULL) {
+	    fprintf(stderr, "%s: invalid settings: %s\n", job->name, settings);
+	    job->pid = -1;
+	} else {
+	    fflush(stdout);
+	    fflush(stderr);
+	    if ((pid = fork()) == 0) convert_job(c, out_dir, tmp, base);
+	    job->pid = pid;
+	    convert_destroy(c);
+	}
+	free(args);
+    }
+
+    if (job->pid > 0) {
+	n_running++;
+	printf("Converting %s\n", job->name);
+    } else {
+	n_failed++;
+    }
+    fflush(stdout);
+    free(base);
+    free(tmp);
+}
+
+static void
+finish_job(int i, int ok)
+{
+    double latency = now() - jobs[i].queued;
+
+    n_running--;
+    if (ok) n_converted++;
+    else n_failed++;
+
+    n_timed++;
+    last_latency = latency;
+    total_latency += latency;
+    if (latency > max_latency) max_latency = latency;
+
+    printf("%s %s after %.1f seconds\n", ok ? "Converted" : "Failed to convert", jobs[i].name, latency);
+    fflush(stdout);
+    remove_job(i);
+}
+
+static void
+write_status(const char *out_dir)
+{
+    char *fname = path(out_dir, "spool.status", "");
+    char *tmp = path(out_dir, ".spool.status", ".tmp");
+    FILE *f;
+
+    if ((f = fopen(tmp, "w")) != NULL) {
+	fprintf(f, "queued %d\n", n_jobs - n_running);
+	fprintf(f, "running %d\n", n_running);
+	fprintf(f, "converted %d\n", n_converted);
+	fprintf(f, "failed %d\n", n_failed);
+	fprintf(f, "last_latency_seconds %.1f\n", last_latency);
+	fprintf(f, "mean_latency_seconds %.1f\n", n_timed > 0 ? total_latency / n_timed : 0);
+	fprintf(f, "max_latency_seconds %.1f\n", max_latency);
+	fclose(f);
+	rename(tmp, fname);
+    }
+    free(fname);
+    free(tmp);
+}
+
+/* Only there so that a job finishing interrupts the poll */
+
+static void
+child_exited(int sig)
+{
+}
+
+static void
+read_events(int fd)
+{
+    char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *p;
+
+    if ((len = read(fd, buf, sizeof(buf))) <= 0) return;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+	struct inotify_event *e = (struct inotify_event *) p;
+
+	if (e->len > 0 && is_job_name(e->name)) queue_job(e->name);
+    }
+}
+
+int
+spool_run(const char *in_dir, const char *out_dir, int max_jobs, spool_parse_t parse)
+{
+    int fd;
+
+    if (max_jobs <= 0) max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((fd = inotify_init()) < 0 || inotify_add_watch(fd, in_dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+	perror(in_dir);
+	return 0;
+    }
+
+    signal(SIGCHLD, child_exited);
+
+    printf("Spooling %s into %s, %d at a time\n", in_dir, out_dir, max_jobs);
+    fflush(stdout);
+
+    queue_unconverted(in_dir, out_dir);
+
+    while (1) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	pid_t pid;
+	int status;
+	int i;
+
+	for (i = 0; i < n_jobs && n_running < max_jobs; i++) {
+	    if (jobs[i].pid != 0 || is_running(jobs[i].name)) continue;
+	    start_job(&jobs[i], in_dir, out_dir, parse);
+	    if (jobs[i].pid < 0) remove_job(i--);
+	}
+	write_status(out_dir);
+
+	if (poll(&pfd, 1, 1000) > 0) read_events(fd);
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	    for (i = 0; i < n_jobs && jobs[i].pid != pid; i++) {}
+	    if (i < n_jobs) finish_job(i, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+    }
+}
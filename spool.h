@@ -0,0 +1,15 @@
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include "convert.h"
+
+/* Turns the arguments of a job into a conversion, NULL if invalid */
+typedef convert_t *(*spool_parse_t)(char *args);
+
+/* Convert the gcode dropped into in_dir into out_dir, running up to
+ * max_jobs conversions at once (0 for one per core).  Returns only if
+ * the directories can't be watched.
+ */
+int spool_run(const char *in_dir, const char *out_dir, int max_jobs, spool_parse_t parse);
+
+#endif
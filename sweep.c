@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "gcode.h"
+#include "printer.h"
+#include "print-time.h"
+#include "sweep.h"
+#include "transition-block.h"
+
+/* What-if runs over a grid of settings.
+ *
+ * The first pass over the gcode doesn't depend on how the transitions are
+ * planned so it is made once.  Each combination of settings is then run
+ * in its own forked process, which gets a copy of the runs, the bed usage
+ * and the printer to change as it likes.  The gcode is produced into
+ * /dev/null to get the splices, pings and print time, and the results
+ * come back through shared memory.
+ */
+
+typedef struct {
+    char *key;
+    char *values[MAX_SWEEP_VALUES];
+    int n_values;
+} axis_t;
+
+typedef enum { NOT_RUN = 0, SUCCEEDED, FAILED } result_status_t;
+
+typedef struct {
+    result_status_t status;
+    int n_splices, n_pings;
+    double filament_mm, waste_mm;
+    double tower_mm2;
+    double seconds;
+} result_t;
+
+static struct {
+    const char *name;
+    int *value;
+    int min, max;
+} options[] = {
+    { "reduce-pings", &reduce_pings, 0, 1 },
+    { "sparse-tower", &sparse_tower, 0, 1 },
+    { "global-purge", &global_purge, 0, 1 },
+    { "ping-in-object", &ping_in_object, 0, 1 },
+    { "towers", &n_towers, 1, MAX_TOWERS },
+};
+
+#define N_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+/* The printer keys the first pass depends on, as in runs_cache_key(),
+ * can't be swept.  The infill and support ones only matter to it with
+ * --purge-any-infill.
+ */
+
+static const char *first_pass_keys[] = { "max_layer_height", "prime_mm", "circular", "diameter", "x", "y" };
+static const char *purge_any_infill_keys[] = { "transitionInInfill", "transitionInSupport" };
+
+#define N_FIRST_PASS_KEYS (sizeof(first_pass_keys) / sizeof(first_pass_keys[0]))
+#define N_PURGE_ANY_INFILL_KEYS (sizeof(purge_any_infill_keys) / sizeof(purge_any_infill_keys[0]))
+
+static axis_t axes[MAX_SWEEP_AXES];
+static int n_axes;
+
+int
+sweep_add_axis(const char *spec)
+{
+    axis_t *a;
+    char *values, *v;
+
+    if (n_axes >= MAX_SWEEP_AXES || (values = strchr(spec, '=')) == NULL || values == spec) return 0;
+
+    a = &axes[n_axes];
+    a->key = strndup(spec, values - spec);
+    a->n_values = 0;
+    values = strdup(values + 1);
+    for (v = strtok(values, ","); v; v = strtok(NULL, ",")) {
+	if (a->n_values >= MAX_SWEEP_VALUES) return 0;
+	a->values[a->n_values++] = v;
+    }
+    if (a->n_values == 0) return 0;
+
+    n_axes++;
+    return 1;
+}
+
+static int
+find_option(const char *name)
+{
+    int i;
+
+    for (i = 0; i < N_OPTIONS; i++) {
+	if (strcmp(options[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int
+is_first_pass_key(const char *key)
+{
+    int i;
+
+    for (i = 0; i < N_FIRST_PASS_KEYS; i++) {
+	if (strcmp(first_pass_keys[i], key) == 0) return 1;
+    }
+    for (i = 0; purge_any_infill && i < N_PURGE_ANY_INFILL_KEYS; i++) {
+	if (strcmp(purge_any_infill_keys[i], key) == 0) return 1;
+    }
+    return 0;
+}
+
+static int
+is_valid_axis(axis_t *a)
+{
+    int o = find_option(a->key);
+    printer_t p = *printer;
+    int i;
+
+    if (is_first_pass_key(a->key)) {
+	fprintf(stderr, "Can't sweep %s, the gcode is only parsed once\n", a->key);
+	return 0;
+    }
+
+    for (i = 0; i < a->n_values; i++) {
+	int v = atoi(a->values[i]);
+
+	if (o >= 0 && (v < options[o].min || v > options[o].max)) {
+	    fprintf(stderr, "Invalid value to sweep for %s: %s, must be between %d and %d\n", a->key, a->values[i], options[o].min, options[o].max);
+	    return 0;
+	}
+	if (o < 0 && ! printer_set(&p, a->key, a->values[i])) {
+	    fprintf(stderr, "Unknown setting to sweep: %s\n", a->key);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* The first axis changes the slowest, like nested loops */
+
+static int
+apply_config(int config)
+{
+    int k;
+
+    for (k = n_axes-1; k >= 0; k--) {
+	axis_t *a = &axes[k];
+	const char *v = a->values[config % a->n_values];
+	int o = find_option(a->key);
+
+	config /= a->n_values;
+	if (o >= 0) *options[o].value = atoi(v);
+	else if (! printer_set(printer, a->key, v)) return 0;
+    }
+    return 1;
+}
+
+static void
+run_config(int config, result_t *r)
+{
+    printer_t *p = malloc(sizeof(*p));
+    FILE *o;
+    int fd, i;
+
+    *p = *printer;
+    printer = p;
+
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+    }
+    if (! apply_config(config) || ! transition_block_create_from_runs() || (o = fopen("/dev/null", "w")) == NULL) exit(1);
+
+    gcode_to_msf_gcode(o);
+
+    r->n_splices = n_splices;
+    r->n_pings = n_pings;
+    r->filament_mm = n_splices > 0 ? splices[n_splices-1].mm : 0;
+    for (i = 0; i < n_splices; i++) r->waste_mm += splices[i].waste;
+    for (i = 0; i < n_towers && ! printer->side_transitions && n_transitions > 0; i++) {
+	if (transition_blocks[i].top_z >= 0) r->tower_mm2 += transition_blocks[i].area;
+    }
+    r->seconds = print_time_elapsed(print_time);
+    r->status = SUCCEEDED;
+    exit(0);
+}
+
+static void
+print_table(result_t *results, int n_configs)
+{
+    int best = -1;
+    int i, k;
+
+    for (i = 0; i < n_configs; i++) {
+	if (results[i].status == SUCCEEDED && (best < 0 || results[i].filament_mm < results[best].filament_mm)) best = i;
+    }
+
+    printf("  ");
+    for (k = 0; k < n_axes; k++) printf("%*s ", (int) fmax(strlen(axes[k].key), 8), axes[k].key);
+    printf("%8s %6s %11s %11s %10s %9s\n", "splices", "pings", "filament_mm", "waste_mm", "tower_mm2", "time");
+
+    for (i = 0; i < n_configs; i++) {
+	result_t *r = &results[i];
+	int config = i, divisor = n_configs;
+
+	printf("%c ", i == best ? '*' : ' ');
+	for (k = 0; k < n_axes; k++) {
+	    divisor /= axes[k].n_values;
+	    printf("%*s ", (int) fmax(strlen(axes[k].key), 8), axes[k].values[config / divisor % axes[k].n_values]);
+	}
+	if (r->status != SUCCEEDED) {
+	    printf("%8s\n", "FAILED");
+	    continue;
+	}
+	printf("%8d %6d %11.2f %11.2f %10.0f %3d:%02d:%02d\n", r->n_splices, r->n_pings, r->filament_mm, r->waste_mm, r->tower_mm2,
+	    (int) (r->seconds / 3600), (int) fmod(r->seconds / 60, 60), (int) fmod(r->seconds, 60));
+    }
+}
+
+int
+sweep_run(convert_t *c, int n_workers)
+{
+    result_t *results;
+    int n_configs = 1;
+    int next = 0, n_running = 0;
+    int i, k;
+
+    if (n_workers <= 0) n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (k = 0; k < n_axes; k++) n_configs *= axes[k].n_values;
+
+    if (! convert_first_pass(c)) return 0;
+
+    for (k = 0; k < n_axes; k++) {
+	if (! is_valid_axis(&axes[k])) return 0;
+    }
+
+    results = mmap(NULL, sizeof(*results) * n_configs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+	perror("mmap");
+	return 0;
+    }
+
+    printf("Sweeping %d configurations on %d workers\n", n_configs, n_workers);
+    fflush(stdout);
+    fflush(stderr);
+
+    while (next < n_configs || n_running > 0) {
+	int status;
+	pid_t pid;
+
+	if (next < n_configs && n_running < n_workers) {
+	    if ((pid = fork()) < 0) {
+		perror("fork");
+		next = n_configs;
+		continue;
+	    }
+	    if (pid == 0) run_config(next, &results[next]);
+	    next++;
+	    n_running++;
+	    continue;
+	}
+	if (wait(&status) < 0) break;
+	n_running--;
+    }
+
+    for (i = 0; i < n_configs; i++) {
+	if (results[i].status == NOT_RUN) results[i].status = FAILED;
+    }
+    print_table(results, n_configs);
+    munmap(results, sizeof(*results) * n_configs);
+
+    return 1;
+}
@@ -0,0 +1,22 @@
+#ifndef __SWEEP_H__
+#define __SWEEP_H__
+
+#include "convert.h"
+
+#define MAX_SWEEP_AXES		8
+#define MAX_SWEEP_VALUES	32
+
+/* Add the values "key=v1,v2,..." to try for a key of the printer's yaml
+ * or for one of reduce-pings, sparse-tower, global-purge, ping-in-object
+ * or towers.  Returns 0 if the spec isn't valid or there are too many.
+ */
+int sweep_add_axis(const char *spec);
+
+/* Make the first pass over c's input once and then convert it with every
+ * combination of the values on n_workers workers (0 for one per core),
+ * printing a table of the results.  Nothing is written.  Returns 0 if the
+ * input can't be read or a key is unknown.
+ */
+int sweep_run(convert_t *c, int n_workers);
+
+#endif
@@ -16,32 +16,45 @@ int n_layers;
 double layer_mm[MAX_RUNS];
 transition_t transitions[MAX_RUNS];
 int n_transitions = 0;
-transition_block_t transition_block;
+transition_block_t transition_blocks[MAX_TOWERS];
+int n_towers = 1;
+static tower_layer_t *tower_layers;	/* what the layers point to */
 int reduce_pings = 0;
+int sparse_tower = 0;
+
+static int tower_per_object = 0;
+int ping_in_object = 0;
+int global_purge = 0;
+double planned_pings[MAX_RUNS];
+int n_planned_pings = 0;
 double transition_final_mm;
 double transition_final_waste;
+int transition_final_drive;
+alias_splice_t alias_splices[MAX_RUNS];
+int n_alias_splices = 0;
 prime_info_t prime_info;
 
 #define MIN_FIRST_SPLICE_LEN	141	/* There appears to be some epsilon error with 140 causing it to error */
 #define MIN_SPLICE_LEN		 80
 #define MIN_PING_LEN		 22	/* Really 20, but give a little slack for pinging off tower */
 #define DENSITY_FOR_PERIMETER	0.2
+#define EPSILON			0.0000001
 
 static double
-layer_transition_mm(layer_t *l)
+layer_transition_mm(layer_t *l, int tower)
 {
     transition_t *t;
     double mm = 0;
     int i;
 
     for (t = &transitions[l->transition0], i = 0; i < l->n_transitions; t++, i++) {
-	mm += t->pre_mm + t->post_mm;
+	if (t->tower == tower) mm += t->pre_mm + t->post_mm;
     }
     return mm;
 }
 
 static double
-transition_block_layer_area(int layer)
+transition_block_layer_area(int layer, int tower)
 {
     layer_t *l = &layers[layer];
     int i;
@@ -49,29 +62,29 @@ transition_block_layer_area(int layer)
     double mm = 0;
 
     for (t = &transitions[l->transition0], i = 0; i < l->n_transitions; i++, t++) {
-	mm += t->pre_mm + t->post_mm;
+	if (t->tower == tower) mm += t->pre_mm + t->post_mm;
     }
 
     return filament_length_to_mm3(mm) / l->h;
 }
 
 static double
-transition_block_area()
+transition_block_area(int tower)
 {
     int i;
     double area = 0;
 
     for (i = 0; i < n_layers; i++) {
-	double la = transition_block_layer_area(i);
+	double la = transition_block_layer_area(i, tower);
 	if (la > area) area = la;
     }
     return area;
 }
 
 int
-transition_block_size(double xy[2], int strategy)
+transition_block_size(int tower, double xy[2], int strategy)
 {
-    double area = transition_block_area();
+    double area = transition_block_area(tower);
     double sqrt_area = sqrt(area);
 
     switch (strategy) {
@@ -122,6 +135,8 @@ transition_length(int from, int to, double total_mm)
 
     if (total_mm < printer->ping_stabilize_mm) return printer->early_transition_len;
 
+    if (get_purge_length(from, to) >= 0) return get_purge_length(from, to);
+
     if (in->strength == STRONG) {
 	if (out->strength == STRONG) factor = 0.5;
 	else if (out->strength == WEAK) factor = 0;
@@ -159,14 +174,26 @@ add_extra_block_purge(transition_t *t, double extra_mm)
     }
 }
 
+static int
+layer_tower_n_transitions(layer_t *l, int tower)
+{
+    int i, n = 0;
+
+    for (i = l->transition0; i < l->transition0 + l->n_transitions; i++) {
+	if (transitions[i].tower == tower) n++;
+    }
+    return n;
+}
+
 static void
-layer_add_extra_block_purge(layer_t *l, double extra_mm)
+layer_add_extra_block_purge(layer_t *l, int tower, double extra_mm)
 {
     int i;
+    int n = layer_tower_n_transitions(l, tower);
     transition_t *t;
 
     for (t = &transitions[l->transition0], i = 0; i < l->n_transitions; t++, i++) {
-	add_extra_block_purge(t, extra_mm / l->n_transitions);
+	if (t->tower == tower) add_extra_block_purge(t, extra_mm / n);
     }
 }
 
@@ -175,40 +202,193 @@ layer_add_extra_block_purge(layer_t *l, double extra_mm)
  * Give it 5M to get started, 5M to stabilize and then start reducing
  * the number of pings.
  * After long enough, really reduce them to speed up large prints.
+ *
+ * The spacings are the minimum distance between pings and are configured
+ * in the pings section of the printer.  Pings should never be further
+ * apart than twice the spacing.
  */
 
-#define EARLY_PING_MM		2000
-#define EARLY_PING_THRESHOLD	350
-#define PING_THRESHOLD		425
-#define PING_SECOND_THRESHOLD	(PING_THRESHOLD*2)
-#define PING_SECOND_E		10000
-#define PING_THIRD_THRESHOLD	(PING_SECOND_THRESHOLD*4)
-#define PING_THIRD_E		50000
-
 static double
 get_ping_threshold(double total_mm)
 {
-    if (total_mm < EARLY_PING_MM) return EARLY_PING_THRESHOLD;
+    if (total_mm < printer->early_ping_mm) return printer->early_ping_spacing;
 
     if (reduce_pings) {
-	if (total_mm >= PING_THIRD_E) return PING_THIRD_THRESHOLD;
-	if (total_mm >= PING_SECOND_E) return PING_SECOND_THRESHOLD;
+	if (total_mm >= printer->minimal_ping_mm) return printer->minimal_ping_spacing;
+	if (total_mm >= printer->reduced_ping_mm) return printer->reduced_ping_spacing;
     }
-    return PING_THRESHOLD;
+    return printer->ping_spacing;
+}
+
+/* Pings are scheduled by choosing, from every place a ping could happen,
+ * the set with the lowest total cost (pause time plus the time to print
+ * any purge the ping forces) such that every gap between pings is
+ * between one and two times the ping threshold.  Stretching a gap past
+ * the threshold is charged so that pings only drift later when that
+ * avoids a more expensive ping.  The filler transitions after the last
+ * tool change are pruned from the tower, so they can't ping.
+ */
+
+#define PING_CANDIDATE_MM	5
+#define PING_PENALTY		1e9
+
+typedef struct {
+    double mm;
+    double cost;
+    double extra_mm;
+    int    transition;	/* -1 for a ping in the object */
+} ping_candidate_t;
+
+static ping_candidate_t *ping_candidates;
+static int n_ping_candidates, a_ping_candidates;
+double ping_extra_purge_mm;
+
+static void
+add_ping_candidate(double mm, double cost, double extra_mm, int transition)
+{
+    if (n_ping_candidates >= a_ping_candidates) {
+	a_ping_candidates = a_ping_candidates ? a_ping_candidates * 2 : 1024;
+	ping_candidates = realloc(ping_candidates, sizeof(*ping_candidates) * a_ping_candidates);
+    }
+    ping_candidates[n_ping_candidates].mm = mm;
+    ping_candidates[n_ping_candidates].cost = cost;
+    ping_candidates[n_ping_candidates].extra_mm = extra_mm;
+    ping_candidates[n_ping_candidates].transition = transition;
+    n_ping_candidates++;
+}
+
+static double
+tower_filament_mm_per_sec(layer_t *l)
+{
+    double mm_per_min = printer->print_speed_mm_per_min > 0 ? printer->print_speed_mm_per_min : 30*60;
+
+    return filament_mm3_to_length(speed_to_flow_rate(mm_per_min, l->h));
 }
 
 static void
-add_transition(int from, int to, double z, run_t *run, run_t *pre_run, double *mm_from_runs, double *total_mm, double *filament_mm)
+add_transition_ping_candidate(transition_t *t, layer_t *l)
+{
+    double len = t->pre_mm + t->post_mm;
+    double extra_mm = ping_in_object || len >= MIN_PING_LEN ? 0 : MIN_PING_LEN - len;
+
+    add_ping_candidate(t->total_mm, printer->ping_seconds + extra_mm / tower_filament_mm_per_sec(l), extra_mm, t->num);
+}
+
+static void
+add_object_ping_candidates(double start_mm, double mm)
+{
+    double at;
+
+    if (! ping_in_object) return;
+
+    for (at = ceil(start_mm / PING_CANDIDATE_MM) * PING_CANDIDATE_MM; at < start_mm + mm; at += PING_CANDIDATE_MM) {
+	add_ping_candidate(at, printer->ping_seconds, 0, -1);
+    }
+}
+
+static void
+schedule_pings(double end_mm)
+{
+    double *best = malloc(sizeof(*best) * (n_ping_candidates + 1));
+    int *prev = malloc(sizeof(*prev) * (n_ping_candidates + 1));
+    int i, j, last = -1;
+    int last_change = -1;
+
+    for (i = 0; i < n_transitions; i++) {
+	if (transitions[i].from != transitions[i].to) last_change = i;
+    }
+
+    for (j = 0; j < n_ping_candidates; j++) {
+	ping_candidate_t *c = &ping_candidates[j];
+
+	if (c->transition > last_change) {
+	    best[j] = INFINITY;
+	    prev[j] = -1;
+	    continue;
+	}
+
+	best[j] = c->mm >= get_ping_threshold(0) && c->mm <= 2*get_ping_threshold(0) ? c->cost : INFINITY;
+	prev[j] = -1;
+
+	for (i = j-1; i >= 0; i--) {
+	    double gap = c->mm - ping_candidates[i].mm;
+	    double threshold = get_ping_threshold(ping_candidates[i].mm);
+	    double cost;
+
+	    if (gap < threshold) continue;
+	    if (gap > 2*threshold) break;
+	    cost = best[i] + c->cost + 2 * printer->ping_seconds * (gap - threshold) / threshold;
+
+	    if (cost < best[j]) {
+		best[j] = cost;
+		prev[j] = i;
+	    }
+	}
+
+	if (! isfinite(best[j])) {
+	    /* Nothing is close enough, take the nearest so the gap is as small as possible */
+	    for (i = j-1; i >= 0 && c->mm - ping_candidates[i].mm < get_ping_threshold(ping_candidates[i].mm); i--) {}
+	    if (i < 0 && c->mm < get_ping_threshold(0)) {
+		best[j] = INFINITY;
+		continue;
+	    }
+	    best[j] = (i >= 0 ? best[i] : 0) + c->cost + PING_PENALTY;
+	    prev[j] = i;
+	}
+    }
+
+    if (end_mm > get_ping_threshold(0)) {
+	for (j = 0; j < n_ping_candidates; j++) {
+	    if (isfinite(best[j]) && end_mm - ping_candidates[j].mm <= 2*get_ping_threshold(ping_candidates[j].mm) && (last < 0 || best[j] < best[last])) last = j;
+	}
+	for (j = n_ping_candidates-1; last < 0 && j >= 0; j--) {
+	    if (isfinite(best[j])) last = j;
+	}
+	/* Too short for any candidate to be past the threshold, ping as late as possible */
+	for (j = n_ping_candidates-1; last < 0 && j >= 0; j--) {
+	    if (ping_candidates[j].transition <= last_change) {
+		last = j;
+		prev[j] = -1;
+	    }
+	}
+    }
+
+    n_planned_pings = 0;
+    ping_extra_purge_mm = 0;
+    for (j = last; j >= 0; j = prev[j]) {
+	ping_candidate_t *c = &ping_candidates[j];
+
+	if (c->transition >= 0 && ! ping_in_object) transitions[c->transition].ping = 1;
+	else planned_pings[n_planned_pings++] = c->mm;
+	ping_extra_purge_mm += c->extra_mm;
+    }
+
+    for (i = 0, j = n_planned_pings-1; i < j; i++, j--) {
+	double tmp = planned_pings[i];
+	planned_pings[i] = planned_pings[j];
+	planned_pings[j] = tmp;
+    }
+
+    free(best);
+    free(prev);
+    n_ping_candidates = 0;
+}
+
+static void
+add_transition(int from, int to, double z, int tower, run_t *run, run_t *pre_run, double *mm_from_runs, double *total_mm, double *filament_mm)
 {
     transition_t *t;
     layer_t *layer;
     double mm;
 
-    if (n_layers == 0 || z > layers[n_layers-1].z) {
+    if (n_layers == 0 || z > layers[n_layers-1].z || pre_run->object != layers[n_layers-1].object) {
+	int same_object = n_layers > 0 && layers[n_layers-1].object == pre_run->object;
+
 	layer = &layers[n_layers];
 	layer->num = n_layers;
+	layer->object = pre_run->object;
 	layer->z = z;
-	layer->h = z - (n_layers ? layers[n_layers-1].z : 0);
+	layer->h = z - (same_object ? layers[n_layers-1].z : 0);
 	layer->transition0 = n_transitions;
 	layer->n_transitions = 1;
 	n_layers++;
@@ -225,11 +405,16 @@ add_transition(int from, int to, double z, run_t *run, run_t *pre_run, double *m
     t->from = from;
     t->to = to;
     t->ping = 0;
+    t->speed_multiplier = 1;
+    t->total_mm = *total_mm;
     t->mm_from_runs = *mm_from_runs;
     t->mm_pre_transition = *filament_mm;
     t->offset = pre_run->offset;
     t->next_move_no_extrusion = pre_run->next_move_no_extrusion;
     t->needs_retraction = ! pre_run->ends_with_retraction;
+    t->tower = tower;
+    t->x = pre_run->x;
+    t->y = pre_run->y;
 
     if (printer->transition_in_infill && pre_run->trailing_infill_mm > 0) {
 	if (0 && get_active_material(from)->strength == WEAK && get_active_material(to)->strength == STRONG) {
@@ -247,10 +432,12 @@ add_transition(int from, int to, double z, run_t *run, run_t *pre_run, double *m
     t->post_mm = mm - t->pre_mm;
     t->infill_mm = t->support_mm = 0;
 
-    move_purge(&t->pre_mm, &t->infill_mm, &t->avail_infill);
-    move_purge(&t->post_mm, &t->support_mm, &t->avail_support);
-    move_purge(&t->post_mm, &t->infill_mm, &t->avail_infill);
-    move_purge(&t->pre_mm, &t->support_mm, &t->avail_support);
+    if (! global_purge) {
+	move_purge(&t->pre_mm, &t->infill_mm, &t->avail_infill);
+	move_purge(&t->post_mm, &t->support_mm, &t->avail_support);
+	move_purge(&t->post_mm, &t->infill_mm, &t->avail_infill);
+	move_purge(&t->pre_mm, &t->support_mm, &t->avail_support);
+    }
 
     if (from != to) {
 	(*mm_from_runs) = 0;
@@ -262,164 +449,783 @@ add_transition(int from, int to, double z, run_t *run, run_t *pre_run, double *m
     (*total_mm) += t->pre_mm + t->post_mm;
 }
 
+/* A sparse tower only prints a layer without a tool change when skipping
+ * it would make the next tower layer taller than the nozzle can print.
+ * Side transitions have no tower so they never need one.
+ */
+
+static int
+can_skip_filler_layer(run_t *next)
+{
+    double last_z = n_layers > 0 && layers[n_layers-1].object == next->object ? layers[n_layers-1].z : 0;
+
+    if (printer->side_transitions) return 1;
+    return sparse_tower && next->z - last_z <= printer->max_layer_height + EPSILON;
+}
+
+/* The tower needs a layer at the height of a run if the next run is on
+ * a new layer of the same object and the tower has nothing there yet.  A
+ * sequential print's towers stop at the last tool change of their object.
+ */
+
+static int
+needs_filler_layer(run_t *run, run_t *next)
+{
+    layer_t *last = n_layers > 0 ? &layers[n_layers-1] : NULL;
+
+    if (run->z == next->z || run->object != next->object) return 0;
+    if (last && last->z == run->z && last->object == run->object) return 0;
+    if (tower_per_object && run->z > transition_blocks[run->object].top_z + EPSILON) return 0;
+    return ! can_skip_filler_layer(next);
+}
+
+/* With more than one tower, each transition goes to the nearest tower
+ * that is still being printed at its height.
+ */
+
+static int
+nearest_tower(run_t *run, double z)
+{
+    double best_d = INFINITY;
+    int k, best = 0;
+
+    if (tower_per_object) return run->object;
+
+    for (k = 0; k < n_towers && n_towers > 1; k++) {
+	transition_block_t *b = &transition_blocks[k];
+	double d = hypot(run->x - b->cx, run->y - b->cy);
+
+	if (z <= b->top_z + EPSILON && d < best_d) {
+	    best_d = d;
+	    best = k;
+	}
+    }
+    return best;
+}
+
+/* Every tower is printed on every tower layer up to its top so give the
+ * towers that the layer didn't use a transition without a tool change.
+ */
+
+static void
+fill_towers(run_t *run, double next_z, double *mm_from_runs, double *total_mm, double *filament_mm)
+{
+    int k;
+
+    if (n_towers == 1 || tower_per_object || run->z == next_z || n_layers == 0 || layers[n_layers-1].z != run->z) return;
+
+    for (k = 0; k < n_towers; k++) {
+	if (run->z <= transition_blocks[k].top_z + EPSILON && layer_tower_n_transitions(&layers[n_layers-1], k) == 0) {
+	    add_transition(run->t, run->t, run->z, k, run, run, mm_from_runs, total_mm, filament_mm);
+	}
+    }
+}
+
+/* A tool change between drives with the same filament doesn't need a
+ * transition, just a splice where the tool change is.  The switch only
+ * happens if the splices on both sides of it are long enough, otherwise
+ * the drive that is already loaded carries on printing.
+ */
+
+static void
+alias_drives()
+{
+    int drive = runs[0].t, first = 1;
+    double splice_mm = 0;
+    int i, j;
+
+    for (i = 0; i < n_runs; i++) {
+	if (runs[i].t != drive && drives_are_aliased(drive, runs[i].t)) {
+	    double ahead = 0;
+
+	    for (j = i; j < n_runs && drives_are_aliased(runs[j].t, runs[i].t) && ahead < MIN_SPLICE_LEN; j++) ahead += runs[j].e;
+	    if (splice_mm < (first ? MIN_FIRST_SPLICE_LEN : MIN_SPLICE_LEN) || ahead < MIN_SPLICE_LEN) {
+		runs[i].t = drive;
+	    } else {
+		drive = runs[i].t;
+		splice_mm = 0;
+		first = 0;
+	    }
+	} else if (runs[i].t != drive) {
+	    drive = runs[i].t;
+	    splice_mm = 0;
+	    first = 0;
+	}
+	splice_mm += runs[i].e;
+    }
+}
+
+static void
+add_alias_splice(run_t *pre_run, double *mm_from_runs, double *filament_mm)
+{
+    alias_splice_t *a = &alias_splices[n_alias_splices++];
+
+    a->transition = n_transitions;
+    a->drive = pre_run->t;
+    a->offset = pre_run->offset;
+    a->mm = *mm_from_runs;
+    *mm_from_runs = *filament_mm = 0;
+}
+
 static void
 compute_transition_tower()
 {
     int i;
     double mm_from_runs, total_mm, filament_mm;
-    double last_ping_at = 0;
-    double ping_threshold;
 
     mm_from_runs = total_mm = filament_mm = runs[0].e;
-    ping_threshold = get_ping_threshold(total_mm);
+    n_alias_splices = 0;
+    add_object_ping_candidates(0, runs[0].e);
 
     for (i = 1; i < n_runs; i++) {
-	double ping_delta;
+	int first_new = n_transitions;
 
-	if (runs[i-1].t != runs[i].t) {
-	    add_transition(runs[i-1].t, runs[i].t, runs[i].z, &runs[i], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
-	} else if (runs[i-1].z != runs[i].z && (n_layers == 0 || layers[n_layers-1].z != runs[i-1].z)) {
-	    add_transition(runs[i-1].t, runs[i-1].t, runs[i-1].z, &runs[i-1], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	if (runs[i-1].t != runs[i].t && drives_are_aliased(runs[i-1].t, runs[i].t)) {
+	    add_alias_splice(&runs[i-1], &mm_from_runs, &filament_mm);
+	    if (needs_filler_layer(&runs[i-1], &runs[i])) {
+		add_transition(runs[i-1].t, runs[i-1].t, runs[i-1].z, nearest_tower(&runs[i-1], runs[i-1].z), &runs[i-1], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	    }
+	    fill_towers(&runs[i-1], runs[i].z, &mm_from_runs, &total_mm, &filament_mm);
+	} else if (runs[i-1].t != runs[i].t && runs[i-1].object != runs[i].object) {
+	    /* Change tools on the finished object's tower before moving on */
+	    add_transition(runs[i-1].t, runs[i].t, runs[i-1].z, nearest_tower(&runs[i-1], runs[i-1].z), &runs[i], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	} else if (runs[i-1].t != runs[i].t) {
+	    if (sparse_tower && needs_filler_layer(&runs[i-1], &runs[i])) {
+		add_transition(runs[i-1].t, runs[i-1].t, runs[i-1].z, nearest_tower(&runs[i-1], runs[i-1].z), &runs[i-1], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	    }
+	    fill_towers(&runs[i-1], runs[i].z, &mm_from_runs, &total_mm, &filament_mm);
+	    add_transition(runs[i-1].t, runs[i].t, runs[i].z, nearest_tower(&runs[i-1], runs[i].z), &runs[i], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	} else {
+	    if (needs_filler_layer(&runs[i-1], &runs[i])) {
+		add_transition(runs[i-1].t, runs[i-1].t, runs[i-1].z, nearest_tower(&runs[i-1], runs[i-1].z), &runs[i-1], &runs[i-1], &mm_from_runs, &total_mm, &filament_mm);
+	    }
+	    fill_towers(&runs[i-1], runs[i].z, &mm_from_runs, &total_mm, &filament_mm);
 	}
 
-	ping_delta = total_mm - last_ping_at;
-        if (ping_delta > ping_threshold || (total_mm > ping_threshold && i+1 < n_runs && ping_delta+runs[i+1].e > ping_threshold*2)) {
-	    last_ping_at = total_mm;
-	    transitions[n_transitions-1].ping = 1;
-	    ping_threshold = get_ping_threshold(total_mm);
+	for (; first_new < n_transitions; first_new++) {
+	    add_transition_ping_candidate(&transitions[first_new], &layers[n_layers-1]);
 	}
+	add_object_ping_candidates(total_mm, runs[i].e);
+
 	total_mm += runs[i].e;
 	filament_mm += runs[i].e;
 	mm_from_runs += runs[i].e;
     }
+    schedule_pings(total_mm);
     transition_final_mm = mm_from_runs;
+    transition_final_drive = runs[n_runs-1].t;
     transition_final_waste = (printer->bowden_len > 0 ? printer->bowden_len : 0) + EXTRA_FILAMENT;
     transition_final_waste += 0.01 * transition_final_mm;
 }
 
+/* Split the transitions between the towers by clustering where they
+ * happen, weighted by how much they purge, and then redo the transitions
+ * so each is assigned to its nearest tower.  Each tower only needs to be
+ * as tall as the highest transition it serves.
+ */
+
+#define TOWER_CLUSTER_ITERATIONS	20
+
+static double
+transition_weight(transition_t *t)
+{
+    return 1 + t->pre_mm + t->post_mm;
+}
+
+static int
+nearest_centre(transition_t *t, int n)
+{
+    double best_d = INFINITY;
+    int k, best = 0;
+
+    for (k = 0; k < n; k++) {
+	double d = hypot(t->x - transition_blocks[k].cx, t->y - transition_blocks[k].cy);
+	if (d < best_d) {
+	    best_d = d;
+	    best = k;
+	}
+    }
+    return best;
+}
+
+static double
+distance_to_centres(transition_t *t, int n)
+{
+    transition_block_t *b = &transition_blocks[nearest_centre(t, n)];
+
+    return hypot(t->x - b->cx, t->y - b->cy);
+}
+
+static void
+cluster_transitions(int n)
+{
+    double sum_x[MAX_TOWERS], sum_y[MAX_TOWERS], sum_w[MAX_TOWERS];
+    int i, j, k, iteration;
+
+    /* Start from the transition furthest from the middle of all of them and
+     * then repeatedly from the one furthest from the centres so far.
+     */
+    transition_blocks[0].cx = transition_blocks[0].cy = sum_w[0] = 0;
+    for (i = 0; i < n_transitions; i++) {
+	transition_blocks[0].cx += transitions[i].x * transition_weight(&transitions[i]);
+	transition_blocks[0].cy += transitions[i].y * transition_weight(&transitions[i]);
+	sum_w[0] += transition_weight(&transitions[i]);
+    }
+    transition_blocks[0].cx /= sum_w[0];
+    transition_blocks[0].cy /= sum_w[0];
+
+    for (k = 0; k < n; k++) {
+	double best_d = -1;
+	int best = 0;
+
+	for (i = 0; i < n_transitions; i++) {
+	    double d = distance_to_centres(&transitions[i], k > 0 ? k : 1);
+	    if (d > best_d) {
+		best_d = d;
+		best = i;
+	    }
+	}
+	if (k > 0 && best_d <= EPSILON) break;
+	transition_blocks[k].cx = transitions[best].x;
+	transition_blocks[k].cy = transitions[best].y;
+    }
+    n = k;
+
+    for (iteration = 0; iteration < TOWER_CLUSTER_ITERATIONS; iteration++) {
+	for (k = 0; k < n; k++) sum_x[k] = sum_y[k] = sum_w[k] = 0;
+	for (i = 0; i < n_transitions; i++) {
+	    transition_t *t = &transitions[i];
+	    double w = transition_weight(t);
+
+	    k = nearest_centre(t, n);
+	    sum_x[k] += t->x * w;
+	    sum_y[k] += t->y * w;
+	    sum_w[k] += w;
+	}
+	for (k = 0; k < n; k++) {
+	    if (sum_w[k] > 0) {
+		transition_blocks[k].cx = sum_x[k] / sum_w[k];
+		transition_blocks[k].cy = sum_y[k] / sum_w[k];
+	    }
+	}
+    }
+
+    for (k = 0; k < n; k++) transition_blocks[k].top_z = -1;
+    for (i = 0; i < n_layers; i++) {
+	for (j = layers[i].transition0; j < layers[i].transition0 + layers[i].n_transitions; j++) {
+	    transition_block_t *b = &transition_blocks[nearest_centre(&transitions[j], n)];
+	    if (layers[i].z > b->top_z) b->top_z = layers[i].z;
+	}
+    }
+
+    for (i = k = 0; k < n; k++) {
+	if (transition_blocks[k].top_z >= 0) transition_blocks[i++] = transition_blocks[k];
+    }
+    n_towers = i > 0 ? i : 1;
+}
+
+static void
+distribute_transitions(int n)
+{
+    int i;
+
+    cluster_transitions(n);
+    if (n_towers == 1) return;
+
+    n_layers = n_transitions = 0;
+    for (i = 0; i < n_runs; i++) runs[i].pre_transition = runs[i].post_transition = 0;
+    compute_transition_tower();
+}
+
+/* A sequential print has a tower beside each object, printed along with
+ * it and only as tall as the object's last tool change.  A tool change
+ * between two objects is done on the finished object's tower.
+ */
+
+static void
+setup_object_towers()
+{
+    int i, k;
+
+    n_towers = n_objects;
+    for (k = 0; k < n_towers; k++) transition_blocks[k].top_z = -1;
+
+    for (i = 1; i < n_runs; i++) {
+	transition_block_t *b = &transition_blocks[runs[i-1].object];
+	double z = runs[i-1].object == runs[i].object ? runs[i].z : runs[i-1].z;
+
+	if (! drives_are_aliased(runs[i-1].t, runs[i].t) && z > b->top_z) b->top_z = z;
+    }
+}
+
+static void
+centre_object_towers()
+{
+    double sum_w[MAX_TOWERS] = { 0, };
+    int i, k;
+
+    for (k = 0; k < n_towers; k++) transition_blocks[k].cx = transition_blocks[k].cy = 0;
+    for (i = 0; i < n_transitions; i++) {
+	transition_t *t = &transitions[i];
+	double w = transition_weight(t);
+
+	transition_blocks[t->tower].cx += t->x * w;
+	transition_blocks[t->tower].cy += t->y * w;
+	sum_w[t->tower] += w;
+    }
+    for (k = 0; k < n_towers; k++) {
+	if (sum_w[k] > 0) {
+	    transition_blocks[k].cx /= sum_w[k];
+	    transition_blocks[k].cy /= sum_w[k];
+	}
+    }
+}
+
+/* The gantry clears a finished object only up to the extruder clearance
+ * height so every tower but the last object's has to stay under it.
+ */
+
+static void
+check_object_towers_clear_gantry()
+{
+    int k;
+
+    for (k = 0; k < n_towers - 1; k++) {
+	if (transition_blocks[k].top_z > printer->clearance_height + EPSILON) {
+	    fprintf(stderr, "WARNING: the tower for object %d goes up to z=%.2f, above the extruder clearance height of %.2f\n", k+1, transition_blocks[k].top_z, printer->clearance_height);
+	}
+    }
+}
+
+/* Only sized for the towers in use, every layer having MAX_TOWERS of them
+ * would make the layers many times bigger.
+ */
+
+static void
+compute_tower_layers()
+{
+    int i, j, k;
+
+    free(tower_layers);
+    tower_layers = calloc(sizeof(*tower_layers), (n_layers > 0 ? n_layers : 1) * n_towers);
+    for (i = 0; i < n_layers; i++) {
+	layer_t *l = &layers[i];
+
+	l->towers = &tower_layers[i * n_towers];
+	for (k = 0; k < n_towers; k++) l->towers[k].first = l->towers[k].last = -1;
+	for (j = l->transition0; j < l->transition0 + l->n_transitions; j++) {
+	    tower_layer_t *tl = &l->towers[transitions[j].tower];
+
+	    if (tl->first < 0) tl->first = j;
+	    tl->last = j;
+	}
+    }
+}
+
+static double
+layer_all_transition_mm(layer_t *l)
+{
+    int k;
+    double mm = 0;
+
+    for (k = 0; k < n_towers; k++) mm += layer_transition_mm(l, k);
+    return mm;
+}
+
 static void
 prune_transition_tower()
 {
     int i;
 
-    while (n_layers > 0 && layer_transition_mm(&layers[n_layers-1]) == 0) n_layers--;
+    while (n_layers > 0 && layer_all_transition_mm(&layers[n_layers-1]) == 0) n_layers--;
 
-    n_transitions = layers[n_layers-1].transition0 + layers[n_layers-1].n_transitions;
+    n_transitions = n_layers > 0 ? layers[n_layers-1].transition0 + layers[n_layers-1].n_transitions : 0;
     for (i = 0; i < n_runs; i++) {
 	if (runs[i].pre_transition > n_transitions) runs[i].pre_transition = -1;
 	if (runs[i].post_transition > n_transitions) runs[i].post_transition = -1;
     }
+    for (i = 0; i < n_alias_splices; i++) {
+	if (alias_splices[i].transition > n_transitions) alias_splices[i].transition = n_transitions;
+    }
 }
 
-static void
-place_transition_block()
+static int
+place_object(int tower, double w, double h, double z, double *x, double *y)
+{
+    transition_block_t *b = &transition_blocks[tower];
+
+    if (tower_per_object) return bed_usage_place_object_in_sequence(bed_usage, w, h, z, tower, printer->clearance_radius, b->cx, b->cy, x, y);
+    if (n_towers == 1) return bed_usage_place_object(bed_usage, w, h, z, x, y);
+    return bed_usage_place_object_near(bed_usage, w, h, z, b->cx, b->cy, x, y);
+}
+
+static int
+place_transition_block(int tower)
 {
+    transition_block_t *b = &transition_blocks[tower];
     double x, y;
-    double z = layers[n_layers-1].z;
+    double z = n_towers == 1 ? layers[n_layers-1].z : b->top_z;
     int strategy = 0;
     double size[2];
 
-    while (transition_block_size(size, strategy++)) {
+    while (transition_block_size(tower, size, strategy++)) {
 	if (size[0] > printer->nozzle*4 && size[1] > printer->nozzle*4 &&
-	    bed_usage_place_object(bed_usage, size[0], size[1], z, &x, &y)) {
-	    transition_block.x = x;
-	    transition_block.y = y;
-	    transition_block.w = size[0];
-	    transition_block.h = size[1];
-	    transition_block.area = size[0] * size[1];
-	    return;
+	    place_object(tower, size[0], size[1], z, &x, &y)) {
+	    b->x = x;
+	    b->y = y;
+	    b->w = size[0];
+	    b->h = size[1];
+	    b->area = size[0] * size[1];
+	    return 1;
 	}
 	fprintf(stderr, "Failed to place transition block %fx%f.  Aborting.\n", size[0], size[1]);
     }
 
     bed_usage_print(bed_usage, stderr);
     fprintf(stderr, "Failed to place transition block.  Aborting.\n");
-    exit(1);
+    return 0;
+}
+
+/* Each tower is added to the bed as it is placed so the next one keeps
+ * clear of it.  They come off again if the constraints move them.
+ */
+
+static int
+place_transition_blocks()
+{
+    int k;
+
+    for (k = 0; k < n_towers; k++) {
+	if (transition_blocks[k].top_z < 0) continue;
+	if (! place_transition_block(k)) return 0;
+	if (n_towers > 1) bed_usage_add_object(bed_usage, transition_blocks[k].x, transition_blocks[k].y, transition_blocks[k].w, transition_blocks[k].h, 'T');
+    }
+    return 1;
+}
+
+static void
+remove_transition_blocks()
+{
+    int k;
+
+    for (k = 0; k < n_towers && n_towers > 1; k++) {
+	if (transition_blocks[k].top_z < 0) continue;
+	bed_usage_add_object(bed_usage, transition_blocks[k].x, transition_blocks[k].y, transition_blocks[k].w, transition_blocks[k].h, 0);
+    }
+}
+
+static int
+is_bottom_layer(layer_t *l)
+{
+    return l->num == 0 || layers[l->num-1].object != l->object;
 }
 
 static double
 layer_min_density(int i)
 {
-    return (i == 0 ? printer->min_bottom_density : printer->min_density);
+    return (is_bottom_layer(&layers[i]) ? printer->min_bottom_density : printer->min_density);
 }
 
 static double
-layer_perimeter_area(layer_t *l)
+layer_perimeter_area(layer_t *l, int tower)
 {
-    return l->use_perimeter ? 2*(transition_block.w + transition_block.h)*printer->nozzle : 0;
+    transition_block_t *b = &transition_blocks[tower];
+
+    return l->towers[tower].use_perimeter ? 2*(b->w + b->h)*printer->nozzle : 0;
 }
 
 static double
-layer_perimeter_filament_len(layer_t *l)
+layer_perimeter_filament_len(layer_t *l, int tower)
 {
-    return filament_mm3_to_length(layer_perimeter_area(l)*l->h);
+    return filament_mm3_to_length(layer_perimeter_area(l, tower)*l->h);
 }
 
 static void
-compute_layer_density(layer_t *l, double *area_out)
+compute_layer_density(layer_t *l, int tower, double *area_out)
 {
-    double this_mm = layer_transition_mm(l);
+    double this_mm = layer_transition_mm(l, tower);
     double this_area = filament_length_to_mm3(this_mm) / l->h;
-    double total_area = transition_block.area;
-    double perimeter_area = layer_perimeter_area(l);
+    double total_area = transition_blocks[tower].area;
+    double perimeter_area = layer_perimeter_area(l, tower);
 
-    l->density = (this_area - perimeter_area)/ (total_area - perimeter_area);
+    l->towers[tower].density = (this_area - perimeter_area)/ (total_area - perimeter_area);
 
     if (area_out) *area_out = total_area - perimeter_area;
 }
 
+static void
+fix_splice_and_ping_constraints(transition_t *t)
+{
+    if (t->num == 0 && t->mm_pre_transition + t->pre_mm < MIN_FIRST_SPLICE_LEN) {
+	t->pre_mm += MIN_FIRST_SPLICE_LEN - (t->mm_pre_transition + t->pre_mm);
+    } else if (t->from != t->to && t->mm_pre_transition + t->pre_mm < MIN_SPLICE_LEN) {
+	double needed = MIN_SPLICE_LEN - (t->mm_pre_transition + t->pre_mm);
+	move_purge(&t->support_mm, &t->pre_mm, &needed);
+	t->pre_mm += needed;
+    }
+    if (t->ping && t->pre_mm + t->post_mm < MIN_PING_LEN) {
+	add_extra_block_purge(t, MIN_PING_LEN - (t->pre_mm + t->post_mm));
+    }
+}
+
+static int
+fix_tower_constraints(layer_t *l, int tower)
+{
+    tower_layer_t *tl = &l->towers[tower];
+    transition_t *t0 = &transitions[tl->first];
+    transition_t *t;
+    double min_density = layer_min_density(l->num);
+    double perimeter_len;
+    double area;
+
+    compute_layer_density(l, tower, &area);
+    if (is_bottom_layer(l) || tl->density <= DENSITY_FOR_PERIMETER) {
+	tl->use_perimeter = 1;
+	compute_layer_density(l, tower, &area);
+    }
+
+    perimeter_len = layer_perimeter_filament_len(l, tower);
+
+    if (tl->use_perimeter && t0->pre_mm + t0->post_mm < perimeter_len) {
+	add_extra_block_purge(t0, perimeter_len - (t0->pre_mm + t0->post_mm));
+	compute_layer_density(l, tower, &area);
+    }
+
+    for (t = t0; t <= &transitions[tl->last]; t++) {
+	if (t->tower != tower) continue;
+	fix_splice_and_ping_constraints(t);
+	compute_layer_density(l, tower, &area);
+    }
+
+    if (tl->density < min_density) {
+	double needed = filament_mm3_to_length(area * (min_density - tl->density) * l->h);
+	layer_add_extra_block_purge(l, tower, needed);
+	compute_layer_density(l, tower, &area);
+	assert(min_density -  0.01 <= tl->density && tl->density <= min_density + 0.01);
+    }
+
+    return tl->density <= 1.001;
+}
+
 static int
 fix_constraints()
 {
-    int i, j;
+    int i, k;
     layer_t *l;
     int bad = 0;
 
     for (l = layers, i = 0; i < n_layers; i++, l++) {
-	transition_t *t0 = &transitions[l->transition0];
-	transition_t *t;
-	double min_density = layer_min_density(i);
-	double perimeter_len;
-	double area;
-
-	compute_layer_density(l, &area);
-	if (i == 0 || l->density <= DENSITY_FOR_PERIMETER) {
-	    l->use_perimeter = 1;
-	    compute_layer_density(l, &area);
+	for (k = 0; k < n_towers; k++) {
+	    if (l->towers[k].first >= 0 && ! fix_tower_constraints(l, k)) bad = 1;
 	}
+    }
+
+    return ! bad;
+}
+
+/* Global purge allocation.
+ *
+ * Instead of moving as much purge as possible into the infill and support
+ * one transition at a time, decide it over the whole print.  Purge moved
+ * out of the tower only saves filament while the tower layer is above its
+ * minimum density and the tower's size is set by its fullest layer, so
+ * for each candidate block area:
+ *   - extend the transitions that make splices too short,
+ *   - move purge out of the tower only where that layer has purge above
+ *     the minimum density, the splices it shortens have length to spare
+ *     and pinged transitions keep enough purge to ping,
+ *   - and the cost is the total filament in the tower, infinite if a
+ *     layer no longer fits.
+ * The cheapest area wins and its allocation is kept.
+ */
 
-	perimeter_len = layer_perimeter_filament_len(l);
+#define GLOBAL_PURGE_AREAS	32
 
-	if (l->use_perimeter && t0->pre_mm + t0->post_mm < perimeter_len) {
-	    add_extra_block_purge(t0, perimeter_len - (t0->pre_mm + t0->post_mm));
-	    compute_layer_density(l, &area);
-	}
+typedef struct {
+    double pre, post;
+    double infill, support;
+} purge_plan_t;
 
-	for (t = t0, j = 0; j < l->n_transitions; t++, j++) {
-	    if (t->num == 0 && t->mm_pre_transition + t->pre_mm < MIN_FIRST_SPLICE_LEN) {
-		t->pre_mm += MIN_FIRST_SPLICE_LEN - (t->mm_pre_transition + t->pre_mm);
-	    } else if (t->from != t->to && t->mm_pre_transition + t->pre_mm < MIN_SPLICE_LEN) {
-		double needed = MIN_SPLICE_LEN - (t->mm_pre_transition + t->pre_mm);
-		move_purge(&t->support_mm, &t->pre_mm, &needed);
-		t->pre_mm += needed;
-	    }
-	    if (t->ping && t->pre_mm + t->post_mm < MIN_PING_LEN) {
-		add_extra_block_purge(t, MIN_PING_LEN - (t->pre_mm + t->post_mm));
+static int
+is_splice_transition(transition_t *t)
+{
+    return t->num == 0 || t->from != t->to;
+}
+
+static double
+min_splice_len(transition_t *t)
+{
+    return t->num == 0 ? MIN_FIRST_SPLICE_LEN : MIN_SPLICE_LEN;
+}
+
+static void
+compute_mm_pre_transition(purge_plan_t *plan)
+{
+    double since_splice = 0;
+    int i;
+
+    for (i = 0; i < n_transitions; i++) {
+	transition_t *t = &transitions[i];
+
+	t->mm_pre_transition = since_splice + t->mm_from_runs;
+	if (t->from != t->to) since_splice = plan[i].post;
+	else since_splice += plan[i].pre + plan[i].post;
+    }
+}
+
+static double
+plan_purge(double area, purge_plan_t *plan, double *slack, int *next_splice)
+{
+    double *tower = malloc(sizeof(*tower) * n_layers);
+    double *surplus = malloc(sizeof(*surplus) * n_layers);
+    double cost = 0;
+    double since_splice = 0;
+    int i, j;
+
+    for (i = 0; i < n_transitions; i++) {
+	transition_t *t = &transitions[i];
+	double mm_pre_transition = since_splice + t->mm_from_runs;
+
+	plan[i].pre = t->pre_mm;
+	plan[i].post = t->post_mm;
+	plan[i].infill = plan[i].support = 0;
+
+	if (is_splice_transition(t)) {
+	    slack[i] = mm_pre_transition + plan[i].pre - min_splice_len(t);
+	    if (slack[i] < 0) {
+		plan[i].pre -= slack[i];
+		slack[i] = 0;
 	    }
-	    compute_layer_density(l, &area);
 	}
 
-	if (l->density < min_density) {
-	    double needed = filament_mm3_to_length(area * (min_density - l->density) * l->h);
-	    layer_add_extra_block_purge(l, needed);
-	    compute_layer_density(l, &area);
-	    assert(min_density -  0.01 <= l->density && l->density <= min_density + 0.01);
+	if (t->from != t->to) since_splice = plan[i].post;
+	else since_splice += plan[i].pre + plan[i].post;
+    }
+
+    for (i = 0; i < n_layers; i++) {
+	layer_t *l = &layers[i];
+
+	tower[i] = 0;
+	for (j = l->transition0; j < l->transition0 + l->n_transitions; j++) tower[i] += plan[j].pre + plan[j].post;
+	surplus[i] = tower[i] - filament_mm3_to_length(layer_min_density(i) * area * l->h);
+    }
+
+    for (i = 0; i < n_layers; i++) {
+	layer_t *l = &layers[i];
+
+	for (j = l->transition0; j < l->transition0 + l->n_transitions; j++) {
+	    transition_t *t = &transitions[j];
+	    purge_plan_t *p = &plan[j];
+	    double *pre_slack = is_splice_transition(t) ? &slack[j] : next_splice[j] >= 0 ? &slack[next_splice[j]] : NULL;
+	    double *post_slack = next_splice[j] >= 0 ? &slack[next_splice[j]] : NULL;
+	    double budget = fmin(surplus[i], p->pre + p->post - (t->ping ? MIN_PING_LEN : 0));
+	    double infill = t->avail_infill, support = t->avail_support;
+	    double x;
+
+	    if (budget <= 0) continue;
+
+	    x = fmin(fmin(p->pre, infill), fmin(budget, pre_slack ? *pre_slack : budget));
+	    p->pre -= x; p->infill += x; infill -= x; budget -= x;
+	    if (pre_slack) *pre_slack -= x;
+
+	    x = fmin(fmin(p->post, support), fmin(budget, post_slack ? *post_slack : budget));
+	    p->post -= x; p->support += x; support -= x; budget -= x;
+	    if (post_slack) *post_slack -= x;
+
+	    x = fmin(fmin(p->post, infill), fmin(budget, post_slack ? *post_slack : budget));
+	    p->post -= x; p->infill += x; infill -= x; budget -= x;
+	    if (post_slack) *post_slack -= x;
+
+	    x = fmin(fmin(p->pre, support), fmin(budget, pre_slack ? *pre_slack : budget));
+	    p->pre -= x; p->support += x; support -= x; budget -= x;
+	    if (pre_slack) *pre_slack -= x;
+
+	    tower[i] -= p->infill + p->support;
+	    surplus[i] -= p->infill + p->support;
+	}
+    }
+
+    for (i = 0; i < n_layers && isfinite(cost); i++) {
+	double floor = filament_mm3_to_length(layer_min_density(i) * area * layers[i].h);
+
+	if (filament_length_to_mm3(tower[i]) / layers[i].h > area * (1 + EPSILON)) cost = INFINITY;
+	else cost += fmax(tower[i], floor);
+    }
+
+    free(tower);
+    free(surplus);
+    return cost;
+}
+
+static void
+optimize_purge()
+{
+    purge_plan_t *plan = malloc(sizeof(*plan) * n_transitions);
+    purge_plan_t *best_plan = malloc(sizeof(*best_plan) * n_transitions);
+    double *slack = malloc(sizeof(*slack) * n_transitions);
+    int *next_splice = malloc(sizeof(*next_splice) * n_transitions);
+    double max_area, best_area = 0, best_cost = INFINITY;
+    int i, next;
+
+    for (i = n_transitions-1, next = -1; i >= 0; i--) {
+	next_splice[i] = next;
+	if (is_splice_transition(&transitions[i])) next = i;
+    }
+
+    max_area = transition_block_area(0);
+    for (i = 0; i < n_layers; i++) {
+	/* Fixing the splice lengths can only grow a layer by the longest splice */
+	double la = filament_length_to_mm3(layer_transition_mm(&layers[i], 0) + MIN_FIRST_SPLICE_LEN) / layers[i].h;
+	if (la > max_area) max_area = la;
+    }
+
+    for (i = 1; i <= GLOBAL_PURGE_AREAS; i++) {
+	double area = max_area * i / GLOBAL_PURGE_AREAS;
+	double cost = plan_purge(area, plan, slack, next_splice);
+
+	if (cost < best_cost) {
+	    purge_plan_t *tmp = best_plan;
+	    best_plan = plan;
+	    plan = tmp;
+	    best_cost = cost;
+	    best_area = area;
 	}
+    }
+
+    assert(isfinite(best_cost));
 
-	bad = bad || l->density > 1.001;
+    for (i = 0; i < n_transitions; i++) {
+	transition_t *t = &transitions[i];
+
+	t->pre_mm = best_plan[i].pre;
+	t->post_mm = best_plan[i].post;
+	t->infill_mm = best_plan[i].infill;
+	t->support_mm = best_plan[i].support;
+	t->avail_infill -= t->infill_mm;
+	t->avail_support -= t->support_mm;
     }
+    compute_mm_pre_transition(best_plan);
 
-    return ! bad;
+    fprintf(report_out, "Global purge allocation: %.2f mm in a %.2f mm^2 tower\n", best_cost, best_area);
+
+    free(plan);
+    free(best_plan);
+    free(slack);
+    free(next_splice);
+}
+
+static int
+check_tower_is_supported()
+{
+    int i;
+
+    for (i = 0; i < n_layers; i++) {
+	if (layers[i].h > printer->max_layer_height + EPSILON) {
+	    fprintf(stderr, "Tower layer at z=%f is %f tall but the maximum layer height is %f.  Aborting.\n", layers[i].z, layers[i].h, printer->max_layer_height);
+	    return 0;
+	}
+    }
+    return 1;
 }
 
 #define MAX_PRIME_LINES	20
@@ -442,7 +1248,7 @@ place_prime()
 	    prime_info.x   = x;
 	    prime_info.y   = y;
 	    prime_info.e   = filament_mm3_to_length(w * printer->nozzle * layers[0].h);
-	    printf("Placed priming at %f,%f with %d lines of length %f\n", x, y, n, w);
+	    fprintf(report_out, "Placed priming at %f,%f with %d lines of length %f\n", x, y, n, w);
 	    return;
 	}
     }
@@ -450,23 +1256,89 @@ place_prime()
     fprintf(stderr, "WARNING: failed to place purge lines\n");
 }
 
-void
+int
 transition_block_create_from_runs()
 {
     int iterations = 0;
+    int requested_towers = n_towers;
+
+    memset(layers, 0, sizeof(layers[0]) * n_layers);
+    memset(transitions, 0, sizeof(transitions[0]) * n_transitions);
+    n_layers = n_transitions = 0;
+    memset(transition_blocks, 0, sizeof(transition_blocks));
+    memset(&prime_info, 0, sizeof(prime_info));
+    n_towers = 1;
+    tower_per_object = n_objects > 1 && ! printer->side_transitions;
+    if (requested_towers > 1 && printer->side_transitions) {
+	fprintf(stderr, "WARNING: side transitions don't use a tower, ignoring the number of towers\n");
+	requested_towers = 1;
+    }
+    if (tower_per_object && n_objects > MAX_TOWERS) {
+	fprintf(stderr, "Sequential print has %d objects but only %d are supported.  Aborting.\n", n_objects, MAX_TOWERS);
+	return 0;
+    }
+    if (requested_towers > 1 && tower_per_object) {
+	fprintf(stderr, "WARNING: sequential prints have a tower per object, ignoring the number of towers\n");
+	requested_towers = 1;
+    }
+    if ((requested_towers > 1 || tower_per_object) && global_purge) {
+	fprintf(stderr, "WARNING: global purge only supports a single tower, ignoring it\n");
+	global_purge = 0;
+    }
+
+    alias_drives();
+    if (tower_per_object) setup_object_towers();
     compute_transition_tower();
+    if (tower_per_object) centre_object_towers();
+    if (requested_towers > 1 && n_transitions > 0) distribute_transitions(requested_towers);
     prune_transition_tower();
-    if (n_transitions > 0) {
+    compute_tower_layers();
+    if (tower_per_object) check_object_towers_clear_gantry();
+    if (sparse_tower && ! printer->side_transitions && ! check_tower_is_supported()) return 0;
+    if (n_transitions > 0 && global_purge) optimize_purge();
+    if (n_transitions > 0 && printer->side_transitions) {
+	int i;
+
+	for (i = 0; i < n_transitions; i++) fix_splice_and_ping_constraints(&transitions[i]);
+    } else if (n_transitions > 0) {
 	do {
-	    iterations++;
-	    place_transition_block();
+	    if (iterations++ > 0) remove_transition_blocks();
+	    if (! place_transition_blocks()) return 0;
 	} while (! fix_constraints());
-	bed_usage_add_object(bed_usage, transition_block.x, transition_block.y, transition_block.w, transition_block.h, 'T');
-	printf("It took %d iterations to stabilize the block\n", iterations);
+	if (n_towers == 1) bed_usage_add_object(bed_usage, transition_blocks[0].x, transition_blocks[0].y, transition_blocks[0].w, transition_blocks[0].h, 'T');
+	fprintf(report_out, "It took %d iterations to stabilize the block\n", iterations);
     } else {
 	transition_final_waste = 0;
     }
     if (printer->prime_mm > 0) place_prime();
+    return 1;
+}
+
+/* Add up to mm of purge before the splice, limited by the room left in
+ * the tower layer, and return how much was added.
+ */
+
+double
+transition_block_lengthen(transition_t *t, double mm)
+{
+    layer_t *l;
+    double area;
+
+    if (printer->side_transitions) {
+	t->pre_mm += mm;
+	return mm;
+    }
+
+    for (l = layers; l < &layers[n_layers-1] && t->num >= l->transition0 + l->n_transitions; l++) {}
+
+    compute_layer_density(l, t->tower, &area);
+    if (l->towers[t->tower].density >= 1) return 0;
+
+    mm = fmin(mm, filament_mm3_to_length(area * (1 - l->towers[t->tower].density) * l->h));
+    t->pre_mm += mm;
+    compute_layer_density(l, t->tower, NULL);
+
+    return mm;
 }
 
 void
@@ -483,9 +1355,14 @@ transition_block_dump_transitions(FILE *o)
     fprintf(o, "Transitions\n");
     fprintf(o, "-----------\n");
     for (l = layers, i = 0; i < n_layers; l++, i++) {
-	fprintf(o, "z=%-8.2f h=%-4.2f density=%-4.2f %9s ", l->z, l->h, l->density, l->use_perimeter ? "perimeter" : "");
+	fprintf(o, "z=%-8.2f h=%-4.2f ", l->z, l->h);
 	for (t = &transitions[l->transition0], j = 0; j < l->n_transitions; t++, j++) {
-	    if (j > 0) fprintf(o, "%41c", ' ');
+	    tower_layer_t *tl = &l->towers[t->tower];
+
+	    if (j > 0) fprintf(o, "%18c", ' ');
+	    if (j == 0 || n_towers > 1) fprintf(o, "density=%-4.2f %9s ", tl->density, tl->use_perimeter ? "perimeter" : "");
+	    else fprintf(o, "%23c", ' ');
+	    if (n_towers > 1) fprintf(o, "[%d] ", t->tower);
 	    fprintf(o, "t%d -> t%d ||| %7.2f -> %6.2f [ %6.2f || %6.2f ] %-6.2f%s", t->from, t->to, t->mm_from_runs, t->infill_mm, t->pre_mm, t->post_mm, t->support_mm, t->ping ? " ping" : "     ");
 	    if (t->from != t->to) mm[t->from] += t->mm_from_runs;
 	    waste[t->from] += t->pre_mm;
@@ -508,3 +1385,65 @@ transition_block_dump_transitions(FILE *o)
 	}
     }
 }
+
+/* The pass over the gcode makes the splices and pings that were planned,
+ * so what the plan says is enough to tell whether the print can be made:
+ * every splice is long enough and no tower layer is over full or, when
+ * layers are combined, taller than the printer can print.  A tower that
+ * can't be placed has already failed transition_block_create_from_runs().
+ */
+
+int
+transition_block_validate(FILE *o)
+{
+    double shortest = INFINITY, shortest_min = 0;
+    double densest = 0, tallest = 0;
+    int n_splices = n_alias_splices + 1, n_pings = n_planned_pings;
+    int ok = 1;
+    int i, k;
+
+    for (i = 0; i < n_transitions; i++) {
+	transition_t *t = &transitions[i];
+	double len = t->mm_pre_transition + t->pre_mm;
+
+	if (t->ping) n_pings++;
+	if (t->from == t->to) continue;
+	n_splices++;
+	if (len - min_splice_len(t) < shortest - shortest_min) {
+	    shortest = len;
+	    shortest_min = min_splice_len(t);
+	}
+    }
+    for (i = 0; i < n_layers; i++) {
+	for (k = 0; k < n_towers && ! printer->side_transitions; k++) {
+	    if (layers[i].towers[k].first >= 0) densest = fmax(densest, layers[i].towers[k].density);
+	}
+	if (layers[i].n_transitions > 0) tallest = fmax(tallest, layers[i].h);
+    }
+
+    fprintf(o, "transition layers: %d\n", n_transitions);
+    fprintf(o, "number of splices: %d\n", n_splices);
+    fprintf(o, "number of pings:   %d\n", n_pings);
+    if (isfinite(shortest)) {
+	fprintf(o, "shortest splice:   %.2f mm (at least %.0f mm)\n", shortest, shortest_min);
+	if (shortest < shortest_min - 0.01) ok = 0;
+    }
+    if (n_transitions > 0 && ! printer->side_transitions) {
+	fprintf(o, "densest layer:     %.2f\n", densest);
+	if (densest > 1.001) ok = 0;
+	if (sparse_tower) {
+	    fprintf(o, "tallest layer:     %.2f mm (at most %.2f mm)\n", tallest, printer->max_layer_height);
+	    if (tallest > printer->max_layer_height + EPSILON) ok = 0;
+	}
+	for (k = 0; k < n_towers; k++) {
+	    transition_block_t *b = &transition_blocks[k];
+	    if (b->top_z < 0) continue;
+	    fprintf(o, "transition block:  (%.2f, %.2f) x (%.2f, %.2f)", b->x, b->y, b->w, b->h);
+	    if (n_towers > 1) fprintf(o, " up to z=%.2f", b->top_z);
+	    fprintf(o, "\n");
+	}
+    }
+    fprintf(o, "validation:        %s\n", ok ? "ok" : "failed");
+
+    return ok;
+}
@@ -3,14 +3,22 @@
 
 #include "gcode.h"
 
+#define MAX_TOWERS	16
+
+typedef struct {
+    double density;
+    int    use_perimeter;
+    int    first, last;	/* this tower's transitions in the layer, -1 if none */
+} tower_layer_t;
+
 typedef struct {
     int    num;
+    int    object;
     double z;
     double h;
     int transition0;
     int n_transitions;
-    double density;
-    int    use_perimeter;
+    tower_layer_t *towers;	/* n_towers of them, once the towers are known */
 } layer_t;
 
 typedef struct {
@@ -25,15 +33,28 @@ typedef struct {
     double avail_infill;
     double avail_support;
     int ping;
+    double speed_multiplier;
+    double total_mm;
     int next_move_no_extrusion;
     int needs_retraction;
+    int tower;
+    double x, y;		/* where the nozzle is when the transition starts */
 } transition_t;
 
 typedef struct {
     double x, y, w, h;
     double area;
+    double top_z;
+    double cx, cy;		/* the centre of the transitions it serves */
 } transition_block_t;
 
+typedef struct {
+    int transition;		/* the splice comes before this transition */
+    int drive;
+    long offset;
+    double mm;			/* filament used since the previous splice */
+} alias_splice_t;
+
 typedef struct {
     double x, y, e;
     int n;
@@ -44,15 +65,31 @@ extern layer_t layers[MAX_RUNS];
 extern int n_layers;
 extern transition_t transitions[MAX_RUNS];
 extern int n_transitions;
-extern transition_block_t transition_block;
+extern transition_block_t transition_blocks[MAX_TOWERS];
+extern int n_towers;
 extern double transition_final_mm;
 extern double transition_final_waste;
+extern int transition_final_drive;
+extern alias_splice_t alias_splices[MAX_RUNS];
+extern int n_alias_splices;
 extern prime_info_t prime_info;
+extern double planned_pings[MAX_RUNS];
+extern int n_planned_pings;
+extern double ping_extra_purge_mm;
 
 extern int reduce_pings;
+extern int sparse_tower;
+extern int ping_in_object;
+extern int global_purge;
 
-void transition_block_create_from_runs();
+/* Returns 0 if there's no tower that can be printed */
+int transition_block_create_from_runs();
 
 void transition_block_dump_transitions(FILE *o);
 
+/* Report whether the planned transitions can be printed, returns 0 if not */
+int transition_block_validate(FILE *o);
+
+double transition_block_lengthen(transition_t *t, double mm);
+
 #endif
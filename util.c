@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+
+int
+find_arg(const char *buf, char arg, double *val)
+{
+    const char *p;
+
+    for (p = buf; *p && *p != ';'; p++) {
+	if (*p == arg && (p == buf || p[-1] == ' ')) return sscanf(p+1, "%lf", val) == 1;
+    }
+    return 0;
+}
+
+unsigned long long
+hash_bytes(unsigned long long h, const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= c[i];
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int
+ends_with(const char *str, const char *suffix)
+{
+    int len_str = strlen(str);
+    int len_suffix = strlen(suffix);
+
+    return len_str > len_suffix && strcmp(&str[len_str - len_suffix], suffix) == 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __UTIL_H__
+#define __UTIL_H__
+
+#include <stddef.h>
+
+/* The value of the word starting with arg in a line of gcode, ignoring a
+ * trailing comment.  Returns 0 if there isn't one.
+ */
+int find_arg(const char *buf, char arg, double *val);
+
+/* FNV-1a, start with h = 0xcbf29ce484222325ULL */
+unsigned long long hash_bytes(unsigned long long h, const void *p, size_t len);
+
+#define HASH(h, v) hash_bytes(h, &(v), sizeof(v))
+
+int ends_with(const char *str, const char *suffix);
+
+#endif